@@ -0,0 +1,138 @@
+/*
+ * What the PMM needs from the rest of the kernel, implemented on top of Linux.
+ *
+ * Physical memory is never touched: memblock_map backs the metadata with
+ * anonymous memory at the virtual address the PMM asked for (the link uses
+ * --wrap=memblock_map), and page frames only exist through their descriptors.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+// kprintf.h declares puts and putchar with the kernel prototypes
+#define puts libc_puts
+#define putchar libc_putchar
+#include <stdio.h>
+#undef puts
+#undef putchar
+
+#include "arch/percpu.h"
+#include "libk/kprintf.h"
+#include "libk/log.h"
+#include "libk/mem.h"
+#include "libk/panic.h"
+#include "mm/memblock.h"
+#include "mm/pmm.h"
+#include "mm/zero_pool.h"
+#include "utils.h"
+
+void __wrap_memblock_map(u64 virt_addr, u64 phys_addr, u64 size);
+
+__thread percpu_t bench_cpu;
+
+// Referenced by memblock_init, which the benchmark does not call
+u64 _sboot, _eboot, _skern, _ekern;
+
+// Stands for the frame cleared by zero_pool_clear_frame, one per CPU like the
+// windows of the kernel
+static __thread u8 scratch_page[PAGE_SIZE];
+
+void percpu_init(u32 cpu_id) {
+    bench_cpu.self = &bench_cpu;
+    bench_cpu.id = cpu_id;
+    bench_cpu.node = 0;
+}
+
+void __wrap_memblock_map(u64 virt_addr, u64 phys_addr, u64 size) {
+    (void)phys_addr;
+
+    void *addr = mmap((void *)virt_addr, ALIGN_UP(size, PAGE_SIZE),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (addr != (void *)virt_addr) {
+        kpanic("bench: Cannot map the PMM metadata at 0x%016lx\n", virt_addr);
+    }
+}
+
+// The zero pool is never refilled: pmm_alloc_zeroed always clears a frame on
+// the spot, which costs as much as clearing the scratch page
+void zero_pool_init(void) {
+}
+
+bool zero_pool_pop(u64 *frame_addr) {
+    (void)frame_addr;
+
+    return false;
+}
+
+void zero_pool_refill(void) {
+}
+
+void zero_pool_clear_frame(u64 frame_addr) {
+    (void)frame_addr;
+
+    memset(scratch_page, 0, PAGE_SIZE);
+}
+
+u64 zero_pool_count(void) {
+    return 0;
+}
+
+bool zero_pool_push_dirty(u64 frame_addr) {
+    (void)frame_addr;
+
+    return false;
+}
+
+u64 zero_pool_drain_dirty(void) {
+    return 0;
+}
+
+u64 zero_pool_num_dirty(void) {
+    return 0;
+}
+
+void puts(const char *str) {
+    fputs(str, stdout);
+}
+
+void putchar(char c) {
+    fputc(c, stdout);
+}
+
+void kprintf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stdout, fmt, ap);
+    va_end(ap);
+}
+
+void kvprintf(const char *fmt, va_list ap) {
+    vfprintf(stdout, fmt, ap);
+}
+
+// Only warnings and errors are printed, to stderr to keep the report readable
+enum log_level log_levels[LOG_NUM_SUBSYSTEMS] = {
+    [0 ... LOG_NUM_SUBSYSTEMS - 1] = LOG_LEVEL_WARN,
+};
+
+void log_print(enum log_level level, const char *fmt, ...) {
+    (void)level;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+noreturn void kpanic(const char *fmt, ...) {
+    fflush(stdout);
+
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    abort();
+}
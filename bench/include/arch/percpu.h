@@ -0,0 +1,38 @@
+#ifndef AVOCADOS_PERCPU_H_
+#define AVOCADOS_PERCPU_H_
+
+/*
+ * Host replacement of src/arch/percpu.h: each thread of a benchmark plays the
+ * part of a CPU, so the per-CPU area is thread local rather than found through
+ * the GS base. Threads call percpu_init with their CPU number before anything
+ * else.
+ */
+
+#include <stddef.h>
+
+#include "attributes.h"
+#include "types.h"
+
+#define MAX_CPUS 16
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct percpu {
+    struct percpu *self;
+    u32 id;
+    u32 node;
+} __align(CACHE_LINE_SIZE) percpu_t;
+
+extern __thread percpu_t bench_cpu;
+
+void percpu_init(u32 cpu_id);
+
+static inline percpu_t *this_cpu(void) {
+    return &bench_cpu;
+}
+
+static inline u32 cpu_id(void) {
+    return bench_cpu.id;
+}
+
+#endif /* ! AVOCADOS_PERCPU_H_ */
@@ -0,0 +1,261 @@
+/*
+ * Host benchmark of libk/mem.c. Each routine is run on sizes from 1 B to
+ * 1 MiB, next to the byte loops it replaced, and the time per call and the
+ * throughput are reported. Buffers are reused from one call to the next, so
+ * everything up to the size of the caches is measured hot.
+ *
+ * clear_page and copy_page are compared with memset and memcpy over a buffer
+ * larger than the last level cache, where the non-temporal stores pay off.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "arch/alternative.h"
+#include "arch/cpu_features.h"
+#include "arch/paging.h"
+#include "libk/mem.h"
+#include "types.h"
+#include "utils.h"
+
+#define BENCH_MIN_SIZE 1UL
+#define BENCH_MAX_SIZE (1UL << 20)
+// Bytes processed for each size and routine, the number of calls follows
+#define BENCH_DEFAULT_BYTES (256UL << 20)
+#define BENCH_MIN_CALLS 1000UL
+#define BENCH_DEFAULT_PAGES_MIB 256UL
+
+typedef enum {
+    BENCH_MEMSET,
+    BENCH_MEMCPY,
+    BENCH_MEMMOVE,
+    BENCH_MEMCMP,
+    BENCH_NUM_ROUTINES,
+} bench_routine_t;
+
+static const char *const routine_names[BENCH_NUM_ROUTINES] = {
+    "memset",
+    "memcpy",
+    "memmove",
+    "memcmp",
+};
+
+static u8 *src_buf;
+static u8 *dst_buf;
+
+static bool make_text_writable(void);
+static double bench_routine(bench_routine_t routine, bool reference, u64 size,
+                            u64 num_calls);
+static void bench_pages(u64 size);
+static void byte_memset(u8 *mem, u8 value, u64 n);
+static void byte_memcpy(u8 *dst, const u8 *src, u64 n);
+static void byte_memmove(u8 *dst, const u8 *src, u64 n);
+static int byte_memcmp(const u8 *s1, const u8 *s2, u64 n);
+static u64 now_ns(void);
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-b BYTES] [-p MIB]\n"
+            "  -b  Bytes processed for each size (default %lu)\n"
+            "  -p  MiB cleared and copied by page (default %lu)\n",
+            name, BENCH_DEFAULT_BYTES, BENCH_DEFAULT_PAGES_MIB);
+}
+
+int main(int argc, char **argv) {
+    u64 num_bytes = BENCH_DEFAULT_BYTES;
+    u64 pages_mib = BENCH_DEFAULT_PAGES_MIB;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            num_bytes = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            pages_mib = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (pages_mib == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The call sites of mem.c are patched like in the kernel
+    cpu_features_init();
+    if (!make_text_writable()) {
+        return EXIT_FAILURE;
+    }
+    alternatives_apply();
+    printf("%s string instructions\n",
+           cpu_has(CPU_FEATURE_ERMS) ? "Enhanced" : "Quadword");
+
+    // Room for memmove to shift by one byte
+    src_buf = aligned_alloc(PAGE_SIZE, 2 * BENCH_MAX_SIZE);
+    dst_buf = aligned_alloc(PAGE_SIZE, 2 * BENCH_MAX_SIZE);
+    for (u64 i = 0; i < 2 * BENCH_MAX_SIZE; ++i) {
+        src_buf[i] = (u8)i;
+        dst_buf[i] = (u8)i;
+    }
+
+    printf("%-8s %8s %12s %12s %10s %8s\n", "routine", "size", "ns/call",
+           "bytewise", "GB/s", "speedup");
+    for (u32 routine = 0; routine < BENCH_NUM_ROUTINES; ++routine) {
+        for (u64 size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+            u64 num_calls = num_bytes / size;
+            if (num_calls < BENCH_MIN_CALLS) {
+                num_calls = BENCH_MIN_CALLS;
+            }
+
+            double ns = bench_routine(routine, false, size, num_calls);
+            double byte_ns = bench_routine(routine, true, size, num_calls);
+            printf("%-8s %8lu %12.2f %12.2f %10.2f %7.1fx\n",
+                   routine_names[routine], size, ns, byte_ns,
+                   (double)size / ns, byte_ns / ns);
+        }
+    }
+
+    bench_pages(pages_mib << 20);
+
+    return EXIT_SUCCESS;
+}
+
+// alternatives_apply writes to the code of the benchmark
+static bool make_text_writable(void) {
+    // Defined by the default linker script of GNU ld
+    extern u8 __executable_start[], etext[];
+
+    u64 start = ALIGN_DOWN((u64)__executable_start, PAGE_SIZE);
+    u64 end = ALIGN_UP((u64)etext, PAGE_SIZE);
+    if (mprotect((void *)start, end - start,
+                 PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+        perror("mprotect");
+        return false;
+    }
+
+    return true;
+}
+
+// Return the time per call in ns. memmove copies to the buffer it reads,
+// shifted by one byte, so that it takes its backward path.
+static double bench_routine(bench_routine_t routine, bool reference, u64 size,
+                            u64 num_calls) {
+    int sink = 0;
+
+    u64 start_ns = now_ns();
+    for (u64 i = 0; i < num_calls; ++i) {
+        switch (routine) {
+        case BENCH_MEMSET:
+            (reference ? byte_memset : memset)(dst_buf, (u8)i, size);
+            break;
+        case BENCH_MEMCPY:
+            (reference ? byte_memcpy : memcpy)(dst_buf, src_buf, size);
+            break;
+        case BENCH_MEMMOVE:
+            (reference ? byte_memmove : memmove)(dst_buf + 1, dst_buf, size);
+            break;
+        case BENCH_MEMCMP:
+            sink += (reference ? byte_memcmp : memcmp)(dst_buf, dst_buf, size);
+            break;
+        default:
+            abort();
+        }
+    }
+    u64 elapsed_ns = now_ns() - start_ns;
+
+    // Keep memcmp from being optimized out
+    __asm__ volatile("" : : "r"(sink));
+
+    return (double)elapsed_ns / (double)num_calls;
+}
+
+// Clear then copy size bytes page by page, with the non-temporal routines and
+// with memset and memcpy
+static void bench_pages(u64 size) {
+    u8 *src = aligned_alloc(PAGE_SIZE, size);
+    u8 *dst = aligned_alloc(PAGE_SIZE, size);
+    // Fault the buffers in before timing anything
+    memset(src, 1, size);
+    memset(dst, 1, size);
+
+    u64 start_ns = now_ns();
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        clear_page(dst + offset);
+    }
+    u64 clear_ns = now_ns() - start_ns;
+
+    start_ns = now_ns();
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        memset(dst + offset, 0, PAGE_SIZE);
+    }
+    u64 memset_ns = now_ns() - start_ns;
+
+    start_ns = now_ns();
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        copy_page(dst + offset, src + offset);
+    }
+    u64 copy_ns = now_ns() - start_ns;
+
+    start_ns = now_ns();
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        memcpy(dst + offset, src + offset, PAGE_SIZE);
+    }
+    u64 memcpy_ns = now_ns() - start_ns;
+
+    u64 num_pages = size / PAGE_SIZE;
+    printf("\n%lu pages, ns/page:\n", num_pages);
+    printf("clear_page %8.1f   memset %8.1f\n",
+           (double)clear_ns / (double)num_pages,
+           (double)memset_ns / (double)num_pages);
+    printf("copy_page  %8.1f   memcpy %8.1f\n",
+           (double)copy_ns / (double)num_pages,
+           (double)memcpy_ns / (double)num_pages);
+
+    free(src);
+    free(dst);
+}
+
+// The implementations mem.c had before the string instructions
+__attribute__((noinline)) static void byte_memset(u8 *mem, u8 value, u64 n) {
+    for (u64 i = 0; i < n; ++i) {
+        mem[i] = value;
+    }
+}
+
+__attribute__((noinline)) static void byte_memcpy(u8 *dst, const u8 *src,
+                                                  u64 n) {
+    for (u64 i = 0; i < n; ++i) {
+        dst[i] = src[i];
+    }
+}
+
+__attribute__((noinline)) static void byte_memmove(u8 *dst, const u8 *src,
+                                                   u64 n) {
+    for (u64 i = n; i > 0; --i) {
+        dst[i - 1] = src[i - 1];
+    }
+}
+
+__attribute__((noinline)) static int byte_memcmp(const u8 *s1, const u8 *s2,
+                                                 u64 n) {
+    for (u64 i = 0; i < n; ++i) {
+        if (s1[i] != s2[i]) {
+            return (int)s1[i] - (int)s2[i];
+        }
+    }
+
+    return 0;
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * 1000000000UL + (u64)ts.tv_nsec;
+}
@@ -0,0 +1,574 @@
+/*
+ * Host benchmark of the PMM. pmm.c and the allocators below it are built for
+ * Linux (see host.c), given a range of fake physical memory through memblock,
+ * then a trace of allocations and frees is replayed. Every call is timed with
+ * the TSC and the latency percentiles of each kind of call are reported.
+ *
+ * Traces are text files with one call per line, '#' starts a comment:
+ *   a ID              pmm_alloc
+ *   z ID              pmm_alloc_zeroed
+ *   p ID ORDER        pmm_alloc_pages
+ *   b ID NUM          pmm_alloc_batch, NUM <= BENCH_MAX_BATCH
+ *   c ID NUM ALIGN    pmm_alloc_contig without address limit
+ *   k ID COLOR        pmm_alloc_colored, COLOR modulo pmm_num_colors()
+ *   f ID              Free ID with the call matching its allocation
+ * An ID names an allocation from the call that makes it to the one that frees
+ * it. Freeing a failed allocation is not a call, so it is not timed.
+ *
+ * Synthetic workloads are generated as traces, so they can be written with -o
+ * and replayed later against another version of the PMM.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "arch/percpu.h"
+#include "mm/memblock.h"
+#include "mm/pmm.h"
+#include "types.h"
+
+// Fake physical memory starts above the first MiB, like on a PC
+#define BENCH_PHYS_BASE 0x100000UL
+#define BENCH_DEFAULT_MEM_MIB 1024UL
+#define BENCH_DEFAULT_NUM_OPS 1000000UL
+
+#define BENCH_MAX_BATCH 64
+// Number of IDs in use at the same time by the churn workload
+#define BENCH_CHURN_SLOTS 4096
+// Number of frames allocated before being freed by the lifo workload
+#define BENCH_LIFO_DEPTH 256
+// Number of allocations of each order tried by the fragment workload
+#define BENCH_FRAGMENT_TRIES 1024
+
+typedef enum {
+    BENCH_ALLOC,
+    BENCH_ALLOC_ZEROED,
+    BENCH_ALLOC_PAGES,
+    BENCH_ALLOC_BATCH,
+    BENCH_ALLOC_CONTIG,
+    BENCH_ALLOC_COLORED,
+    BENCH_NUM_ALLOC_KINDS,
+    BENCH_FREE = BENCH_NUM_ALLOC_KINDS,
+} bench_kind_t;
+
+// Latencies are reported for each allocation kind and for the free of each
+// allocation kind
+#define BENCH_NUM_STATS (2 * BENCH_NUM_ALLOC_KINDS)
+
+static const char *const stat_names[BENCH_NUM_STATS] = {
+    "alloc",       "alloc_zeroed", "alloc_pages",   "alloc_batch",
+    "alloc_contig", "alloc_colored",
+    "free",        "free_zeroed",  "free_pages",    "free_batch",
+    "free_contig", "free_colored",
+};
+
+static const char trace_letters[] = { 'a', 'z', 'p', 'b', 'c', 'k', 'f' };
+
+typedef struct {
+    bench_kind_t kind;
+    u32 id;
+    // Order, number of frames, color, or number of frames with the alignment
+    // of pmm_alloc_contig
+    u64 arg;
+    u64 align;
+} bench_op_t;
+
+typedef struct {
+    bench_op_t *ops;
+    u64 count;
+    u64 capacity;
+    // IDs are in [0, num_ids)
+    u32 num_ids;
+} bench_trace_t;
+
+typedef enum {
+    SLOT_EMPTY,
+    SLOT_HELD,
+    SLOT_FAILED,
+} bench_slot_state_t;
+
+typedef struct {
+    bench_slot_state_t state;
+    bench_kind_t kind;
+    u64 arg;
+    u64 phys_addr;
+    // BENCH_MAX_BATCH frames, only for pmm_alloc_batch
+    u64 *frames;
+} bench_slot_t;
+
+typedef struct {
+    // TSC cycles of every call
+    u64 *cycles;
+    u64 count;
+    u64 failed;
+} bench_stat_t;
+
+static void trace_push(bench_trace_t *trace, bench_kind_t kind, u32 id,
+                       u64 arg, u64 align);
+static bool trace_load(bench_trace_t *trace, const char *path);
+static bool trace_save(const bench_trace_t *trace, const char *path);
+static void gen_churn(bench_trace_t *trace, u64 num_ops, u64 *state);
+static void gen_lifo(bench_trace_t *trace, u64 num_ops);
+static void gen_fragment(bench_trace_t *trace, u64 num_frames);
+static void replay(const bench_trace_t *trace, bench_stat_t *stats);
+static u64 replay_alloc(bench_slot_t *slot, const bench_op_t *op);
+static u64 replay_free(bench_slot_t *slot);
+static void report(bench_stat_t *stats, double ns_per_cycle);
+static int compare_u64(const void *a, const void *b);
+static u64 bench_random(u64 *state);
+static u64 now_ns(void);
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-m MIB] [-n OPS] [-s SEED] [-o TRACE]\n"
+            "          [-w churn|lifo|fragment | -t TRACE]\n"
+            "  -m  MiB of fake physical memory (default %lu)\n"
+            "  -n  Number of calls of the churn and lifo workloads "
+            "(default %lu)\n"
+            "  -s  Seed of the churn workload\n"
+            "  -w  Synthetic workload to replay (default churn)\n"
+            "  -t  Trace file to replay\n"
+            "  -o  Write the replayed trace to a file\n",
+            name, BENCH_DEFAULT_MEM_MIB, BENCH_DEFAULT_NUM_OPS);
+}
+
+int main(int argc, char **argv) {
+    u64 mem_mib = BENCH_DEFAULT_MEM_MIB;
+    u64 num_ops = BENCH_DEFAULT_NUM_OPS;
+    u64 seed = 0x5eed;
+    const char *workload = "churn";
+    const char *trace_path = NULL;
+    const char *output_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:s:w:t:o:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_mib = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            num_ops = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (mem_mib == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    percpu_init(0);
+    memblock_add(BENCH_PHYS_BASE, BENCH_PHYS_BASE + (mem_mib << 20));
+    pmm_init();
+
+    bench_trace_t trace = { 0 };
+    if (trace_path != NULL) {
+        if (!trace_load(&trace, trace_path)) {
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(workload, "churn") == 0) {
+        // xorshift must not start from 0
+        u64 state = seed | 1;
+        gen_churn(&trace, num_ops, &state);
+    } else if (strcmp(workload, "lifo") == 0) {
+        gen_lifo(&trace, num_ops);
+    } else if (strcmp(workload, "fragment") == 0) {
+        gen_fragment(&trace, (mem_mib << 20) / PAGE_SIZE);
+    } else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (output_path != NULL && !trace_save(&trace, output_path)) {
+        return EXIT_FAILURE;
+    }
+
+    bench_stat_t stats[BENCH_NUM_STATS] = { 0 };
+    for (u64 i = 0; i < BENCH_NUM_STATS; ++i) {
+        stats[i].cycles = malloc(trace.count * sizeof(u64));
+    }
+
+    u64 start_ns = now_ns();
+    u64 start_cycles = __rdtsc();
+    replay(&trace, stats);
+    u64 elapsed_cycles = __rdtsc() - start_cycles;
+    u64 elapsed_ns = now_ns() - start_ns;
+
+    // Replay bookkeeping is included, so throughput is a lower bound
+    printf("%lu calls replayed in %.1f ms: %.2f Mcalls/s\n", trace.count,
+           (double)elapsed_ns / 1e6,
+           (double)trace.count * 1e3 / (double)elapsed_ns);
+    report(stats, (double)elapsed_ns / (double)elapsed_cycles);
+
+    pmm_check();
+    pmm_print_stats();
+
+    return EXIT_SUCCESS;
+}
+
+static void trace_push(bench_trace_t *trace, bench_kind_t kind, u32 id,
+                       u64 arg, u64 align) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity == 0 ? 4096 : 2 * trace->capacity;
+        trace->ops = realloc(trace->ops, trace->capacity * sizeof(bench_op_t));
+        if (trace->ops == NULL) {
+            fprintf(stderr, "bench: Out of memory for the trace\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    trace->ops[trace->count] =
+        (bench_op_t){ .kind = kind, .id = id, .arg = arg, .align = align };
+    trace->count += 1;
+    if (id >= trace->num_ids) {
+        trace->num_ids = id + 1;
+    }
+}
+
+static bool trace_load(bench_trace_t *trace, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    u64 line_num = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num += 1;
+
+        char letter;
+        u32 id;
+        u64 arg = 0;
+        u64 align = 0;
+        int num_fields = sscanf(line, " %c %u %lu %lu", &letter, &id, &arg,
+                                &align);
+        if (num_fields < 1 || letter == '#') {
+            continue;
+        }
+
+        const char *kind_ptr = memchr(trace_letters, letter,
+                                      sizeof(trace_letters));
+        int expected_fields = 2;
+        if (letter == 'p' || letter == 'b' || letter == 'k') {
+            expected_fields = 3;
+        } else if (letter == 'c') {
+            expected_fields = 4;
+        }
+        if (kind_ptr == NULL || num_fields < expected_fields
+            || (letter == 'p' && arg > PMM_MAX_ORDER)
+            || (letter == 'b' && (arg == 0 || arg > BENCH_MAX_BATCH))
+            || (letter == 'c' && (arg == 0 || align % PAGE_SIZE != 0))) {
+            fprintf(stderr, "%s:%lu: Invalid call\n", path, line_num);
+            fclose(file);
+            return false;
+        }
+
+        trace_push(trace, (bench_kind_t)(kind_ptr - trace_letters), id, arg,
+                   align);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static bool trace_save(const bench_trace_t *trace, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    for (u64 i = 0; i < trace->count; ++i) {
+        const bench_op_t *op = &trace->ops[i];
+        fprintf(file, "%c %u", trace_letters[op->kind], op->id);
+        if (op->kind == BENCH_ALLOC_PAGES || op->kind == BENCH_ALLOC_BATCH
+            || op->kind == BENCH_ALLOC_COLORED) {
+            fprintf(file, " %lu", op->arg);
+        } else if (op->kind == BENCH_ALLOC_CONTIG) {
+            fprintf(file, " %lu %lu", op->arg, op->align);
+        }
+        fputc('\n', file);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Random mix of every kind of allocation over BENCH_CHURN_SLOTS IDs, an ID
+// being freed when it is picked again
+static void gen_churn(bench_trace_t *trace, u64 num_ops, u64 *state) {
+    static bool held[BENCH_CHURN_SLOTS];
+
+    for (u64 i = 0; i < num_ops; ++i) {
+        u32 id = (u32)(bench_random(state) % BENCH_CHURN_SLOTS);
+        if (held[id]) {
+            trace_push(trace, BENCH_FREE, id, 0, 0);
+            held[id] = false;
+            continue;
+        }
+
+        u64 r = bench_random(state);
+        u64 percent = r % 100;
+        r /= 100;
+        if (percent < 50) {
+            trace_push(trace, BENCH_ALLOC, id, 0, 0);
+        } else if (percent < 55) {
+            trace_push(trace, BENCH_ALLOC_ZEROED, id, 0, 0);
+        } else if (percent < 85) {
+            trace_push(trace, BENCH_ALLOC_PAGES, id, r % 5, 0);
+        } else if (percent < 90) {
+            trace_push(trace, BENCH_ALLOC_BATCH, id, 1 + r % 16, 0);
+        } else if (percent < 95) {
+            trace_push(trace, BENCH_ALLOC_COLORED, id, r % 256, 0);
+        } else {
+            trace_push(trace, BENCH_ALLOC_CONTIG, id, 1 + r % 8,
+                       (u64)PAGE_SIZE << (r / 8 % 4));
+        }
+        held[id] = true;
+    }
+
+    for (u32 id = 0; id < BENCH_CHURN_SLOTS; ++id) {
+        if (held[id]) {
+            trace_push(trace, BENCH_FREE, id, 0, 0);
+            held[id] = false;
+        }
+    }
+}
+
+// Single frames freed in the reverse order of their allocation: the fast path
+// of the magazines
+static void gen_lifo(bench_trace_t *trace, u64 num_ops) {
+    while (trace->count < num_ops) {
+        for (u32 id = 0; id < BENCH_LIFO_DEPTH; ++id) {
+            trace_push(trace, BENCH_ALLOC, id, 0, 0);
+        }
+        for (u32 id = BENCH_LIFO_DEPTH; id > 0; --id) {
+            trace_push(trace, BENCH_FREE, id - 1, 0, 0);
+        }
+    }
+}
+
+// Take every frame, free one frame out of two so that no free block is larger
+// than a frame, then look for blocks of increasing order: the worst case of
+// the buddy allocators. Everything is freed at the end and large blocks are
+// allocated again to check that the buddies merged back.
+static void gen_fragment(bench_trace_t *trace, u64 num_frames) {
+    u32 num_ids = (u32)num_frames;
+    for (u32 id = 0; id < num_ids; ++id) {
+        trace_push(trace, BENCH_ALLOC_PAGES, id, 0, 0);
+    }
+    for (u32 id = 1; id < num_ids; id += 2) {
+        trace_push(trace, BENCH_FREE, id, 0, 0);
+    }
+
+    u32 next_id = num_ids;
+    for (u64 order = 1; order <= PMM_MAX_ORDER; ++order) {
+        for (u32 i = 0; i < BENCH_FRAGMENT_TRIES; ++i) {
+            trace_push(trace, BENCH_ALLOC_PAGES, next_id + i, order, 0);
+        }
+        for (u32 i = 0; i < BENCH_FRAGMENT_TRIES; ++i) {
+            trace_push(trace, BENCH_FREE, next_id + i, 0, 0);
+        }
+    }
+
+    for (u32 id = 0; id < num_ids; id += 2) {
+        trace_push(trace, BENCH_FREE, id, 0, 0);
+    }
+
+    u32 num_blocks = (u32)(num_frames >> PMM_MAX_ORDER);
+    for (u32 i = 0; i < num_blocks; ++i) {
+        trace_push(trace, BENCH_ALLOC_PAGES, next_id + i, PMM_MAX_ORDER, 0);
+    }
+    for (u32 i = 0; i < num_blocks; ++i) {
+        trace_push(trace, BENCH_FREE, next_id + i, 0, 0);
+    }
+}
+
+// Replay the trace and record the cycles of every call. IDs still held at the
+// end are freed without being timed so that pmm_check sees a clean PMM.
+static void replay(const bench_trace_t *trace, bench_stat_t *stats) {
+    bench_slot_t *slots = calloc(trace->num_ids, sizeof(bench_slot_t));
+    if (slots == NULL) {
+        fprintf(stderr, "bench: Out of memory for the IDs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (u64 i = 0; i < trace->count; ++i) {
+        const bench_op_t *op = &trace->ops[i];
+        bench_slot_t *slot = &slots[op->id];
+        if ((op->kind == BENCH_FREE) == (slot->state == SLOT_EMPTY)) {
+            fprintf(stderr, "bench: Call %lu: ID %u is %s\n", i, op->id,
+                    slot->state == SLOT_EMPTY ? "not allocated"
+                                              : "already allocated");
+            exit(EXIT_FAILURE);
+        }
+
+        if (op->kind == BENCH_FREE) {
+            if (slot->state == SLOT_HELD) {
+                bench_stat_t *stat = &stats[BENCH_FREE + slot->kind];
+                stat->cycles[stat->count] = replay_free(slot);
+                stat->count += 1;
+            }
+            slot->state = SLOT_EMPTY;
+            continue;
+        }
+
+        bench_stat_t *stat = &stats[op->kind];
+        stat->cycles[stat->count] = replay_alloc(slot, op);
+        stat->count += 1;
+        if (slot->state == SLOT_FAILED) {
+            stat->failed += 1;
+        }
+    }
+
+    for (u32 id = 0; id < trace->num_ids; ++id) {
+        if (slots[id].state == SLOT_HELD) {
+            replay_free(&slots[id]);
+        }
+        free(slots[id].frames);
+    }
+    free(slots);
+}
+
+// Return the cycles taken by the allocation
+static u64 replay_alloc(bench_slot_t *slot, const bench_op_t *op) {
+    if (op->kind == BENCH_ALLOC_BATCH && slot->frames == NULL) {
+        slot->frames = malloc(BENCH_MAX_BATCH * sizeof(u64));
+    }
+
+    u64 phys_addr = PMM_ALLOC_ERROR;
+    u64 arg = op->arg;
+    u64 start = __rdtsc();
+    switch (op->kind) {
+    case BENCH_ALLOC:
+        phys_addr = pmm_alloc();
+        break;
+    case BENCH_ALLOC_ZEROED:
+        phys_addr = pmm_alloc_zeroed();
+        break;
+    case BENCH_ALLOC_PAGES:
+        phys_addr = pmm_alloc_pages((u8)arg);
+        break;
+    case BENCH_ALLOC_BATCH:
+        // Only the frames allocated are freed
+        arg = pmm_alloc_batch(slot->frames, arg);
+        phys_addr = arg == 0 ? PMM_ALLOC_ERROR : slot->frames[0];
+        break;
+    case BENCH_ALLOC_CONTIG:
+        phys_addr = pmm_alloc_contig(arg, op->align, PMM_ALLOC_ERROR);
+        break;
+    case BENCH_ALLOC_COLORED:
+        phys_addr = pmm_alloc_colored((u32)(arg % pmm_num_colors()));
+        break;
+    default:
+        break;
+    }
+    u64 cycles = __rdtsc() - start;
+
+    slot->state = phys_addr == PMM_ALLOC_ERROR ? SLOT_FAILED : SLOT_HELD;
+    slot->kind = op->kind;
+    slot->arg = arg;
+    slot->phys_addr = phys_addr;
+
+    return cycles;
+}
+
+// Return the cycles taken by the free
+static u64 replay_free(bench_slot_t *slot) {
+    u64 start = __rdtsc();
+    switch (slot->kind) {
+    case BENCH_ALLOC:
+    case BENCH_ALLOC_ZEROED:
+    case BENCH_ALLOC_COLORED:
+        pmm_free(slot->phys_addr);
+        break;
+    case BENCH_ALLOC_PAGES:
+        pmm_free_pages(slot->phys_addr, (u8)slot->arg);
+        break;
+    case BENCH_ALLOC_BATCH:
+        pmm_free_batch(slot->frames, slot->arg);
+        break;
+    case BENCH_ALLOC_CONTIG:
+        pmm_free_contig(slot->phys_addr, slot->arg);
+        break;
+    default:
+        break;
+    }
+    u64 cycles = __rdtsc() - start;
+
+    slot->state = SLOT_EMPTY;
+
+    return cycles;
+}
+
+static void report(bench_stat_t *stats, double ns_per_cycle) {
+    printf("%-13s %9s %9s %9s %9s %9s %9s\n", "call", "count", "failed",
+           "mean ns", "p50 ns", "p99 ns", "p999 ns");
+
+    for (u64 i = 0; i < BENCH_NUM_STATS; ++i) {
+        bench_stat_t *stat = &stats[i];
+        if (stat->count == 0) {
+            continue;
+        }
+
+        qsort(stat->cycles, stat->count, sizeof(u64), compare_u64);
+        u64 total = 0;
+        for (u64 j = 0; j < stat->count; ++j) {
+            total += stat->cycles[j];
+        }
+
+        double mean = (double)total / (double)stat->count;
+        double p50 = (double)stat->cycles[(stat->count - 1) * 500 / 1000];
+        double p99 = (double)stat->cycles[(stat->count - 1) * 990 / 1000];
+        double p999 = (double)stat->cycles[(stat->count - 1) * 999 / 1000];
+        printf("%-13s %9lu %9lu %9.0f %9.0f %9.0f %9.0f\n", stat_names[i],
+               stat->count, stat->failed, mean * ns_per_cycle,
+               p50 * ns_per_cycle, p99 * ns_per_cycle, p999 * ns_per_cycle);
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a;
+    u64 y = *(const u64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+// xorshift64 (Marsaglia)
+static u64 bench_random(u64 *state) {
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * 1000000000UL + (u64)ts.tv_nsec;
+}
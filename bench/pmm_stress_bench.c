@@ -0,0 +1,137 @@
+/*
+ * Host stress test of the PMM on several CPUs at once. pmm.c and the
+ * allocators below it are built for Linux (see host.c) as for pmm_bench, then
+ * every thread plays the part of a CPU and runs pmm_stress_test with its own
+ * seed, all of them released at the same time. pmm_check looks at the state
+ * left behind once they are all done.
+ *
+ * The kernel only runs on the bootstrap processor for now, so this is where
+ * the locking of the PMM is exercised. The wall time is reported so that the
+ * scaling of the locks can be followed as the number of threads grows.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "arch/percpu.h"
+#include "mm/memblock.h"
+#include "mm/pmm.h"
+#include "types.h"
+
+// Fake physical memory starts above the first MiB, like on a PC
+#define BENCH_PHYS_BASE 0x100000UL
+#define BENCH_DEFAULT_MEM_MIB 256UL
+#define BENCH_DEFAULT_NUM_ROUNDS 1000000UL
+#define BENCH_DEFAULT_NUM_THREADS 4U
+
+typedef struct {
+    pthread_t thread;
+    u32 cpu_id;
+    u64 seed;
+    u64 num_rounds;
+} bench_thread_t;
+
+static void *stress_thread(void *arg);
+static u64 now_ns(void);
+
+// Holds every thread until all of them are ready
+static pthread_barrier_t start_barrier;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-m MIB] [-n ROUNDS] [-j THREADS] [-s SEED]\n"
+            "  -m  MiB of fake physical memory (default %lu)\n"
+            "  -n  Rounds of pmm_stress_test on each thread (default %lu)\n"
+            "  -j  Number of threads, at most %u (default %u)\n"
+            "  -s  Seed of the first thread, the next ones add their number\n",
+            name, BENCH_DEFAULT_MEM_MIB, BENCH_DEFAULT_NUM_ROUNDS, MAX_CPUS,
+            BENCH_DEFAULT_NUM_THREADS);
+}
+
+int main(int argc, char **argv) {
+    u64 mem_mib = BENCH_DEFAULT_MEM_MIB;
+    u64 num_rounds = BENCH_DEFAULT_NUM_ROUNDS;
+    u64 num_threads = BENCH_DEFAULT_NUM_THREADS;
+    u64 seed = 0x5eed;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:j:s:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            mem_mib = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            num_rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'j':
+            num_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (mem_mib == 0 || num_threads == 0 || num_threads > MAX_CPUS) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    percpu_init(0);
+    memblock_add(BENCH_PHYS_BASE, BENCH_PHYS_BASE + (mem_mib << 20));
+    pmm_init();
+
+    bench_thread_t threads[MAX_CPUS];
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)num_threads + 1);
+    for (u32 i = 0; i < num_threads; ++i) {
+        threads[i] = (bench_thread_t){
+            .cpu_id = i,
+            .seed = seed + i,
+            .num_rounds = num_rounds,
+        };
+        if (pthread_create(&threads[i].thread, NULL, stress_thread,
+                           &threads[i])
+            != 0) {
+            fprintf(stderr, "bench: Cannot create thread %u\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    u64 start_ns = now_ns();
+    for (u32 i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    u64 elapsed_ns = now_ns() - start_ns;
+
+    printf("%lu rounds on %lu threads in %.1f ms: %.2f Mrounds/s\n",
+           num_rounds * num_threads, num_threads, (double)elapsed_ns / 1e6,
+           (double)(num_rounds * num_threads) * 1e3 / (double)elapsed_ns);
+
+    pmm_check();
+    pmm_print_stats();
+
+    return EXIT_SUCCESS;
+}
+
+static void *stress_thread(void *arg) {
+    const bench_thread_t *thread = arg;
+
+    percpu_init(thread->cpu_id);
+    pthread_barrier_wait(&start_barrier);
+    pmm_stress_test(thread->seed, thread->num_rounds);
+
+    return NULL;
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * 1000000000UL + (u64)ts.tv_nsec;
+}
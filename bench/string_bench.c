@@ -0,0 +1,240 @@
+/*
+ * Host benchmark of libk/string.c. Each scan runs over strings from 1 B to
+ * 64 KiB, next to the byte loops libk had before (or the obvious byte loop for
+ * the functions it did not have), and the time per call is reported. The
+ * strings start one byte past a word boundary, so that the head of the word
+ * scans is always exercised.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libk/mem.h"
+#include "libk/string.h"
+#include "types.h"
+
+#define BENCH_MIN_SIZE 1UL
+#define BENCH_MAX_SIZE (64UL << 10)
+// Bytes scanned for each size and function, the number of calls follows
+#define BENCH_DEFAULT_BYTES (64UL << 20)
+#define BENCH_MIN_CALLS 1000UL
+#define BENCH_NEEDLE "needle"
+#define BENCH_NEEDLE_LEN 6
+
+typedef enum {
+    BENCH_STRLEN,
+    BENCH_STRNLEN,
+    BENCH_STRCHR,
+    BENCH_MEMCHR,
+    BENCH_STRNCMP,
+    BENCH_MEMMEM,
+    BENCH_NUM_FUNCS,
+} bench_func_t;
+
+static const char *const func_names[BENCH_NUM_FUNCS] = {
+    "strlen", "strnlen", "strchr", "memchr", "strncmp", "memmem",
+};
+
+static char *str1;
+static char *str2;
+
+static double bench_func(bench_func_t func, bool reference, u64 size,
+                         u64 num_calls);
+static void fill(char *str, u64 size);
+static u64 byte_strlen(const char *s);
+static u64 byte_strnlen(const char *s, u64 max_len);
+static const char *byte_strchr(const char *s, char c);
+static const u8 *byte_memchr(const u8 *mem, u8 value, u64 n);
+static int byte_strncmp(const char *s1, const char *s2, u64 n);
+static const u8 *byte_memmem(const u8 *haystack, u64 haystack_len,
+                             const u8 *needle, u64 needle_len);
+static u64 now_ns(void);
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-b BYTES]\n"
+            "  -b  Bytes scanned for each size (default %lu)\n",
+            name, BENCH_DEFAULT_BYTES);
+}
+
+int main(int argc, char **argv) {
+    u64 num_bytes = BENCH_DEFAULT_BYTES;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            num_bytes = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    // One more byte for the null byte and one to misalign the strings
+    str1 = malloc(BENCH_MAX_SIZE + 2);
+    str2 = malloc(BENCH_MAX_SIZE + 2);
+
+    printf("%-8s %8s %12s %12s %8s\n", "function", "size", "ns/call",
+           "bytewise", "speedup");
+    for (u32 func = 0; func < BENCH_NUM_FUNCS; ++func) {
+        for (u64 size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 2) {
+            u64 num_calls = num_bytes / size;
+            if (num_calls < BENCH_MIN_CALLS) {
+                num_calls = BENCH_MIN_CALLS;
+            }
+
+            fill(str1 + 1, size);
+            fill(str2 + 1, size);
+
+            double ns = bench_func(func, false, size, num_calls);
+            double byte_ns = bench_func(func, true, size, num_calls);
+            printf("%-8s %8lu %12.2f %12.2f %7.1fx\n", func_names[func], size,
+                   ns, byte_ns, byte_ns / ns);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Return the time per call in ns. The searched characters are not in the
+// strings and the needle of memmem ends them, so that every call scans the
+// whole string.
+static double bench_func(bench_func_t func, bool reference, u64 size,
+                         u64 num_calls) {
+    const char *s1 = str1 + 1;
+    const char *s2 = str2 + 1;
+    const u8 *needle = (const u8 *)BENCH_NEEDLE;
+    u64 needle_len = size < BENCH_NEEDLE_LEN ? size : BENCH_NEEDLE_LEN;
+    u64 sink = 0;
+
+    u64 start_ns = now_ns();
+    for (u64 i = 0; i < num_calls; ++i) {
+        switch (func) {
+        case BENCH_STRLEN:
+            sink += (reference ? byte_strlen : strlen)(s1);
+            break;
+        case BENCH_STRNLEN:
+            sink += (reference ? byte_strnlen : strnlen)(s1, size + 1);
+            break;
+        case BENCH_STRCHR:
+            sink += (u64)(reference ? byte_strchr : strchr)(s1, '#');
+            break;
+        case BENCH_MEMCHR:
+            sink += (u64)(reference ? byte_memchr : memchr)((const u8 *)s1,
+                                                            '#', size);
+            break;
+        case BENCH_STRNCMP:
+            sink += (u64)(reference ? byte_strncmp : strncmp)(s1, s2, size);
+            break;
+        case BENCH_MEMMEM:
+            sink += (u64)(reference ? byte_memmem : memmem)(
+                (const u8 *)s1, size, needle, needle_len);
+            break;
+        default:
+            abort();
+        }
+    }
+    u64 elapsed_ns = now_ns() - start_ns;
+
+    // Keep the calls from being optimized out
+    __asm__ volatile("" : : "r"(sink));
+
+    return (double)elapsed_ns / (double)num_calls;
+}
+
+// Letters ended by as much of the needle of memmem as fits, then a null byte
+static void fill(char *str, u64 size) {
+    for (u64 i = 0; i < size; ++i) {
+        str[i] = (char)('a' + i % 26);
+    }
+
+    u64 needle_len = size < BENCH_NEEDLE_LEN ? size : BENCH_NEEDLE_LEN;
+    memcpy((u8 *)str + size - needle_len, (const u8 *)BENCH_NEEDLE,
+           needle_len);
+    str[size] = '\0';
+}
+
+// The implementations libk/string.c had before the word scans
+__attribute__((noinline)) static u64 byte_strlen(const char *s) {
+    u64 len = 0;
+
+    while (*s != '\0') {
+        len += 1;
+        s += 1;
+    }
+
+    return len;
+}
+
+__attribute__((noinline)) static int byte_strncmp(const char *s1,
+                                                  const char *s2, u64 n) {
+    u64 i = 0;
+    while (i < n && s1[i] == s2[i] && s1[i] != '\0') {
+        i += 1;
+    }
+
+    return i == n ? 0 : s1[i] - s2[i];
+}
+
+// Byte loops for the functions libk did not have
+__attribute__((noinline)) static u64 byte_strnlen(const char *s,
+                                                  u64 max_len) {
+    u64 len = 0;
+
+    while (len < max_len && s[len] != '\0') {
+        len += 1;
+    }
+
+    return len;
+}
+
+__attribute__((noinline)) static const char *byte_strchr(const char *s,
+                                                         char c) {
+    for (;; ++s) {
+        if (*s == c) {
+            return s;
+        }
+        if (*s == '\0') {
+            return NULL;
+        }
+    }
+}
+
+__attribute__((noinline)) static const u8 *byte_memchr(const u8 *mem,
+                                                       u8 value, u64 n) {
+    for (u64 i = 0; i < n; ++i) {
+        if (mem[i] == value) {
+            return mem + i;
+        }
+    }
+
+    return NULL;
+}
+
+__attribute__((noinline)) static const u8 *
+byte_memmem(const u8 *haystack, u64 haystack_len, const u8 *needle,
+            u64 needle_len) {
+    for (u64 i = 0; i + needle_len <= haystack_len; ++i) {
+        u64 j = 0;
+        while (j < needle_len && haystack[i + j] == needle[j]) {
+            j += 1;
+        }
+        if (j == needle_len) {
+            return haystack + i;
+        }
+    }
+
+    return NULL;
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * 1000000000UL + (u64)ts.tv_nsec;
+}
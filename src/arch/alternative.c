@@ -0,0 +1,59 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_ARCH
+
+#include "alternative.h"
+#include "arch/cpu_features.h"
+#include "arch/instr.h"
+#include "libk/kassert.h"
+#include "libk/log.h"
+#include "libk/panic.h"
+
+#define OPCODE_CALL_REL32 0xe8
+#define CALL_REL32_SIZE 5
+
+// Defined by the linker for sections named like C identifiers
+extern const alternative_t __start_alternatives[], __stop_alternatives[];
+
+static u64 alternative_addr(const i32 *offset);
+
+// Must run on the bootstrap processor before the other CPUs are started and
+// before any interrupt is enabled: the call sites are rewritten in place.
+void alternatives_apply(void) {
+    u64 num_patched = 0;
+
+    for (const alternative_t *alt = __start_alternatives;
+         alt < __stop_alternatives; ++alt) {
+        if (!cpu_has(alt->feature)) {
+            continue;
+        }
+
+        volatile u8 *site = (volatile u8 *)alternative_addr(&alt->site);
+        u64 replacement = alternative_addr(&alt->replacement);
+        kassert(*site == OPCODE_CALL_REL32);
+
+        i64 disp = (i64)replacement - (i64)((u64)site + CALL_REL32_SIZE);
+        if (disp != (i32)disp) {
+            kpanic("Alternatives: Replacement 0x%016lx out of reach of the "
+                   "call at 0x%016lx\n",
+                   replacement, (u64)site);
+        }
+
+        // Bytewise, the displacement is not aligned and memcpy may be the
+        // function being patched
+        for (u32 i = 0; i < sizeof(i32); ++i) {
+            site[1 + i] = (u8)((u32)disp >> (i * 8));
+        }
+        num_patched += 1;
+    }
+
+    // Stores to code are only guaranteed to be seen by the instruction fetch
+    // after a serializing instruction (See Vol. 3A 9.1.3)
+    u32 eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+
+    log(LOG_LEVEL_INFO, "Alternatives: %lu of %lu call sites patched\n",
+        num_patched, (u64)(__stop_alternatives - __start_alternatives));
+}
+
+static u64 alternative_addr(const i32 *offset) {
+    return (u64)((i64)offset + *offset);
+}
@@ -0,0 +1,50 @@
+#ifndef AVOCADOS_ALTERNATIVE_H_
+#define AVOCADOS_ALTERNATIVE_H_
+
+/*
+ * Alternatives: call sites whose target is chosen once at boot, depending on
+ * the CPU features, instead of on each call. ALTERNATIVE_CALL emits a call to
+ * a default implementation and records it in the alternatives section, then
+ * alternatives_apply rewrites the displacement of the calls whose feature is
+ * present. When several records name the same site, the last one applying
+ * wins.
+ *
+ * Records hold offsets relative to themselves rather than addresses, so that
+ * the host benchmarks, built as position independent executables, need no
+ * relocation of the section.
+ */
+
+#include "types.h"
+
+#define _ALTERNATIVE_STR(X) #X
+#define ALTERNATIVE_STR(X) _ALTERNATIVE_STR(X)
+
+// To be used as the template of an asm statement. DEFAULT and REPLACEMENT are
+// symbol names, FEATURE a CPU_FEATURE_* constant. The operands and clobbers
+// must describe the calling convention of both implementations.
+#define ALTERNATIVE_CALL(DEFAULT, REPLACEMENT, FEATURE)                        \
+    "771: call " DEFAULT "\n"                                                  \
+    ".pushsection alternatives, \"a\"\n"                                       \
+    ".balign 4\n"                                                              \
+    ".long 771b - .\n"                                                         \
+    ".long " REPLACEMENT " - .\n"                                              \
+    ".long " ALTERNATIVE_STR(FEATURE) "\n"                                     \
+    ".popsection\n"
+
+// Caller-saved registers of the System V ABI, for replacements written in C.
+// The vector registers are left out as the kernel never uses them outside of
+// kernel_fpu_begin sections.
+#define ALTERNATIVE_C_CLOBBERS                                                 \
+    "rax", "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "cc", "memory"
+
+typedef struct {
+    // Offset of the call instruction
+    i32 site;
+    // Offset of the function called when the feature is present
+    i32 replacement;
+    u32 feature;
+} alternative_t;
+
+void alternatives_apply(void);
+
+#endif /* ! AVOCADOS_ALTERNATIVE_H_ */
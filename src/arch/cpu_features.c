@@ -0,0 +1,154 @@
+/*
+ * Table of the CPU features, filled once from CPUID by the bootstrap processor.
+ * The other CPUs are assumed to have the same features.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_ARCH
+
+#include "arch/cpu_features.h"
+#include "arch/instr.h"
+#include "libk/kassert.h"
+#include "libk/kprintf.h"
+#include "libk/log.h"
+#include "tools/test.h"
+
+#define CPUID_EXT_LEAF_BASE 0x80000000
+
+typedef enum {
+    CPUID_EAX,
+    CPUID_EBX,
+    CPUID_ECX,
+    CPUID_EDX,
+} cpuid_reg_t;
+
+typedef struct {
+    u32 leaf;
+    u32 subleaf;
+    cpuid_reg_t reg;
+} cpu_feature_word_t;
+
+typedef struct {
+    u32 feature;
+    const char *name;
+} cpu_feature_name_t;
+
+static const cpu_feature_word_t feature_words[CPU_FEATURE_NUM_WORDS] = {
+    [CPU_FEATURE_WORD_1_ECX] = { 0x1, 0, CPUID_ECX },
+    [CPU_FEATURE_WORD_1_EDX] = { 0x1, 0, CPUID_EDX },
+    [CPU_FEATURE_WORD_7_EBX] = { 0x7, 0, CPUID_EBX },
+    [CPU_FEATURE_WORD_7_ECX] = { 0x7, 0, CPUID_ECX },
+    [CPU_FEATURE_WORD_7_EDX] = { 0x7, 0, CPUID_EDX },
+    [CPU_FEATURE_WORD_D_1_EAX] = { 0xd, 1, CPUID_EAX },
+    [CPU_FEATURE_WORD_80000001_ECX] = { 0x80000001, 0, CPUID_ECX },
+    [CPU_FEATURE_WORD_80000001_EDX] = { 0x80000001, 0, CPUID_EDX },
+};
+
+static const cpu_feature_name_t feature_names[] = {
+    { CPU_FEATURE_SSE3, "sse3" },
+    { CPU_FEATURE_SSSE3, "ssse3" },
+    { CPU_FEATURE_FMA, "fma" },
+    { CPU_FEATURE_CX16, "cx16" },
+    { CPU_FEATURE_PCID, "pcid" },
+    { CPU_FEATURE_SSE4_1, "sse4_1" },
+    { CPU_FEATURE_SSE4_2, "sse4_2" },
+    { CPU_FEATURE_X2APIC, "x2apic" },
+    { CPU_FEATURE_MOVBE, "movbe" },
+    { CPU_FEATURE_POPCNT, "popcnt" },
+    { CPU_FEATURE_TSC_DEADLINE, "tsc_deadline" },
+    { CPU_FEATURE_AES, "aes" },
+    { CPU_FEATURE_XSAVE, "xsave" },
+    { CPU_FEATURE_AVX, "avx" },
+    { CPU_FEATURE_RDRAND, "rdrand" },
+    { CPU_FEATURE_HYPERVISOR, "hypervisor" },
+    { CPU_FEATURE_FPU, "fpu" },
+    { CPU_FEATURE_TSC, "tsc" },
+    { CPU_FEATURE_MSR, "msr" },
+    { CPU_FEATURE_APIC, "apic" },
+    { CPU_FEATURE_PGE, "pge" },
+    { CPU_FEATURE_PAT, "pat" },
+    { CPU_FEATURE_CLFLUSH, "clflush" },
+    { CPU_FEATURE_FXSR, "fxsr" },
+    { CPU_FEATURE_SSE, "sse" },
+    { CPU_FEATURE_SSE2, "sse2" },
+    { CPU_FEATURE_HTT, "htt" },
+    { CPU_FEATURE_FSGSBASE, "fsgsbase" },
+    { CPU_FEATURE_BMI1, "bmi1" },
+    { CPU_FEATURE_AVX2, "avx2" },
+    { CPU_FEATURE_SMEP, "smep" },
+    { CPU_FEATURE_BMI2, "bmi2" },
+    { CPU_FEATURE_ERMS, "erms" },
+    { CPU_FEATURE_INVPCID, "invpcid" },
+    { CPU_FEATURE_AVX512F, "avx512f" },
+    { CPU_FEATURE_RDSEED, "rdseed" },
+    { CPU_FEATURE_SMAP, "smap" },
+    { CPU_FEATURE_CLFLUSHOPT, "clflushopt" },
+    { CPU_FEATURE_CLWB, "clwb" },
+    { CPU_FEATURE_UMIP, "umip" },
+    { CPU_FEATURE_PKU, "pku" },
+    { CPU_FEATURE_LA57, "la57" },
+    { CPU_FEATURE_RDPID, "rdpid" },
+    { CPU_FEATURE_FSRM, "fsrm" },
+    { CPU_FEATURE_XSAVEOPT, "xsaveopt" },
+    { CPU_FEATURE_XSAVEC, "xsavec" },
+    { CPU_FEATURE_XSAVES, "xsaves" },
+    { CPU_FEATURE_LAHF_LM, "lahf_lm" },
+    { CPU_FEATURE_LZCNT, "lzcnt" },
+    { CPU_FEATURE_NX, "nx" },
+    { CPU_FEATURE_PDPE1GB, "pdpe1gb" },
+    { CPU_FEATURE_RDTSCP, "rdtscp" },
+    { CPU_FEATURE_LM, "lm" },
+};
+
+#define NUM_FEATURE_NAMES (sizeof(feature_names) / sizeof(feature_names[0]))
+
+static u32 features[CPU_FEATURE_NUM_WORDS];
+
+// Must be called before cpu_has, the words of the leaves the CPU does not
+// have are left empty
+void cpu_features_init(void) {
+    u32 regs[4];
+    cpuid(0, 0, &regs[CPUID_EAX], &regs[CPUID_EBX], &regs[CPUID_ECX],
+          &regs[CPUID_EDX]);
+    u32 max_leaf = regs[CPUID_EAX];
+    cpuid(CPUID_EXT_LEAF_BASE, 0, &regs[CPUID_EAX], &regs[CPUID_EBX],
+          &regs[CPUID_ECX], &regs[CPUID_EDX]);
+    u32 max_ext_leaf = regs[CPUID_EAX];
+
+    for (u32 i = 0; i < CPU_FEATURE_NUM_WORDS; ++i) {
+        const cpu_feature_word_t *word = &feature_words[i];
+        u32 max = word->leaf >= CPUID_EXT_LEAF_BASE ? max_ext_leaf : max_leaf;
+        if (word->leaf > max) {
+            continue;
+        }
+
+        cpuid(word->leaf, word->subleaf, &regs[CPUID_EAX], &regs[CPUID_EBX],
+              &regs[CPUID_ECX], &regs[CPUID_EDX]);
+        features[i] = regs[word->reg];
+    }
+
+    log(LOG_LEVEL_INFO, "CPU features: Max leaf 0x%x, max extended leaf 0x%x\n",
+        max_leaf, max_ext_leaf);
+}
+
+bool cpu_has(u32 feature) {
+    kassert(feature < CPU_FEATURE_NUM_WORDS * 32);
+
+    return (features[feature / 32] & CPU_FEATURE_MASK(feature)) != 0;
+}
+
+void cpu_features_print(void) {
+    kprintf("CPU features:");
+    for (u64 i = 0; i < NUM_FEATURE_NAMES; ++i) {
+        if (cpu_has(feature_names[i].feature)) {
+            kprintf(" %s", feature_names[i].name);
+        }
+    }
+    kprintf("\n");
+}
+
+// Every CPU running the kernel has these, see boot.S
+DEFINE_TEST(test_cpu_features) {
+    kassert(cpu_has(CPU_FEATURE_LM));
+    kassert(cpu_has(CPU_FEATURE_NX));
+    kassert(cpu_has(CPU_FEATURE_SSE2));
+}
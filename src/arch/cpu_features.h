@@ -0,0 +1,106 @@
+#ifndef AVOCADOS_CPU_FEATURES_H_
+#define AVOCADOS_CPU_FEATURES_H_
+
+/*
+ * A CPU feature is a bit of a CPUID register: the index of the register in
+ * the feature table times 32, plus the index of the bit (See Vol. 2A 3.3
+ * CPUID).
+ */
+#define CPU_FEATURE(WORD, BIT) ((WORD)*32 + (BIT))
+
+// Registers of the feature table
+#define CPU_FEATURE_WORD_1_ECX 0
+#define CPU_FEATURE_WORD_1_EDX 1
+#define CPU_FEATURE_WORD_7_EBX 2
+#define CPU_FEATURE_WORD_7_ECX 3
+#define CPU_FEATURE_WORD_7_EDX 4
+#define CPU_FEATURE_WORD_D_1_EAX 5
+#define CPU_FEATURE_WORD_80000001_ECX 6
+#define CPU_FEATURE_WORD_80000001_EDX 7
+#define CPU_FEATURE_NUM_WORDS 8
+
+// Leaf 01H, ECX
+#define CPU_FEATURE_SSE3 CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 0)
+#define CPU_FEATURE_SSSE3 CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 9)
+#define CPU_FEATURE_FMA CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 12)
+#define CPU_FEATURE_CX16 CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 13)
+#define CPU_FEATURE_PCID CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 17)
+#define CPU_FEATURE_SSE4_1 CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 19)
+#define CPU_FEATURE_SSE4_2 CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 20)
+#define CPU_FEATURE_X2APIC CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 21)
+#define CPU_FEATURE_MOVBE CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 22)
+#define CPU_FEATURE_POPCNT CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 23)
+#define CPU_FEATURE_TSC_DEADLINE CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 24)
+#define CPU_FEATURE_AES CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 25)
+#define CPU_FEATURE_XSAVE CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 26)
+#define CPU_FEATURE_AVX CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 28)
+#define CPU_FEATURE_RDRAND CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 30)
+#define CPU_FEATURE_HYPERVISOR CPU_FEATURE(CPU_FEATURE_WORD_1_ECX, 31)
+
+// Leaf 01H, EDX
+#define CPU_FEATURE_FPU CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 0)
+#define CPU_FEATURE_TSC CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 4)
+#define CPU_FEATURE_MSR CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 5)
+#define CPU_FEATURE_APIC CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 9)
+#define CPU_FEATURE_PGE CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 13)
+#define CPU_FEATURE_PAT CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 16)
+#define CPU_FEATURE_CLFLUSH CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 19)
+#define CPU_FEATURE_FXSR CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 24)
+#define CPU_FEATURE_SSE CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 25)
+#define CPU_FEATURE_SSE2 CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 26)
+#define CPU_FEATURE_HTT CPU_FEATURE(CPU_FEATURE_WORD_1_EDX, 28)
+
+// Leaf 07H subleaf 0, EBX
+#define CPU_FEATURE_FSGSBASE CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 0)
+#define CPU_FEATURE_BMI1 CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 3)
+#define CPU_FEATURE_AVX2 CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 5)
+#define CPU_FEATURE_SMEP CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 7)
+#define CPU_FEATURE_BMI2 CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 8)
+#define CPU_FEATURE_ERMS CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 9)
+#define CPU_FEATURE_INVPCID CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 10)
+#define CPU_FEATURE_AVX512F CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 16)
+#define CPU_FEATURE_RDSEED CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 18)
+#define CPU_FEATURE_SMAP CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 20)
+#define CPU_FEATURE_CLFLUSHOPT CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 23)
+#define CPU_FEATURE_CLWB CPU_FEATURE(CPU_FEATURE_WORD_7_EBX, 24)
+
+// Leaf 07H subleaf 0, ECX
+#define CPU_FEATURE_UMIP CPU_FEATURE(CPU_FEATURE_WORD_7_ECX, 2)
+#define CPU_FEATURE_PKU CPU_FEATURE(CPU_FEATURE_WORD_7_ECX, 3)
+#define CPU_FEATURE_LA57 CPU_FEATURE(CPU_FEATURE_WORD_7_ECX, 16)
+#define CPU_FEATURE_RDPID CPU_FEATURE(CPU_FEATURE_WORD_7_ECX, 22)
+
+// Leaf 07H subleaf 0, EDX
+#define CPU_FEATURE_FSRM CPU_FEATURE(CPU_FEATURE_WORD_7_EDX, 4)
+
+// Leaf 0DH subleaf 1, EAX
+#define CPU_FEATURE_XSAVEOPT CPU_FEATURE(CPU_FEATURE_WORD_D_1_EAX, 0)
+#define CPU_FEATURE_XSAVEC CPU_FEATURE(CPU_FEATURE_WORD_D_1_EAX, 1)
+#define CPU_FEATURE_XSAVES CPU_FEATURE(CPU_FEATURE_WORD_D_1_EAX, 3)
+
+// Leaf 80000001H, ECX
+#define CPU_FEATURE_LAHF_LM CPU_FEATURE(CPU_FEATURE_WORD_80000001_ECX, 0)
+#define CPU_FEATURE_LZCNT CPU_FEATURE(CPU_FEATURE_WORD_80000001_ECX, 5)
+
+// Leaf 80000001H, EDX
+#define CPU_FEATURE_NX CPU_FEATURE(CPU_FEATURE_WORD_80000001_EDX, 20)
+#define CPU_FEATURE_PDPE1GB CPU_FEATURE(CPU_FEATURE_WORD_80000001_EDX, 26)
+#define CPU_FEATURE_RDTSCP CPU_FEATURE(CPU_FEATURE_WORD_80000001_EDX, 27)
+#define CPU_FEATURE_LM CPU_FEATURE(CPU_FEATURE_WORD_80000001_EDX, 29)
+
+// Mask of a feature in its register
+#define CPU_FEATURE_MASK(FEATURE) (1U << ((FEATURE) % 32))
+
+#ifndef __ASSEMBLER__
+
+#include <stdbool.h>
+
+#include "types.h"
+
+void cpu_features_init(void);
+bool cpu_has(u32 feature);
+void cpu_features_print(void);
+
+#endif /* ! __ASSEMBLER__ */
+
+#endif /* ! AVOCADOS_CPU_FEATURES_H_ */
@@ -0,0 +1,179 @@
+/*
+ * x87, SSE and AVX state. The kernel is built with -mgeneral-regs-only so the
+ * compiler never touches the vector registers: code that does must run
+ * between kernel_fpu_begin and kernel_fpu_end. There are no user tasks, so
+ * the only state to preserve is that of a section interrupted by a handler
+ * opening its own. Each CPU has an area per nesting level, written by
+ * XSAVEOPT and read by XRSTOR (See Vol. 1 13).
+ *
+ * Without XSAVE, FXSAVE and FXRSTOR handle the x87 and SSE state and AVX is
+ * left disabled.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_ARCH
+
+#include "arch/cpu_features.h"
+#include "arch/instr.h"
+#include "arch/percpu.h"
+#include "arch/regs.h"
+#include "fpu.h"
+#include "libk/kassert.h"
+#include "libk/log.h"
+#include "libk/panic.h"
+#include "tools/test.h"
+
+// Enough for the x87, SSE and AVX components in the standard format
+#define FPU_STATE_MAX_SIZE 1024
+#define FXSAVE_STATE_SIZE 512
+
+typedef enum {
+    FPU_SAVE_FXSAVE,
+    FPU_SAVE_XSAVE,
+    FPU_SAVE_XSAVEOPT,
+} fpu_save_method_t;
+
+static void fpu_save(u8 *state);
+static void fpu_restore(const u8 *state);
+
+static fpu_save_method_t save_method = FPU_SAVE_FXSAVE;
+static u64 state_size = FXSAVE_STATE_SIZE;
+static bool has_avx = false;
+// The outermost section has nothing to save, its registers are left to the
+// next one. XSAVE areas must be aligned on 64 bytes.
+static u8 fpu_states[MAX_CPUS][FPU_MAX_DEPTH - 1][FPU_STATE_MAX_SIZE] __align(
+    64);
+
+// Must be called on each CPU before any kernel_fpu_begin
+void fpu_init(void) {
+    // SSE and SSE2 are part of x86-64, no need to check for them
+    write_cr0((read_cr0() | CR0_MP) & ~(u64)(CR0_EM | CR0_TS));
+    u64 cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+    if (!cpu_has(CPU_FEATURE_XSAVE)) {
+        write_cr4(cr4);
+        __asm__ volatile("fninit");
+
+        log(LOG_LEVEL_INFO, "FPU: SSE enabled, state saved by FXSAVE\n");
+        return;
+    }
+
+    write_cr4(cr4 | CR4_OSXSAVE);
+
+    u64 xcr0 = XCR0_X87 | XCR0_SSE;
+    has_avx = cpu_has(CPU_FEATURE_AVX);
+    if (has_avx) {
+        xcr0 |= XCR0_AVX;
+    }
+    xsetbv(0, xcr0);
+    __asm__ volatile("fninit");
+
+    // Size of the area for the components enabled in XCR0
+    u32 eax, ebx, ecx, edx;
+    cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+    if (ebx > FPU_STATE_MAX_SIZE) {
+        kpanic("FPU: XSAVE area of %u bytes is too large\n", ebx);
+    }
+    state_size = ebx;
+
+    save_method =
+        cpu_has(CPU_FEATURE_XSAVEOPT) ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+
+    log(LOG_LEVEL_INFO, "FPU: SSE%s enabled, state of %lu bytes saved by %s\n",
+        has_avx ? " and AVX" : "", state_size,
+        save_method == FPU_SAVE_XSAVEOPT ? "XSAVEOPT" : "XSAVE");
+}
+
+bool fpu_has_avx(void) {
+    return has_avx;
+}
+
+// Return the size of the state saved for a nested section
+u64 fpu_state_size(void) {
+    return state_size;
+}
+
+// Give the x87, SSE and AVX registers to the caller until kernel_fpu_end.
+// Sections nest: an interrupt handler may open one while the code it
+// interrupted is in another, the registers of that one are saved here.
+void kernel_fpu_begin(void) {
+    percpu_t *cpu = this_cpu();
+    u32 depth = cpu->fpu_depth;
+
+    if (depth >= FPU_MAX_DEPTH) {
+        kpanic("FPU: More than %u nested kernel_fpu_begin\n", FPU_MAX_DEPTH);
+    }
+
+    // Saved before the depth is raised: a handler running in between saves
+    // the same registers in the same area and restores them.
+    if (depth > 0) {
+        fpu_save(fpu_states[cpu->id][depth - 1]);
+    }
+    cpu->fpu_depth = depth + 1;
+}
+
+void kernel_fpu_end(void) {
+    percpu_t *cpu = this_cpu();
+    u32 depth = cpu->fpu_depth;
+
+    kassert(depth > 0);
+
+    // Restored before the depth is lowered, otherwise a handler running in
+    // between would overwrite the area with the registers of this section.
+    if (depth > 1) {
+        fpu_restore(fpu_states[cpu->id][depth - 2]);
+    }
+    cpu->fpu_depth = depth - 1;
+}
+
+// EDX:EAX selects every component enabled in XCR0
+static void fpu_save(u8 *state) {
+    switch (save_method) {
+    case FPU_SAVE_XSAVEOPT:
+        __asm__ volatile("xsaveopt64 %0"
+                         : "=m"(*state)
+                         : "a"(0xffffffff), "d"(0xffffffff)
+                         : "memory");
+        break;
+    case FPU_SAVE_XSAVE:
+        __asm__ volatile("xsave64 %0"
+                         : "=m"(*state)
+                         : "a"(0xffffffff), "d"(0xffffffff)
+                         : "memory");
+        break;
+    case FPU_SAVE_FXSAVE:
+        __asm__ volatile("fxsave64 %0" : "=m"(*state) : : "memory");
+        break;
+    }
+}
+
+static void fpu_restore(const u8 *state) {
+    if (save_method == FPU_SAVE_FXSAVE) {
+        __asm__ volatile("fxrstor64 %0" : : "m"(*state) : "memory");
+    } else {
+        __asm__ volatile("xrstor64 %0"
+                         :
+                         : "m"(*state), "a"(0xffffffff), "d"(0xffffffff)
+                         : "memory");
+    }
+}
+
+// xmm0 cannot be listed as clobbered with -mgeneral-regs-only, which also
+// guarantees that the compiler does not use it
+DEFINE_TEST(test_kernel_fpu) {
+    u64 outer = 0x0123456789abcdefUL;
+    u64 inner = ~outer;
+    u64 res;
+
+    kernel_fpu_begin();
+    __asm__ volatile("movq %0, %%xmm0" : : "r"(outer));
+
+    // As if an interrupt handler used xmm0
+    kernel_fpu_begin();
+    __asm__ volatile("movq %0, %%xmm0" : : "r"(inner));
+    kernel_fpu_end();
+
+    __asm__ volatile("movq %%xmm0, %0" : "=r"(res));
+    kernel_fpu_end();
+
+    kassert(res == outer);
+}
@@ -0,0 +1,19 @@
+#ifndef AVOCADOS_FPU_H_
+#define AVOCADOS_FPU_H_
+
+#include <stdbool.h>
+
+#include "types.h"
+
+// Number of kernel_fpu_begin sections that can be nested on a CPU: a section
+// and the sections of the interrupt handlers that may run during it
+#define FPU_MAX_DEPTH 4
+
+void fpu_init(void);
+bool fpu_has_avx(void);
+u64 fpu_state_size(void);
+
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif /* ! AVOCADOS_FPU_H_ */
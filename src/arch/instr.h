@@ -11,6 +11,25 @@ static inline void cli(void) {
     __asm__ volatile("cli");
 }
 
+static inline u64 read_rflags(void) {
+    u64 res;
+
+    __asm__ volatile("pushfq\n\t"
+                     "popq %0"
+                     : "=r"(res));
+
+    return res;
+}
+
+// Restore flags saved by read_rflags, IF included
+static inline void write_rflags(u64 val) {
+    __asm__ volatile("pushq %0\n\t"
+                     "popfq"
+                     : /* No output */
+                     : "r"(val)
+                     : "memory", "cc");
+}
+
 static inline void hlt(void) {
     __asm__ volatile("hlt");
 }
@@ -63,4 +82,62 @@ static inline u64 rdmsr(u32 msr) {
     return ((u64)res_hi << 32) | res_lo;
 }
 
+static inline void wrmsr(u32 msr, u64 val) {
+    __asm__ volatile("wrmsr"
+                     : /* No output */
+                     : "c"(msr), "a"((u32)val), "d"((u32)(val >> 32)));
+}
+
+// Time stamp counter, not serializing
+static inline u64 rdtsc(void) {
+    u32 res_lo, res_hi;
+
+    __asm__ volatile("rdtsc" : "=d"(res_hi), "=a"(res_lo));
+
+    return ((u64)res_hi << 32) | res_lo;
+}
+
+static inline void cpuid(u32 leaf, u32 subleaf, u32 *eax, u32 *ebx, u32 *ecx,
+                         u32 *edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(subleaf));
+}
+
+static inline u64 read_cr0(void) {
+    u64 res;
+
+    __asm__ volatile("mov %%cr0, %0" : "=r"(res));
+
+    return res;
+}
+
+static inline void write_cr0(u64 val) {
+    __asm__ volatile("mov %0, %%cr0" : /* No output */ : "r"(val) : "memory");
+}
+
+static inline u64 read_cr4(void) {
+    u64 res;
+
+    __asm__ volatile("mov %%cr4, %0" : "=r"(res));
+
+    return res;
+}
+
+static inline void write_cr4(u64 val) {
+    __asm__ volatile("mov %0, %%cr4" : /* No output */ : "r"(val) : "memory");
+}
+
+// CR4.OSXSAVE must be set
+static inline void xsetbv(u32 xcr, u64 val) {
+    __asm__ volatile("xsetbv"
+                     : /* No output */
+                     : "c"(xcr), "a"((u32)val), "d"((u32)(val >> 32)));
+}
+
+// Invalidate the TLB entries of the page containing addr
+static inline void invlpg(u64 addr) {
+    __asm__ volatile("invlpg (%0)" : /* No output */ : "r"(addr) : "memory");
+}
+
 #endif /* ! AVOCADOS_INSTR_H_ */
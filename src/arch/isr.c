@@ -1,8 +1,14 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_ISR
+
 #include "attributes.h"
 #include "drivers/apic.h"
 #include "libk/log.h"
 #include "types.h"
 
+// The handlers are C functions: the direction flag is cleared as the ABI
+// requires, it is restored by iretq with the rest of RFLAGS. The x87, SSE and
+// AVX registers are not saved, the kernel only touches them between
+// kernel_fpu_begin and kernel_fpu_end, which nest if a handler needs them.
 #define DEF_ISR(VECTOR, HANDLER) _DEF_ISR(VECTOR, HANDLER)
 
 #define _DEF_ISR(VECTOR, HANDLER)                                              \
@@ -23,6 +29,7 @@
                          "push %r14\n"                                         \
                          "push %r15\n"                                         \
                                                                                \
+                         "cld\n"                                               \
                          "call " #HANDLER "\n"                                 \
                                                                                \
                          "pop %r15\n"                                          \
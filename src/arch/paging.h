@@ -8,6 +8,10 @@
 #include "types.h"
 #include "utils.h"
 
+// Pages in physical memory are called page frames. (Vol. 3A 2.1.5)
+// TODO: Assert that page frame size is a power of two
+#define PAGE_SIZE 4096U
+
 // Paging structure size is 4096 bytes (see Vol. 3A 4.2)
 #define PAGING_STRUCT_SIZE 4096U
 
@@ -62,6 +66,30 @@ _Static_assert(sizeof(pde_t) == 8);
 typedef pde_t
     pdt_t[PAGING_STRUCT_SIZE / sizeof(pde_t)] __align(PAGING_STRUCT_SIZE);
 
+// Size of the page mapped by a page-directory entry with the PS flag
+#define LARGE_PAGE_SIZE 0x200000UL
+
+// Page-directory entry that maps a 2-MByte page
+typedef struct {
+    u64 present : 1;
+    u64 rw : 1;
+    u64 us : 1;
+    u64 pwt : 1;
+    u64 pcd : 1;
+    u64 a : 1;
+    u64 d : 1;
+    u64 ps : 1;
+    u64 g : 1;
+    u64 ignored0 : 2;
+    u64 r : 1;
+    u64 pat : 1;
+    u64 reserved : 8;
+    u64 addr : 31;
+    u64 ignored1 : 11;
+    u64 xd : 1;
+} __packed pde_large_t;
+_Static_assert(sizeof(pde_large_t) == 8);
+
 // Page-table entry that maps a 4-KByte page
 typedef struct {
     u64 present : 1;
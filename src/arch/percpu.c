@@ -0,0 +1,21 @@
+#include "instr.h"
+#include "libk/kassert.h"
+#include "percpu.h"
+#include "regs.h"
+
+static percpu_t percpus[MAX_CPUS];
+
+// Must be called on each CPU before any use of this_cpu or cpu_id. cpu_id is
+// the kernel index given to the calling CPU (0 for the bootstrap processor).
+void percpu_init(u32 cpu_id) {
+    kassert(cpu_id < MAX_CPUS);
+
+    percpu_t *cpu = &percpus[cpu_id];
+    cpu->self = cpu;
+    cpu->id = cpu_id;
+    cpu->node = 0;
+    cpu->fpu_depth = 0;
+    cpu->kprintf_depth = 0;
+
+    wrmsr(MSR_IA32_GS_BASE, (u64)cpu);
+}
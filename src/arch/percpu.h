@@ -0,0 +1,52 @@
+#ifndef AVOCADOS_PERCPU_H_
+#define AVOCADOS_PERCPU_H_
+
+#include <stddef.h>
+
+#include "attributes.h"
+#include "types.h"
+
+// Maximum number of CPUs supported by the kernel
+#define MAX_CPUS 16
+
+// Data written by a single CPU should be aligned on a cache line to avoid
+// false sharing with other CPUs.
+#define CACHE_LINE_SIZE 64
+
+// Data private to a CPU. The GS base of each CPU points to its own percpu_t so
+// that it can be reached without knowing the CPU index.
+typedef struct percpu {
+    // Address of this structure, read through gs
+    struct percpu *self;
+    // Kernel index of the CPU in [0, MAX_CPUS)
+    u32 id;
+    // NUMA node of the CPU
+    u32 node;
+    // Number of nested kernel_fpu_begin sections running on the CPU
+    u32 fpu_depth;
+    // Number of nested kprintf calls running on the CPU
+    u32 kprintf_depth;
+} __align(CACHE_LINE_SIZE) percpu_t;
+
+void percpu_init(u32 cpu_id);
+
+static inline percpu_t *this_cpu(void) {
+    percpu_t *cpu;
+
+    __asm__("mov %%gs:%c1, %0" : "=r"(cpu) : "i"(offsetof(percpu_t, self)));
+
+    return cpu;
+}
+
+// Return the index of the CPU executing this function.
+// As long as no preemption exists, the result stays valid until the caller
+// enables interrupts.
+static inline u32 cpu_id(void) {
+    u32 id;
+
+    __asm__("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(percpu_t, id)));
+
+    return id;
+}
+
+#endif /* ! AVOCADOS_PERCPU_H_ */
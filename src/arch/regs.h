@@ -3,13 +3,31 @@
 
 // Control registers (See Vol. 3A 2.5)
 
+// Monitor coprocessor: wait and fwait honor CR0.TS
+#define CR0_MP (1U << 1)
+// x87 FPU emulation, SSE instructions raise #UD when set
+#define CR0_EM (1U << 2)
+// Task switched: x87 and SSE instructions raise #NM when set
+#define CR0_TS (1U << 3)
 // Enable/disable paging
 #define CR0_PG (1U << 31)
 
 // Enable/disable paging to produce addresses with more than 32 bits
 #define CR4_PAE (1U << 5)
+// Enable FXSAVE, FXRSTOR and the SSE instructions
+#define CR4_OSFXSR (1U << 9)
+// Report unmasked SIMD floating-point exceptions with #XM instead of #UD
+#define CR4_OSXMMEXCPT (1U << 10)
 // 5-level paging/4-level paging
 #define CR4_LA57 (1U << 12)
+// Enable XSAVE, XRSTOR, XSETBV and XGETBV
+#define CR4_OSXSAVE (1U << 18)
+
+// Extended control register 0, the state components managed by XSAVE (See
+// Vol. 1 13.3)
+#define XCR0_X87 (1U << 0)
+#define XCR0_SSE (1U << 1)
+#define XCR0_AVX (1U << 2)
 
 // Extended feature enable register (See Vol. 3A 2.2.1)
 // Enables IA-32e mode operation
@@ -22,5 +40,6 @@
 // See Vol. 4
 #define MSR_IA32_APIC_BASE 0x1b
 #define MSR_IA32_EFER 0xc0000080
+#define MSR_IA32_GS_BASE 0xc0000101
 
 #endif /* ! AVOCADOS_REGISTERS_H_ */
@@ -0,0 +1,35 @@
+#ifndef AVOCADOS_SPINLOCK_H_
+#define AVOCADOS_SPINLOCK_H_
+
+#include <stdbool.h>
+
+#include "arch/instr.h"
+#include "types.h"
+
+// Test and test-and-set lock. Waiters spin on a plain load so that the cache
+// line stays shared until the owner releases it.
+// Interrupts are not disabled: code running in interrupt handlers must not take
+// a lock that the interrupted code may hold.
+typedef struct {
+    u32 locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT ((spinlock_t){ .locked = 0 })
+
+static inline bool spin_trylock(spinlock_t *lock) {
+    return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    while (!spin_trylock(lock)) {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED) != 0) {
+            pause();
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif /* ! AVOCADOS_SPINLOCK_H_ */
@@ -1,17 +1,62 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_DRIVERS
+
 #include <stddef.h>
 
 #include "acpi.h"
+#include "arch/instr.h"
+#include "arch/paging.h"
 #include "libk/kassert.h"
 #include "libk/kprintf.h"
 #include "libk/log.h"
+#include "libk/mem.h"
 #include "libk/string.h"
+#include "mm/numa.h"
+#include "mm/pmm.h"
 #include "mm/vmm.h"
 #include "utils.h"
 
+// Before pmm_init, ACPI tables are read through a window of 4KiB pages whose
+// page table is in the kernel image, so that no frame has to be allocated
+#define ACPI_EARLY_VIRT_ADDR 0x000000000fc00000UL
+
+// Copies of the tables kept by acpi_reclaim, right after the 2GiB reserved to
+// the mapping of the ACPI region
+#define ACPI_TABLES_VIRT_ADDR 0x0000001080000000UL
+
+// Maximum number of ACPI reclaimable ranges given back to the PMM
+#define ACPI_MAX_RECLAIMABLE_RANGES 8
+
+static void *acpi_early_map(u64 phys_addr, u64 len);
+static const description_header_t *acpi_early_map_table(u64 phys_addr);
+static void acpi_early_unmap_all(void);
+static void acpi_prepare_numa(void);
+static void acpi_parse_srat(const srat_t *srat);
+static void acpi_parse_slit(const slit_t *slit);
+static void acpi_unmap_region(void);
+
 rsdp_t g_rsdp;
 u64 acpi_region_addr;
 u64 acpi_region_len;
 
+static pt_t acpi_early_pt;
+// Number of pages mapped in the early window
+static u64 acpi_early_num_pages = 0;
+
+// Memory holding ACPI tables that is free once the tables are read
+static struct {
+    u64 addr;
+    u64 len;
+} acpi_reclaimable_ranges[ACPI_MAX_RECLAIMABLE_RANGES];
+static u64 acpi_num_reclaimable_ranges = 0;
+
+// Tables still used once ACPI reclaimable memory is given back to the PMM
+static const char acpi_kept_signatures[][4] = { "APIC", "HPET" };
+#define ACPI_NUM_KEPT_TABLES                                                   \
+    (sizeof(acpi_kept_signatures) / sizeof(acpi_kept_signatures[0]))
+// Copies of the kept tables made by acpi_reclaim, NULL if a table is missing
+static const description_header_t *acpi_kept_tables[ACPI_NUM_KEPT_TABLES];
+static bool acpi_reclaimed = false;
+
 // This function does not init ACPI but stores ACPI informations to be able to
 // use ACPI after pmm_init.
 void acpi_prepare(const struct multiboot_tag_old_acpi *old_acpi_tag,
@@ -32,6 +77,21 @@ void acpi_prepare(const struct multiboot_tag_old_acpi *old_acpi_tag,
              + i * sizeof(struct multiboot_mmap_entry)
          < mmap_tag->size;
          i++) {
+        if (mmap_tag->entries[i].type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE) {
+            if (acpi_num_reclaimable_ranges < ACPI_MAX_RECLAIMABLE_RANGES) {
+                acpi_reclaimable_ranges[acpi_num_reclaimable_ranges].addr =
+                    mmap_tag->entries[i].addr;
+                acpi_reclaimable_ranges[acpi_num_reclaimable_ranges].len =
+                    mmap_tag->entries[i].len;
+                acpi_num_reclaimable_ranges += 1;
+            } else {
+                log(LOG_LEVEL_WARN,
+                    "ACPI: Reclaimable memory at 0x%016lx will not be "
+                    "reclaimed\n",
+                    (u64)mmap_tag->entries[i].addr);
+            }
+        }
+
         if (g_rsdp.rsdt_phys_addr >= mmap_tag->entries[i].addr
             && g_rsdp.rsdt_phys_addr
                 < mmap_tag->entries[i].addr + mmap_tag->entries[i].len) {
@@ -44,6 +104,219 @@ void acpi_prepare(const struct multiboot_tag_old_acpi *old_acpi_tag,
         }
     }
     kassert(acpi_region_found);
+
+    acpi_prepare_numa();
+}
+
+// Copy the tables still needed (acpi_kept_signatures) to memory owned by the
+// kernel, then give ACPI reclaimable memory to the PMM. The ACPI region must
+// be mapped, it is unmapped afterwards and acpi_rsdt_find_table only finds the
+// kept tables.
+void acpi_reclaim(void) {
+    kassert(!acpi_reclaimed);
+
+    u64 virt_addr = ACPI_TABLES_VIRT_ADDR;
+    for (u64 i = 0; i < ACPI_NUM_KEPT_TABLES; ++i) {
+        char signature[4];
+        memcpy((u8 *)signature, (const u8 *)acpi_kept_signatures[i], 4);
+
+        const description_header_t *table = acpi_rsdt_find_table(signature);
+        if (table == NULL) {
+            acpi_kept_tables[i] = NULL;
+            continue;
+        }
+
+        u64 len = ALIGN_UP(table->length, PAGE_SIZE);
+        for (u64 offset = 0; offset < len; offset += PAGE_SIZE) {
+            u64 res = vmm_alloc(virt_addr + offset, VMM_ALLOC_RW);
+            kassert(res != VMM_ALLOC_ERROR);
+        }
+        memcpy((u8 *)virt_addr, (const u8 *)table, table->length);
+
+        acpi_kept_tables[i] = (const void *)virt_addr;
+        virt_addr += len;
+    }
+    acpi_reclaimed = true;
+
+    acpi_unmap_region();
+
+    u64 num_frames = 0;
+    for (u64 i = 0; i < acpi_num_reclaimable_ranges; ++i) {
+        num_frames += pmm_free_reserved(acpi_reclaimable_ranges[i].addr,
+                                        acpi_reclaimable_ranges[i].addr
+                                            + acpi_reclaimable_ranges[i].len);
+    }
+
+    log(LOG_LEVEL_INFO, "ACPI: Reclaimed %lu page frames\n", num_frames);
+}
+
+// Remove the mapping made by acpi_map_region without freeing the frames, which
+// do not belong to the VMM. Page tables are kept.
+static void acpi_unmap_region(void) {
+    for (u64 offset = 0; offset < acpi_region_len; offset += PAGE_SIZE) {
+        get_pte(ACPI_VIRT_ADDR + offset)->present = 0;
+        invlpg(ACPI_VIRT_ADDR + offset);
+    }
+}
+
+// Map [phys_addr, phys_addr + len) in the early window and return the virtual
+// address of phys_addr. Mappings are only removed by acpi_early_unmap_all.
+static void *acpi_early_map(u64 phys_addr, u64 len) {
+    pde_t *pde = get_pde(ACPI_EARLY_VIRT_ADDR);
+    if (!pde->present) {
+        // acpi_early_pt is in bss, so every entry is already not present
+        *pde = (pde_t){
+            .present = 1,
+            .rw = 1,
+            .us = 0,
+            .addr = BIT_RANGE((u64)&acpi_early_pt, 12, 51),
+            .xd = 1,
+        };
+    }
+
+    u64 first_page = ALIGN_DOWN(phys_addr, PAGE_SIZE);
+    u64 num_pages = (ALIGN_UP(phys_addr + len, PAGE_SIZE) - first_page)
+        / PAGE_SIZE;
+    kassert(acpi_early_num_pages + num_pages
+            <= PAGING_STRUCT_SIZE / sizeof(pte_t));
+
+    u64 virt_addr = ACPI_EARLY_VIRT_ADDR + acpi_early_num_pages * PAGE_SIZE;
+    for (u64 i = 0; i < num_pages; ++i) {
+        acpi_early_pt[acpi_early_num_pages + i] = (pte_t){
+            .present = 1,
+            .rw = 0,
+            .us = 0,
+            .addr = BIT_RANGE(first_page + i * PAGE_SIZE, 12, 51),
+            .xd = 1,
+        };
+    }
+    acpi_early_num_pages += num_pages;
+
+    return (void *)(virt_addr + phys_addr - first_page);
+}
+
+// Map a whole table in the early window
+static const description_header_t *acpi_early_map_table(u64 phys_addr) {
+    const description_header_t *header =
+        acpi_early_map(phys_addr, sizeof(description_header_t));
+
+    return acpi_early_map(phys_addr, header->length);
+}
+
+static void acpi_early_unmap_all(void) {
+    for (u64 i = 0; i < acpi_early_num_pages; ++i) {
+        acpi_early_pt[i].present = 0;
+        invlpg(ACPI_EARLY_VIRT_ADDR + i * PAGE_SIZE);
+    }
+    acpi_early_num_pages = 0;
+
+    get_pde(ACPI_EARLY_VIRT_ADDR)->present = 0;
+    invlpg(ACPI_EARLY_VIRT_ADDR);
+}
+
+// The NUMA topology must be known by pmm_init, which runs before ACPI tables
+// are mapped by acpi_map_region.
+static void acpi_prepare_numa(void) {
+    const rsdt_t *rsdt =
+        (const void *)acpi_early_map_table(g_rsdp.rsdt_phys_addr);
+
+    const srat_t *srat = NULL;
+    const slit_t *slit = NULL;
+    for (u64 i = 0;
+         i * sizeof(u32) + offsetof(rsdt_t, entry) < rsdt->header.length; ++i) {
+        const description_header_t *header =
+            acpi_early_map(rsdt->entry[i], sizeof(description_header_t));
+
+        if (strncmp(header->signature, "SRAT", 4) == 0) {
+            srat = (const void *)acpi_early_map_table(rsdt->entry[i]);
+        } else if (strncmp(header->signature, "SLIT", 4) == 0) {
+            slit = (const void *)acpi_early_map_table(rsdt->entry[i]);
+        }
+    }
+
+    if (srat != NULL) {
+        kassert(acpi_table_is_valid_checksum(&srat->header));
+        acpi_parse_srat(srat);
+    } else {
+        log(LOG_LEVEL_INFO, "ACPI: No SRAT, assuming a single NUMA node\n");
+    }
+
+    if (slit != NULL) {
+        kassert(acpi_table_is_valid_checksum(&slit->header));
+        acpi_parse_slit(slit);
+    }
+
+    numa_build_fallback_lists();
+
+    acpi_early_unmap_all();
+}
+
+static void acpi_parse_srat(const srat_t *srat) {
+    const srat_affinity_t *affinity = (const void *)(srat + 1);
+    while ((u64)affinity - (u64)srat < srat->header.length) {
+        if (affinity->type == SRAT_AFFINITY_LAPIC) {
+            const srat_affinity_lapic_t *a = (const void *)affinity;
+            u32 proximity_domain = a->proximity_domain_lo
+                | (u32)a->proximity_domain_hi[0] << 8
+                | (u32)a->proximity_domain_hi[1] << 16
+                | (u32)a->proximity_domain_hi[2] << 24;
+
+            // Disabled entries must not create nodes
+            u32 node = (a->flags & SRAT_AFFINITY_ENABLED)
+                ? numa_add_domain(proximity_domain)
+                : NUMA_NO_NODE;
+            if (node != NUMA_NO_NODE) {
+                numa_add_cpu(a->apic_id, node);
+            }
+        } else if (affinity->type == SRAT_AFFINITY_MEMORY) {
+            const srat_affinity_memory_t *a = (const void *)affinity;
+            u64 base_addr = (u64)a->base_addr_hi << 32 | a->base_addr_lo;
+            u64 len = (u64)a->length_hi << 32 | a->length_lo;
+
+            u32 node = (a->flags & SRAT_AFFINITY_ENABLED)
+                ? numa_add_domain(a->proximity_domain)
+                : NUMA_NO_NODE;
+            if (node != NUMA_NO_NODE) {
+                log(LOG_LEVEL_DEBUG,
+                    "ACPI: Memory 0x%016lx-0x%016lx in NUMA node %u\n",
+                    base_addr, base_addr + len, node);
+                numa_add_memory_range(node, base_addr, len);
+            }
+        } else if (affinity->type == SRAT_AFFINITY_X2APIC) {
+            const srat_affinity_x2apic_t *a = (const void *)affinity;
+
+            u32 node = (a->flags & SRAT_AFFINITY_ENABLED)
+                ? numa_add_domain(a->proximity_domain)
+                : NUMA_NO_NODE;
+            if (node != NUMA_NO_NODE) {
+                numa_add_cpu(a->x2apic_id, node);
+            }
+        }
+
+        if (affinity->length == 0) {
+            log(LOG_LEVEL_WARN, "ACPI: Invalid SRAT entry of length 0\n");
+            break;
+        }
+        affinity = (const void *)((u64)affinity + affinity->length);
+    }
+}
+
+// Localities of the SLIT are proximity domains
+static void acpi_parse_slit(const slit_t *slit) {
+    for (u64 i = 0; i < slit->num_localities; ++i) {
+        u32 from = numa_domain_to_node((u32)i);
+        if (from == NUMA_NO_NODE) {
+            continue;
+        }
+
+        for (u64 j = 0; j < slit->num_localities; ++j) {
+            u32 to = numa_domain_to_node((u32)j);
+            if (to != NUMA_NO_NODE) {
+                numa_set_distance(from, to,
+                                  slit->entries[i * slit->num_localities + j]);
+            }
+        }
+    }
 }
 
 u64 acpi_map_region(void) {
@@ -53,6 +326,16 @@ u64 acpi_map_region(void) {
 
 // Returns NULL if not found
 const description_header_t *acpi_rsdt_find_table(char signature[4]) {
+    if (acpi_reclaimed) {
+        for (u64 i = 0; i < ACPI_NUM_KEPT_TABLES; ++i) {
+            if (strncmp(acpi_kept_signatures[i], signature, 4) == 0) {
+                return acpi_kept_tables[i];
+            }
+        }
+
+        return NULL;
+    }
+
     const rsdt_t *rsdt = (void *)ACPI_PHYS_TO_VIRT(g_rsdp.rsdt_phys_addr);
 
     const description_header_t *description_header = NULL;
@@ -109,9 +109,72 @@ typedef struct {
     u8 attrs;
 } __packed hpet_description_table_t;
 
+// System Resource Affinity Table (ACPI 6.5 5.2.16)
+typedef struct {
+    description_header_t header;
+    u32 __reserved1;
+    u64 __reserved2;
+} __packed srat_t;
+
+typedef struct {
+#define SRAT_AFFINITY_LAPIC 0
+#define SRAT_AFFINITY_MEMORY 1
+#define SRAT_AFFINITY_X2APIC 2
+    u8 type;
+    u8 length;
+} __packed srat_affinity_t;
+
+// Affinity structures are only used when this flag is set
+#define SRAT_AFFINITY_ENABLED (1 << 0)
+
+typedef struct {
+    u8 type;
+    u8 length;
+    u8 proximity_domain_lo;
+    u8 apic_id;
+    u32 flags;
+    u8 local_sapic_eid;
+    u8 proximity_domain_hi[3];
+    u32 clock_domain;
+} __packed srat_affinity_lapic_t;
+
+typedef struct {
+    u8 type;
+    u8 length;
+    u32 proximity_domain;
+    u16 __reserved1;
+    u32 base_addr_lo;
+    u32 base_addr_hi;
+    u32 length_lo;
+    u32 length_hi;
+    u32 __reserved2;
+    u32 flags;
+    u64 __reserved3;
+} __packed srat_affinity_memory_t;
+
+typedef struct {
+    u8 type;
+    u8 length;
+    u16 __reserved1;
+    u32 proximity_domain;
+    u32 x2apic_id;
+    u32 flags;
+    u32 clock_domain;
+    u32 __reserved2;
+} __packed srat_affinity_x2apic_t;
+
+// System Locality Information Table (ACPI 6.5 5.2.17)
+typedef struct {
+    description_header_t header;
+    u64 num_localities;
+    // num_localities * num_localities distances, row-major
+    u8 entries[];
+} __packed slit_t;
+
 void acpi_prepare(const struct multiboot_tag_old_acpi *old_acpi_tag,
                   const struct multiboot_tag_mmap *mmap_tag);
 u64 acpi_map_region(void);
+void acpi_reclaim(void);
 
 const description_header_t *acpi_rsdt_find_table(char signature[4]);
 u32 acpi_madt_find_ioapic_addr(const madt_t *madt);
@@ -1,6 +1,10 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_DRIVERS
+
 #include "apic.h"
+#include "arch/cpu_features.h"
 #include "arch/instr.h"
 #include "arch/regs.h"
+#include "attributes.h"
 #include "libk/kassert.h"
 #include "libk/kprintf.h"
 #include "libk/log.h"
@@ -9,13 +13,23 @@
 #define LAPIC_VIRT_ADDR 0x0000001100000000UL
 #define IOAPIC_VIRT_ADDR 0x0000001100001000UL
 
-// All 32-bit registers should be accessed using 128-bit aligned 32-bit
-// loads or stores. (See Vol. 3A 11.4.1)
-#define REG_LAPIC_ID ((volatile u32 *)(LAPIC_VIRT_ADDR + 0x20))
-#define REG_EOI ((volatile u32 *)(LAPIC_VIRT_ADDR + 0xb0))
-#define REG_SVR ((volatile u32 *)(LAPIC_VIRT_ADDR + 0xf0))
-#define REG_LVT_LINT0 ((volatile u32 *)(LAPIC_VIRT_ADDR + 0x350))
-#define REG_LVT_LINT1 ((volatile u32 *)(LAPIC_VIRT_ADDR + 0x360))
+// Offsets of the local APIC registers. In xAPIC mode, all 32-bit registers
+// should be accessed using 128-bit aligned 32-bit loads or stores (See Vol. 3A
+// 11.4.1). In x2APIC mode, they are MSRs (See Vol. 3A 11.12.1.2).
+#define REG_LAPIC_ID 0x20
+#define REG_EOI 0xb0
+#define REG_SVR 0xf0
+#define REG_ISR(N) (0x100U + (N)*0x10U)
+#define REG_LVT_LINT0 0x350
+#define REG_LVT_LINT1 0x360
+
+#define X2APIC_MSR(REG) (0x800U + (REG) / 0x10U)
+
+#define IA32_APIC_BASE_EXTD (1U << 10)
+#define IA32_APIC_BASE_EN (1U << 11)
+
+// Number of 32-bit in-service registers
+#define LAPIC_NUM_ISR 8
 
 // Same between lapic and ioapic
 #define DELIVERY_MODE_FIXED 0b000
@@ -48,7 +62,12 @@
 #define IOREDTBL_HI(N) (0x11U + (N)*2)
 
 static void disable_dual_8259a_pic(void);
+static void lapic_write(u32 reg, u32 val);
+static void lapic_print_in_service(const u32 *isr);
 static inline u32 ioapic_read_register(u32 offset);
+
+// Whether the local APIC is accessed through MSRs instead of MMIO
+static bool x2apic = false;
 static void ioapic_set_io_redirection_table(u8 num, u8 vector, u8 delivery_mode,
                                             u8 destination_mode, u8 polarity,
                                             u8 trigger_mode, u8 mask,
@@ -62,16 +81,23 @@ void apic_init(u64 lapic_phys_addr, u64 ioapic_phys_addr, bool has_8259a) {
     // See Vol. 3A 11.4.1
 
     u64 ia32_apic_base = rdmsr(MSR_IA32_APIC_BASE);
-    if (!(ia32_apic_base & (1 << 11))) {
+    if (!(ia32_apic_base & IA32_APIC_BASE_EN)) {
         kpanic("APIC is global disabled\n");
     }
     kassert((ia32_apic_base & 0xfffff000) == lapic_phys_addr);
 
-    u64 res = vmm_map_physical(LAPIC_VIRT_ADDR, lapic_phys_addr, 4096, 0);
-    if (res == VMM_ALLOC_ERROR) {
-        kpanic("Failed to map local APIC registers\n");
+    // apic_eoi is patched by alternatives_apply to match this choice
+    if (cpu_has(CPU_FEATURE_X2APIC)) {
+        wrmsr(MSR_IA32_APIC_BASE, ia32_apic_base | IA32_APIC_BASE_EXTD);
+        x2apic = true;
+        log(LOG_LEVEL_DEBUG, "APIC: Local APIC in x2APIC mode\n");
+    } else {
+        u64 res = vmm_map_physical(LAPIC_VIRT_ADDR, lapic_phys_addr, 4096, 0);
+        if (res == VMM_ALLOC_ERROR) {
+            kpanic("Failed to map local APIC registers\n");
+        }
+        log(LOG_LEVEL_DEBUG, "APIC: Local APIC mapped\n");
     }
-    log(LOG_LEVEL_DEBUG, "APIC: Local APIC mapped\n");
 
     // If PCAT_COMPAT the 8259 vectors must be disabled when enabling the
     // ACPI APIC operation
@@ -80,16 +106,18 @@ void apic_init(u64 lapic_phys_addr, u64 ioapic_phys_addr, bool has_8259a) {
     }
 
     // TODO: How do we handle nmi ?
-    *REG_LVT_LINT0 = LVT_LINT(VECTOR_NUMBER_LINT0, DELIVERY_MODE_FIXED,
-                              POLARITY_ACTIVE_HIGH, TRIGGER_MODE_EDGE, 0);
+    lapic_write(REG_LVT_LINT0,
+                LVT_LINT(VECTOR_NUMBER_LINT0, DELIVERY_MODE_FIXED,
+                         POLARITY_ACTIVE_HIGH, TRIGGER_MODE_EDGE, 0));
     // Software should always set the trigger mode in the LVT LINT1 register to
     // edge sensitive. (See Vol. 3A 11.5.1)
-    *REG_LVT_LINT1 = LVT_LINT(VECTOR_NUMBER_LINT1, DELIVERY_MODE_FIXED,
-                              POLARITY_ACTIVE_HIGH, TRIGGER_MODE_EDGE, 0);
+    lapic_write(REG_LVT_LINT1,
+                LVT_LINT(VECTOR_NUMBER_LINT1, DELIVERY_MODE_FIXED,
+                         POLARITY_ACTIVE_HIGH, TRIGGER_MODE_EDGE, 0));
     // Setup spurious interrupt and software enable APIC
-    *REG_SVR = SVR(VECTOR_NUMBER_SPURIOUS_INT, 1);
+    lapic_write(REG_SVR, SVR(VECTOR_NUMBER_SPURIOUS_INT, 1));
 
-    res = vmm_map_physical(IOAPIC_VIRT_ADDR, ioapic_phys_addr, 4096, 0);
+    u64 res = vmm_map_physical(IOAPIC_VIRT_ADDR, ioapic_phys_addr, 4096, 0);
     if (res == VMM_ALLOC_ERROR) {
         kpanic("Failed to map IO APIC registers\n");
     }
@@ -158,20 +186,62 @@ static void ioapic_set_io_redirection_table(u8 num, u8 vector, u8 delivery_mode,
     *REG_IOWIN = (u32)destination << (56 - 32);
 }
 
-void apic_eoi(void) {
-    volatile u32 *isr = (volatile u32 *)(LAPIC_VIRT_ADDR + 0x100);
-    for (u8 i = 0; i < 8; ++i) {
-        if (*isr != 0) {
+static void lapic_write(u32 reg, u32 val) {
+    if (x2apic) {
+        wrmsr(X2APIC_MSR(reg), val);
+    } else {
+        *(volatile u32 *)(LAPIC_VIRT_ADDR + reg) = val;
+    }
+}
+
+// apic_eoi calls these from an asm statement, at any alignment of the stack.
+// They align it on 16 bytes, as the ABI requires at a call, before running the
+// C implementation.
+#define DEF_EOI_STUB(NAME, IMPL)                                               \
+    __naked void NAME(void) {                                                  \
+        __asm__ volatile("push %rbp\n"                                         \
+                         "mov %rsp, %rbp\n"                                    \
+                         "and $-16, %rsp\n"                                    \
+                         "call " #IMPL "\n"                                    \
+                         "leave\n"                                             \
+                         "ret\n");                                             \
+    }
+
+// apic_eoi is patched to apic_eoi_x2apic in x2APIC mode
+DEF_EOI_STUB(apic_eoi_mmio, lapic_eoi_mmio);
+DEF_EOI_STUB(apic_eoi_x2apic, lapic_eoi_x2apic);
+
+__used static void lapic_eoi_mmio(void) {
+    u32 isr[LAPIC_NUM_ISR];
+    for (u32 i = 0; i < LAPIC_NUM_ISR; ++i) {
+        isr[i] = *(volatile u32 *)(LAPIC_VIRT_ADDR + REG_ISR(i));
+    }
+    lapic_print_in_service(isr);
+
+    // Just need a write to EOI
+    *(volatile u32 *)(LAPIC_VIRT_ADDR + REG_EOI) = 0;
+}
+
+__used static void lapic_eoi_x2apic(void) {
+    u32 isr[LAPIC_NUM_ISR];
+    for (u32 i = 0; i < LAPIC_NUM_ISR; ++i) {
+        isr[i] = (u32)rdmsr(X2APIC_MSR(REG_ISR(i)));
+    }
+    lapic_print_in_service(isr);
+
+    wrmsr(X2APIC_MSR(REG_EOI), 0);
+}
+
+// Print the lowest in-service vector of each in-service register
+static void lapic_print_in_service(const u32 *isr) {
+    for (u32 i = 0; i < LAPIC_NUM_ISR; ++i) {
+        if (isr[i] != 0) {
             for (u32 j = 0; j < 32; ++j) {
-                if (((*isr >> j) & 1) == 1) {
+                if (((isr[i] >> j) & 1) == 1) {
                     kprintf("isr: %u\n", i * 32 + j);
                     break;
                 }
             }
         }
-        isr = (volatile u32 *)((u64)isr + 0x10);
     }
-
-    // Just need a write to EOI
-    *REG_EOI = 0;
 }
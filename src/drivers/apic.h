@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#include "arch/alternative.h"
+#include "arch/cpu_features.h"
 #include "types.h"
 
 // 32 to 64
@@ -13,6 +15,18 @@
 
 void apic_init(u64 lapic_phys_addr, u64 ioapic_phys_addr, bool has_8259a);
 void ioapic_unmask_interrupt(u8 interrupt);
-void apic_eoi(void);
+void apic_eoi_mmio(void);
+void apic_eoi_x2apic(void);
+
+// Signal the end of the interrupt being handled. The call goes to the MMIO or
+// x2APIC variant without checking the mode of the local APIC, see
+// alternatives_apply.
+static inline void apic_eoi(void) {
+    __asm__ volatile(ALTERNATIVE_CALL("apic_eoi_mmio", "apic_eoi_x2apic",
+                                      CPU_FEATURE_X2APIC)
+                     : /* No output */
+                     : /* No input */
+                     : ALTERNATIVE_C_CLOBBERS);
+}
 
 #endif /* ! AVOCADOS_APIC_H_ */
@@ -1,3 +1,5 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_DRIVERS
+
 #include "framebuffer.h"
 #include "libk/kassert.h"
 #include "libk/log.h"
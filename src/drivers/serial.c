@@ -111,3 +111,10 @@ void serial_puts(enum serial_port port, const char *str) {
         str += 1;
     }
 }
+
+// Write binary data, without fixing line endings
+void serial_write_raw(enum serial_port port, const u8 *buf, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        serial_write_byte(port, buf[i]);
+    }
+}
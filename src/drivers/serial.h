@@ -37,5 +37,6 @@ bool serial_can_transmit(enum serial_port port);
 void serial_write_byte(enum serial_port port, u8 byte);
 void serial_write(enum serial_port port, const char *buf, size_t count);
 void serial_puts(enum serial_port port, const char *str);
+void serial_write_raw(enum serial_port port, const u8 *buf, size_t count);
 
 #endif /* ! AVOCADOS_SERIAL_H_ */
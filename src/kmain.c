@@ -1,9 +1,13 @@
 #include <stddef.h>
 #include <stdnoreturn.h>
 
+#include "arch/alternative.h"
+#include "arch/cpu_features.h"
+#include "arch/fpu.h"
 #include "arch/gdt.h"
 #include "arch/idt.h"
 #include "arch/instr.h"
+#include "arch/percpu.h"
 #include "attributes.h"
 #include "avocados.h"
 #include "backtrace.h"
@@ -13,12 +17,17 @@
 #include "drivers/hpet.h"
 #include "drivers/pci.h"
 #include "drivers/serial.h"
+#include "libk/binlog.h"
 #include "libk/kassert.h"
 #include "libk/kprintf.h"
 #include "libk/log.h"
 #include "libk/panic.h"
+#include "mm/memblock.h"
+#include "mm/numa.h"
+#include "mm/page_color.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
+#include "mm/zero_pool.h"
 #include "multiboot2.h"
 #include "multiboot_utils.h"
 #include "tools/test.h"
@@ -28,8 +37,17 @@
 
 u8 kernel_stack[KERNEL_STACK_SIZE] __align(16);
 
+// Code only run by the bootstrap processor before long mode
+extern u64 _sboot;
+extern u64 _eboot;
+
 noreturn void kmain(multiboot_uint32_t magic, u64 multiboot_info_addr) {
     serial_init(SERIAL_PORT_COM1, SERIAL_BAUDRATE_38400);
+    percpu_init(0);
+    cpu_features_init();
+    cpu_features_print();
+    alternatives_apply();
+    fpu_init();
 
     run_tests();
 
@@ -60,6 +78,7 @@ noreturn void kmain(multiboot_uint32_t magic, u64 multiboot_info_addr) {
 
     const struct multiboot_tag_mmap *mmap_tag = (void *)tag;
     multiboot_print_mmap(mmap_tag);
+    memblock_init(mmap_tag);
 
     tag = multiboot_find_tag((void *)(multiboot_info_addr + 8),
                              MULTIBOOT_TAG_TYPE_ACPI_OLD);
@@ -77,14 +96,23 @@ noreturn void kmain(multiboot_uint32_t magic, u64 multiboot_info_addr) {
     }
 
     acpi_prepare(old_acpi_tag, mmap_tag);
+    numa_cpu_init();
 
-    pmm_init(mmap_tag);
+    pmm_init();
+    // Page tables of vmm_init are the first users of zeroed frames
+    zero_pool_refill();
     vmm_init();
 
     kassert(fb_init() == 0);
 
     u64 res = acpi_map_region();
     kassert(res != VMM_ALLOC_ERROR);
+    acpi_reclaim();
+
+    u64 num_boot_frames =
+        pmm_free_reserved(ALIGN_DOWN((u64)&_sboot, PAGE_SIZE),
+                          ALIGN_UP((u64)&_eboot, PAGE_SIZE));
+    log(LOG_LEVEL_INFO, "Reclaimed %lu boot page frames\n", num_boot_frames);
 
     const madt_t *madt = (void *)acpi_rsdt_find_table("APIC");
     kassert(madt != NULL);
@@ -105,6 +133,19 @@ noreturn void kmain(multiboot_uint32_t magic, u64 multiboot_info_addr) {
     kprintf("mmap_addr: %lx\n", mmap_addr);
     vmm_free(mmap_addr);
 
+#ifdef DEBUG
+    // bench/pmm_stress_bench.c runs it on several CPUs at once
+    pmm_stress_test(0x5eed, 10000);
+    pmm_check();
+#endif
+    pmm_test_regions();
+    pmm_test_dma_zone();
+    pmm_test_free_cached();
+    pmm_print_stats();
+#ifdef KERNEL_BENCH
+    page_color_bench();
+#endif
+
     /* backtrace(); */
 
     pci_list();
@@ -130,9 +171,13 @@ noreturn void kmain(multiboot_uint32_t magic, u64 multiboot_info_addr) {
 
     /* end: */
 
+    binlog_flush();
     puts("End of kmain reached\n");
-    cli();
+    // Interrupts are served while the CPU idles, the zeroing included
+    sti();
     while (1) {
+        // Nothing else to do, prepare zeroed frames
+        zero_pool_refill();
         hlt();
     }
 }
@@ -0,0 +1,188 @@
+/*
+ * Each CPU appends its records to its own buffer with interrupts disabled, so
+ * that a handler logging in the middle of a record cannot interleave with it.
+ *
+ * Every CPU has two buffers. When the active one is full, or on binlog_flush,
+ * the buffers are swapped with interrupts disabled, then the full one is
+ * written to the serial port with interrupts restored: at 38400 bauds, a
+ * buffer takes about a second to write. Handlers log to the other buffer in
+ * the meantime. If it fills up before the write is done, records are dropped
+ * and counted, and the next buffer starts with a record of their number.
+ *
+ * Text written to the serial port by a handler during the write ends up in
+ * the middle of the frame, which the decoder cannot read.
+ */
+
+#include "binlog.h"
+
+#include "arch/instr.h"
+#include "arch/percpu.h"
+#include "drivers/serial.h"
+#include "kassert.h"
+#include "mem.h"
+#include "tools/test.h"
+
+#define BINLOG_BUF_SIZE 4096
+
+typedef struct {
+    u8 bufs[2][BINLOG_BUF_SIZE] __align(8);
+    u64 lens[2];
+    // Index of the buffer records are appended to
+    u32 active;
+    // The other buffer is being written to the serial port
+    bool writing;
+    // Records dropped while both buffers were in use
+    u64 num_dropped;
+} binlog_cpu_t;
+
+static void binlog_append(binlog_cpu_t *c, u32 id, enum log_level level,
+                          const char *fmt, const u64 *args, u64 num_args);
+static u32 binlog_swap(binlog_cpu_t *c);
+static void binlog_write(binlog_cpu_t *c, u32 idx);
+
+static binlog_cpu_t binlog_cpus[MAX_CPUS];
+
+// Must not be called before percpu_init
+void binlog_record(enum log_level level, const char *fmt, const u64 *args,
+                   u64 num_args) {
+    kassert(num_args <= BINLOG_MAX_ARGS);
+
+    u64 size = sizeof(binlog_record_t) + num_args * sizeof(u64);
+    u64 rflags = read_rflags();
+    cli();
+
+    u32 id = cpu_id();
+    binlog_cpu_t *c = &binlog_cpus[id];
+    bool full = c->lens[c->active] + size > BINLOG_BUF_SIZE;
+    if (full && c->writing) {
+        c->num_dropped += 1;
+        write_rflags(rflags);
+        return;
+    }
+    u32 full_idx = full ? binlog_swap(c) : 0;
+    binlog_append(c, id, level, fmt, args, num_args);
+
+    write_rflags(rflags);
+
+    if (full) {
+        binlog_write(c, full_idx);
+    }
+}
+
+// Write the records of the calling CPU to the serial port. If a write of the
+// CPU is already in progress, the records wait for the next one.
+void binlog_flush(void) {
+    u64 rflags = read_rflags();
+    cli();
+
+    binlog_cpu_t *c = &binlog_cpus[cpu_id()];
+    if (c->writing || c->lens[c->active] == 0) {
+        write_rflags(rflags);
+        return;
+    }
+    u32 idx = binlog_swap(c);
+
+    write_rflags(rflags);
+
+    binlog_write(c, idx);
+}
+
+// Append a record to the active buffer, which must have room for it.
+// Interrupts must be disabled.
+static void binlog_append(binlog_cpu_t *c, u32 id, enum log_level level,
+                          const char *fmt, const u64 *args, u64 num_args) {
+    u64 size = sizeof(binlog_record_t) + num_args * sizeof(u64);
+    kassert(c->lens[c->active] + size <= BINLOG_BUF_SIZE);
+
+    binlog_record_t *record =
+        (binlog_record_t *)&c->bufs[c->active][c->lens[c->active]];
+    record->fmt_addr = (u64)fmt;
+    record->timestamp = rdtsc();
+    record->cpu_id = (u16)id;
+    record->level = (u8)level;
+    record->num_args = (u8)num_args;
+    record->reserved = 0;
+    memcpy((u8 *)(record + 1), (const u8 *)args, num_args * sizeof(u64));
+    c->lens[c->active] += size;
+}
+
+// Make the empty buffer the active one and return the index of the other,
+// which is to be written with binlog_write. The records dropped during the
+// previous write are counted at the start of the new active buffer.
+// Interrupts must be disabled and no write must be in progress.
+static u32 binlog_swap(binlog_cpu_t *c) {
+    static const char dropped_fmt[] = "binlog: %lu records dropped\n";
+
+    kassert(!c->writing);
+
+    u32 idx = c->active;
+    c->active = 1 - idx;
+    c->writing = true;
+
+    if (c->num_dropped > 0) {
+        binlog_append(c, cpu_id(), LOG_LEVEL_WARN, dropped_fmt,
+                      &c->num_dropped, 1);
+        c->num_dropped = 0;
+    }
+
+    return idx;
+}
+
+// Write the buffer given by binlog_swap to the serial port, interrupts may be
+// enabled. The buffer is then available again.
+static void binlog_write(binlog_cpu_t *c, u32 idx) {
+    binlog_frame_t frame = { .size = (u32)c->lens[idx] };
+    serial_write_raw(SERIAL_PORT_COM1, (const u8 *)BINLOG_MAGIC,
+                     BINLOG_MAGIC_SIZE);
+    serial_write_raw(SERIAL_PORT_COM1, (const u8 *)&frame, sizeof(frame));
+    serial_write_raw(SERIAL_PORT_COM1, c->bufs[idx], c->lens[idx]);
+
+    u64 rflags = read_rflags();
+    cli();
+    c->lens[idx] = 0;
+    c->writing = false;
+    write_rflags(rflags);
+}
+
+DEFINE_TEST(test_binlog) {
+    static const char fmt[] = "test_binlog: %d %s %p\n";
+    u32 id = cpu_id();
+
+    // The test record is dropped rather than written
+    binlog_flush();
+    binlog(LOG_LEVEL_INFO, fmt, -1, fmt, (void *)&id);
+    binlog(LOG_LEVEL_WARN, "test_binlog\n");
+
+    const binlog_cpu_t *c = &binlog_cpus[id];
+    const binlog_record_t *record =
+        (const binlog_record_t *)c->bufs[c->active];
+    const u64 *args = (const u64 *)(record + 1);
+    kassert(record->fmt_addr == (u64)fmt);
+    kassert(record->level == LOG_LEVEL_INFO && record->num_args == 3);
+    kassert(record->cpu_id == id);
+    kassert((i32)args[0] == -1);
+    kassert(args[1] == (u64)fmt && args[2] == (u64)&id);
+
+    record = (const binlog_record_t *)(args + 3);
+    kassert(record->level == LOG_LEVEL_WARN && record->num_args == 0);
+    kassert(c->lens[c->active]
+            == 2 * sizeof(binlog_record_t) + 3 * sizeof(u64));
+
+    binlog_cpus[id].lens[c->active] = 0;
+}
+
+DEFINE_TEST(test_binlog_dropped) {
+    binlog_cpu_t *c = &binlog_cpus[cpu_id()];
+
+    // Pretend the other buffer is being written and the active one is full
+    binlog_flush();
+    c->writing = true;
+    c->lens[c->active] = BINLOG_BUF_SIZE;
+    binlog(LOG_LEVEL_INFO, "test_binlog_dropped\n");
+    kassert(c->num_dropped == 1);
+    kassert(c->lens[c->active] == BINLOG_BUF_SIZE);
+
+    c->writing = false;
+    c->lens[c->active] = 0;
+    c->num_dropped = 0;
+}
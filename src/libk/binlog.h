@@ -0,0 +1,73 @@
+#ifndef AVOCADOS_BINLOG_H_
+#define AVOCADOS_BINLOG_H_
+
+/*
+ * Binary logs: a record holds the address of the format string, the TSC and
+ * the arguments cast to u64, nothing is formatted in the kernel. Records are
+ * written to the serial port in frames starting with BINLOG_MAGIC, between
+ * the text output, and tools/binlog_decode.c formats them back with the
+ * strings of the kernel ELF.
+ *
+ * Strings given to %s are recorded by address, so only those the ELF holds,
+ * such as literals, can be decoded.
+ */
+
+#include <stdbool.h>
+
+#include "attributes.h"
+#include "log.h"
+#include "types.h"
+
+// Text output never holds a null byte
+#define BINLOG_MAGIC "\0BINLOG"
+#define BINLOG_MAGIC_SIZE 8
+
+// Maximum number of arguments of a binlog call
+#define BINLOG_MAX_ARGS 8
+
+// A frame is BINLOG_MAGIC, a binlog_frame_t then size bytes of records
+typedef struct {
+    u32 size;
+} __packed binlog_frame_t;
+
+// Followed by num_args u64
+typedef struct {
+    u64 fmt_addr;
+    u64 timestamp;
+    u16 cpu_id;
+    u8 level;
+    u8 num_args;
+    u32 reserved;
+} __packed binlog_record_t;
+
+#define BINLOG_CAST_1(A) (u64)(A)
+#define BINLOG_CAST_2(A, ...) (u64)(A), BINLOG_CAST_1(__VA_ARGS__)
+#define BINLOG_CAST_3(A, ...) (u64)(A), BINLOG_CAST_2(__VA_ARGS__)
+#define BINLOG_CAST_4(A, ...) (u64)(A), BINLOG_CAST_3(__VA_ARGS__)
+#define BINLOG_CAST_5(A, ...) (u64)(A), BINLOG_CAST_4(__VA_ARGS__)
+#define BINLOG_CAST_6(A, ...) (u64)(A), BINLOG_CAST_5(__VA_ARGS__)
+#define BINLOG_CAST_7(A, ...) (u64)(A), BINLOG_CAST_6(__VA_ARGS__)
+#define BINLOG_CAST_8(A, ...) (u64)(A), BINLOG_CAST_7(__VA_ARGS__)
+#define BINLOG_CAST_N(_1, _2, _3, _4, _5, _6, _7, _8, N, ...) BINLOG_CAST_##N
+// Cast each of at most BINLOG_MAX_ARGS arguments to u64
+#define BINLOG_CAST(...)                                                       \
+    BINLOG_CAST_N(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, _)(__VA_ARGS__)
+
+// Record a message in the buffer of the CPU. The format is still checked by
+// the compiler through the call to log_print, which is never made.
+#define binlog(LEVEL, FMT, ...)                                                \
+    do {                                                                       \
+        const u64 _binlog_args[] = { 0 __VA_OPT__(, BINLOG_CAST(__VA_ARGS__)) \
+        };                                                                     \
+        binlog_record(LEVEL, FMT, _binlog_args + 1,                            \
+                      sizeof(_binlog_args) / sizeof(u64) - 1);                 \
+        if (false) {                                                           \
+            log_print(LEVEL, FMT __VA_OPT__(, ) __VA_ARGS__);                  \
+        }                                                                      \
+    } while (false)
+
+void binlog_record(enum log_level level, const char *fmt, const u64 *args,
+                   u64 num_args);
+void binlog_flush(void);
+
+#endif /* ! AVOCADOS_BINLOG_H_ */
@@ -2,6 +2,17 @@
 #include "bitmap.h"
 #include "kassert.h"
 #include "tools/test.h"
+#include "utils.h"
+
+static u64 bitmap_find_next(const bitmap_t *bitmap, u64 start, u64 end,
+                            u64 invert);
+
+bool bitmap_test(const bitmap_t *bitmap, u64 idx) {
+    kassert(idx < bitmap->size);
+
+    u64 chunk = bitmap->chunks[idx / BITMAP_CHUNK_BITS];
+    return (chunk >> (idx % BITMAP_CHUNK_BITS)) & 1;
+}
 
 void bitmap_set(bitmap_t *bitmap, u64 idx) {
     kassert(idx < bitmap->size);
@@ -16,22 +27,237 @@ void bitmap_clear(bitmap_t *bitmap, u64 idx) {
         ~(1UL << (idx % BITMAP_CHUNK_BITS));
 }
 
-void bitmap_set_range(bitmap_t *bitmap, u64 start, u64 count) {
-    kassert(start < bitmap->size && start + count <= bitmap->size);
-    // Overflow of start + count is okay since it won't loop
+// Mask of the bits of a chunk in [start % BITMAP_CHUNK_BITS, BITMAP_CHUNK_BITS)
+static inline u64 head_mask(u64 start) {
+    return ~0UL << (start % BITMAP_CHUNK_BITS);
+}
+
+// Mask of the bits of a chunk in [0, end % BITMAP_CHUNK_BITS), all the bits if
+// end is a multiple of BITMAP_CHUNK_BITS
+static inline u64 tail_mask(u64 end) {
+    return ~0UL >> ((BITMAP_CHUNK_BITS - end % BITMAP_CHUNK_BITS)
+                    % BITMAP_CHUNK_BITS);
+}
+
+// Set or clear the bits in [start, end). Whole chunks are written at once,
+// only the first and last chunks of the range are masked.
+void bitmap_set_range(bitmap_t *bitmap, u64 start, u64 end) {
+    kassert(start <= end && end <= bitmap->size);
+
+    if (start == end) {
+        return;
+    }
+
+    u64 first_chunk = start / BITMAP_CHUNK_BITS;
+    u64 last_chunk = (end - 1) / BITMAP_CHUNK_BITS;
+
+    if (first_chunk == last_chunk) {
+        bitmap->chunks[first_chunk] |= head_mask(start) & tail_mask(end);
+        return;
+    }
 
-    for (u64 i = start; i < start + count; ++i) {
-        bitmap_set(bitmap, i);
+    bitmap->chunks[first_chunk] |= head_mask(start);
+    for (u64 i = first_chunk + 1; i < last_chunk; ++i) {
+        bitmap->chunks[i] = ~0UL;
     }
+    bitmap->chunks[last_chunk] |= tail_mask(end);
 }
 
-void bitmap_clear_range(bitmap_t *bitmap, u64 start, u64 count) {
-    kassert(start < bitmap->size && start + count <= bitmap->size);
-    // Overflow of start + count is okay since it won't loop
+void bitmap_clear_range(bitmap_t *bitmap, u64 start, u64 end) {
+    kassert(start <= end && end <= bitmap->size);
+
+    if (start == end) {
+        return;
+    }
+
+    u64 first_chunk = start / BITMAP_CHUNK_BITS;
+    u64 last_chunk = (end - 1) / BITMAP_CHUNK_BITS;
 
-    for (u64 i = start; i < start + count; ++i) {
-        bitmap_clear(bitmap, i);
+    if (first_chunk == last_chunk) {
+        bitmap->chunks[first_chunk] &= ~(head_mask(start) & tail_mask(end));
+        return;
     }
+
+    bitmap->chunks[first_chunk] &= ~head_mask(start);
+    for (u64 i = first_chunk + 1; i < last_chunk; ++i) {
+        bitmap->chunks[i] = 0;
+    }
+    bitmap->chunks[last_chunk] &= ~tail_mask(end);
+}
+
+// Return the number of bits set in [start, end)
+u64 bitmap_popcount(const bitmap_t *bitmap, u64 start, u64 end) {
+    kassert(start <= end && end <= bitmap->size);
+
+    if (start == end) {
+        return 0;
+    }
+
+    u64 first_chunk = start / BITMAP_CHUNK_BITS;
+    u64 last_chunk = (end - 1) / BITMAP_CHUNK_BITS;
+
+    if (first_chunk == last_chunk) {
+        return (u64)__builtin_popcountl(bitmap->chunks[first_chunk]
+                                        & head_mask(start) & tail_mask(end));
+    }
+
+    u64 num_set = (u64)__builtin_popcountl(bitmap->chunks[first_chunk]
+                                           & head_mask(start));
+    for (u64 i = first_chunk + 1; i < last_chunk; ++i) {
+        num_set += (u64)__builtin_popcountl(bitmap->chunks[i]);
+    }
+    num_set +=
+        (u64)__builtin_popcountl(bitmap->chunks[last_chunk] & tail_mask(end));
+
+    return num_set;
+}
+
+// Return the index of the first cleared bit, bitmap->size if there is none
+u64 bitmap_find_first_zero(const bitmap_t *bitmap) {
+    return bitmap_find_next_zero(bitmap, 0, bitmap->size);
+}
+
+// Return the index of the first cleared bit in [start, end), end if there is
+// none
+u64 bitmap_find_next_zero(const bitmap_t *bitmap, u64 start, u64 end) {
+    return bitmap_find_next(bitmap, start, end, ~0UL);
+}
+
+// Return the index of the first set bit in [start, end), end if there is none
+u64 bitmap_find_next_set(const bitmap_t *bitmap, u64 start, u64 end) {
+    return bitmap_find_next(bitmap, start, end, 0);
+}
+
+// Return the index of the first run of len cleared bits in [start, end) whose
+// first index i is aligned: (i + align_offset) % align == 0, align being a
+// power of two. Return end if there is none.
+u64 bitmap_find_zero_run(const bitmap_t *bitmap, u64 start, u64 end, u64 len,
+                         u64 align, u64 align_offset) {
+    kassert(len > 0);
+    kassert(align != 0 && (align & (align - 1)) == 0);
+
+    u64 idx = start;
+    while (true) {
+        idx = bitmap_find_next_zero(bitmap, idx, end);
+        idx = ALIGN_UP(idx + align_offset, align) - align_offset;
+        if (idx >= end || len > end - idx) {
+            return end;
+        }
+
+        // No run can start before a set bit of the candidate run
+        u64 busy_idx = bitmap_find_next_set(bitmap, idx, idx + len);
+        if (busy_idx == idx + len) {
+            return idx;
+        }
+        idx = busy_idx + 1;
+    }
+}
+
+bool bitmap_test_atomic(const bitmap_t *bitmap, u64 idx) {
+    kassert(idx < bitmap->size);
+
+    u64 chunk = __atomic_load_n(&bitmap->chunks[idx / BITMAP_CHUNK_BITS],
+                                __ATOMIC_ACQUIRE);
+    return (chunk >> (idx % BITMAP_CHUNK_BITS)) & 1;
+}
+
+// The locked instructions are full barriers
+void bitmap_set_atomic(bitmap_t *bitmap, u64 idx) {
+    kassert(idx < bitmap->size);
+
+    __asm__ volatile("lock btsq %1, %0"
+                     : "+m"(bitmap->chunks[idx / BITMAP_CHUNK_BITS])
+                     : "Jr"(idx % BITMAP_CHUNK_BITS)
+                     : "memory");
+}
+
+void bitmap_clear_atomic(bitmap_t *bitmap, u64 idx) {
+    kassert(idx < bitmap->size);
+
+    __asm__ volatile("lock btrq %1, %0"
+                     : "+m"(bitmap->chunks[idx / BITMAP_CHUNK_BITS])
+                     : "Jr"(idx % BITMAP_CHUNK_BITS)
+                     : "memory");
+}
+
+// Set the bit and return its previous value
+bool bitmap_test_and_set_atomic(bitmap_t *bitmap, u64 idx) {
+    kassert(idx < bitmap->size);
+
+    bool was_set;
+    __asm__ volatile("lock btsq %2, %0"
+                     : "+m"(bitmap->chunks[idx / BITMAP_CHUNK_BITS]),
+                       "=@ccc"(was_set)
+                     : "Jr"(idx % BITMAP_CHUNK_BITS)
+                     : "memory");
+
+    return was_set;
+}
+
+// Clear the bit and return its previous value
+bool bitmap_test_and_clear_atomic(bitmap_t *bitmap, u64 idx) {
+    kassert(idx < bitmap->size);
+
+    bool was_set;
+    __asm__ volatile("lock btrq %2, %0"
+                     : "+m"(bitmap->chunks[idx / BITMAP_CHUNK_BITS]),
+                       "=@ccc"(was_set)
+                     : "Jr"(idx % BITMAP_CHUNK_BITS)
+                     : "memory");
+
+    return was_set;
+}
+
+// Set the first cleared bit and return its index, bitmap->size if every bit is
+// set. A chunk with a cleared bit is claimed with a compare and exchange, which
+// is retried with the value written by the CPU that won the race, if any.
+// The bit is released with bitmap_clear_atomic.
+u64 bitmap_alloc_bit(bitmap_t *bitmap) {
+    u64 num_chunks = ALIGN_UP(bitmap->size, BITMAP_CHUNK_BITS)
+        / BITMAP_CHUNK_BITS;
+
+    for (u64 i = 0; i < num_chunks; ++i) {
+        // Bits past the end of the bitmap are never handed out
+        u64 valid = i == num_chunks - 1 ? tail_mask(bitmap->size) : ~0UL;
+        u64 chunk = __atomic_load_n(&bitmap->chunks[i], __ATOMIC_RELAXED);
+
+        while ((~chunk & valid) != 0) {
+            u64 bit = (u64)__builtin_ctzl(~chunk & valid);
+            if (__atomic_compare_exchange_n(&bitmap->chunks[i], &chunk,
+                                            chunk | (1UL << bit), false,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                return i * BITMAP_CHUNK_BITS + bit;
+            }
+        }
+    }
+
+    return bitmap->size;
+}
+
+// Return the index of the first bit of [start, end) that differs from invert,
+// end if there is none. A chunk is skipped with a single comparison and the
+// bit is found with tzcnt (bsf on CPUs without BMI1).
+static u64 bitmap_find_next(const bitmap_t *bitmap, u64 start, u64 end,
+                            u64 invert) {
+    kassert(end <= bitmap->size);
+
+    if (start >= end) {
+        return end;
+    }
+
+    u64 chunk_idx = start / BITMAP_CHUNK_BITS;
+    u64 chunk = (bitmap->chunks[chunk_idx] ^ invert) & head_mask(start);
+    while (chunk == 0) {
+        chunk_idx += 1;
+        if (chunk_idx * BITMAP_CHUNK_BITS >= end) {
+            return end;
+        }
+        chunk = bitmap->chunks[chunk_idx] ^ invert;
+    }
+
+    u64 idx = chunk_idx * BITMAP_CHUNK_BITS + (u64)__builtin_ctzl(chunk);
+    return idx < end ? idx : end;
 }
 
 DEFINE_TEST(test_bitmap) {
@@ -40,11 +266,104 @@ DEFINE_TEST(test_bitmap) {
     bitmap_t *bitmap = (bitmap_t *)mem;
     bitmap->size = 125;
 
-    bitmap_set_range(bitmap, 62, 4);
+    bitmap_set_range(bitmap, 62, 66);
     kassert(bitmap->chunks[0] == ((1UL << 62) | (1UL << 63)));
     kassert(bitmap->chunks[1] == ((1UL << 0) | (1UL << 1)));
 
-    bitmap_clear_range(bitmap, 63, 2);
+    bitmap_clear_range(bitmap, 63, 65);
     kassert(bitmap->chunks[0] == (1UL << 62));
     kassert(bitmap->chunks[1] == (1UL << 1));
+
+    bitmap_clear_range(bitmap, 0, 125);
+    kassert(bitmap->chunks[0] == 0);
+    kassert(bitmap->chunks[1] == 0);
+
+    // Range ending on a chunk boundary
+    bitmap_set_range(bitmap, 3, 64);
+    kassert(bitmap->chunks[0] == ~0UL << 3);
+    kassert(bitmap->chunks[1] == 0);
+}
+
+DEFINE_TEST(test_bitmap_range_whole_chunks) {
+    __align(_Alignof(bitmap_t))
+        u8 mem[sizeof(bitmap_t) + 4 * sizeof(u64)] = { 0 };
+    bitmap_t *bitmap = (bitmap_t *)mem;
+    bitmap->size = 250;
+
+    bitmap_set_range(bitmap, 10, 240);
+    kassert(bitmap->chunks[0] == ~0UL << 10);
+    kassert(bitmap->chunks[1] == ~0UL);
+    kassert(bitmap->chunks[2] == ~0UL);
+    kassert(bitmap->chunks[3] == (1UL << (240 - 192)) - 1);
+
+    bitmap_clear_range(bitmap, 64, 192);
+    kassert(bitmap->chunks[0] == ~0UL << 10);
+    kassert(bitmap->chunks[1] == 0);
+    kassert(bitmap->chunks[2] == 0);
+    kassert(bitmap->chunks[3] == (1UL << (240 - 192)) - 1);
+}
+
+DEFINE_TEST(test_bitmap_search) {
+    __align(_Alignof(bitmap_t))
+        u8 mem[sizeof(bitmap_t) + 4 * sizeof(u64)] = { 0 };
+    bitmap_t *bitmap = (bitmap_t *)mem;
+    bitmap->size = 250;
+
+    kassert(bitmap_find_first_zero(bitmap) == 0);
+    kassert(bitmap_find_next_set(bitmap, 0, 250) == 250);
+    kassert(bitmap_popcount(bitmap, 0, 250) == 0);
+
+    bitmap_set_range(bitmap, 0, 130);
+    bitmap_set(bitmap, 140);
+    bitmap_set(bitmap, 200);
+    kassert(bitmap_find_first_zero(bitmap) == 130);
+    kassert(bitmap_find_next_zero(bitmap, 131, 250) == 131);
+    kassert(bitmap_find_next_zero(bitmap, 0, 100) == 100);
+    kassert(bitmap_find_next_set(bitmap, 130, 250) == 140);
+    kassert(bitmap_find_next_set(bitmap, 141, 250) == 200);
+    kassert(bitmap_find_next_set(bitmap, 141, 200) == 200);
+    kassert(bitmap_find_next_set(bitmap, 201, 250) == 250);
+    kassert(bitmap_popcount(bitmap, 0, 250) == 132);
+    kassert(bitmap_popcount(bitmap, 129, 201) == 3);
+
+    // The run must start on (i + 2) % 8 == 0
+    kassert(bitmap_find_zero_run(bitmap, 0, 250, 8, 1, 0) == 130);
+    kassert(bitmap_find_zero_run(bitmap, 0, 250, 8, 8, 2) == 142);
+    kassert(bitmap_find_zero_run(bitmap, 0, 250, 50, 1, 0) == 141);
+    kassert(bitmap_find_zero_run(bitmap, 0, 250, 50, 16, 0) == 144);
+    kassert(bitmap_find_zero_run(bitmap, 0, 250, 60, 1, 0) == 250);
+    kassert(bitmap_find_zero_run(bitmap, 0, 200, 60, 1, 0) == 200);
+    kassert(bitmap_find_zero_run(bitmap, 141, 200, 59, 1, 0) == 141);
+
+    bitmap_set_range(bitmap, 0, 250);
+    kassert(bitmap_find_first_zero(bitmap) == 250);
+    kassert(bitmap_find_zero_run(bitmap, 0, 250, 1, 1, 0) == 250);
+}
+
+DEFINE_TEST(test_bitmap_atomic) {
+    __align(_Alignof(bitmap_t))
+        u8 mem[sizeof(bitmap_t) + 2 * sizeof(u64)] = { 0 };
+    bitmap_t *bitmap = (bitmap_t *)mem;
+    bitmap->size = 70;
+
+    kassert(!bitmap_test_and_set_atomic(bitmap, 65));
+    kassert(bitmap_test_and_set_atomic(bitmap, 65));
+    kassert(bitmap_test_atomic(bitmap, 65));
+    kassert(bitmap_test_and_clear_atomic(bitmap, 65));
+    kassert(!bitmap_test_and_clear_atomic(bitmap, 65));
+
+    bitmap_set_atomic(bitmap, 1);
+    kassert(bitmap->chunks[0] == 1UL << 1);
+
+    // Every bit but 1 is handed out once, in order
+    for (u64 i = 0; i < 70; ++i) {
+        if (i != 1) {
+            kassert(bitmap_alloc_bit(bitmap) == i);
+        }
+    }
+    kassert(bitmap_alloc_bit(bitmap) == 70);
+    kassert(bitmap->chunks[1] == (1UL << 6) - 1);
+
+    bitmap_clear_atomic(bitmap, 66);
+    kassert(bitmap_alloc_bit(bitmap) == 66);
 }
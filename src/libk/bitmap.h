@@ -1,6 +1,8 @@
 #ifndef AVOCADOS_BITMAP_H_
 #define AVOCADOS_BITMAP_H_
 
+#include <stdbool.h>
+
 #include "types.h"
 
 typedef struct {
@@ -14,10 +16,28 @@ typedef struct {
 #define BITS_PER_BYTE 8
 #define BITMAP_CHUNK_BITS (sizeof(((bitmap_t *)0)->chunks[0]) * BITS_PER_BYTE)
 
+bool bitmap_test(const bitmap_t *bitmap, u64 idx);
 void bitmap_set(bitmap_t *bitmap, u64 idx);
 void bitmap_clear(bitmap_t *bitmap, u64 idx);
 
-void bitmap_set_range(bitmap_t *bitmap, u64 start, u64 count);
-void bitmap_clear_range(bitmap_t *bitmap, u64 start, u64 count);
+// Range operations work on the bits in [start, end)
+void bitmap_set_range(bitmap_t *bitmap, u64 start, u64 end);
+void bitmap_clear_range(bitmap_t *bitmap, u64 start, u64 end);
+u64 bitmap_popcount(const bitmap_t *bitmap, u64 start, u64 end);
+
+u64 bitmap_find_first_zero(const bitmap_t *bitmap);
+u64 bitmap_find_next_zero(const bitmap_t *bitmap, u64 start, u64 end);
+u64 bitmap_find_next_set(const bitmap_t *bitmap, u64 start, u64 end);
+u64 bitmap_find_zero_run(const bitmap_t *bitmap, u64 start, u64 end, u64 len,
+                         u64 align, u64 align_offset);
+
+// Atomic operations, for bitmaps updated by several CPUs without a lock. Any
+// other operation needs the bitmap to be owned by the caller.
+bool bitmap_test_atomic(const bitmap_t *bitmap, u64 idx);
+void bitmap_set_atomic(bitmap_t *bitmap, u64 idx);
+void bitmap_clear_atomic(bitmap_t *bitmap, u64 idx);
+bool bitmap_test_and_set_atomic(bitmap_t *bitmap, u64 idx);
+bool bitmap_test_and_clear_atomic(bitmap_t *bitmap, u64 idx);
+u64 bitmap_alloc_bit(bitmap_t *bitmap);
 
 #endif /* ! AVOCADOS_BITMAP_H_ */
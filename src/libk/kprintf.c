@@ -1,12 +1,31 @@
+/*
+ * kprintf formats a whole message before it reaches the serial port: the
+ * formatting engine writes to a kprintf_out_t, which is either the buffer of
+ * the caller (ksnprintf) or a per-CPU buffer handed to the sink in one write
+ * (kprintf). A message longer than the per-CPU buffer is written in several
+ * parts rather than truncated.
+ *
+ * A kprintf interrupted by a handler that prints too would see its buffer
+ * overwritten, so nested calls use a small buffer on the stack instead.
+ */
+
 #include <stdbool.h>
 
+#include "arch/percpu.h"
 #include "drivers/serial.h"
 #include "kassert.h"
 #include "kprintf.h"
+#include "mem.h"
 #include "string.h"
+#include "tools/test.h"
 #include "types.h"
 #include "utils.h"
 
+#define KPRINTF_BUF_SIZE 512
+#define KPRINTF_NESTED_BUF_SIZE 64
+// Number of digits of 2**64 - 1 in base 8, the longest of the bases
+#define NUM_MAX_DIGITS 22
+
 enum length_modifier {
     LM_NONE,
     LM_HH,
@@ -15,8 +34,56 @@ enum length_modifier {
     LM_LL,
 };
 
-static u64 num_to_str(u64 num, char *str, u8 base, bool upper, bool num_signed);
-static void pad(u64 field_length, u64 field_width, char padding_char);
+typedef void (*kprintf_sink_t)(const char *buf, u64 len);
+
+typedef struct {
+    char *buf;
+    // Characters buf can hold, without the null byte of ksnprintf
+    u64 size;
+    // Characters in buf
+    u64 len;
+    // Characters of the whole message, including those flushed or dropped
+    u64 count;
+    // Called when buf is full, characters past size are dropped if NULL
+    kprintf_sink_t flush;
+} kprintf_out_t;
+
+// Flags, width and precision of a conversion specification
+typedef struct {
+    u64 width;
+    // Minimum number of digits, or maximum number of characters of a string
+    u64 precision;
+    bool has_precision;
+    // - flag, pad on the right
+    bool left;
+    // 0 flag, pad numbers with zeros
+    bool zero;
+} conversion_t;
+
+static void kvprintf_to(kprintf_out_t *out, const char *fmt, va_list ap);
+static void out_write(kprintf_out_t *out, const char *str, u64 n);
+static void out_fill(kprintf_out_t *out, char c, u64 n);
+static void out_flush(kprintf_out_t *out);
+static void serial_sink(const char *buf, u64 len);
+static void format_num(kprintf_out_t *out, u64 num, const char *prefix,
+                       u8 base, bool upper, const conversion_t *conv);
+static char *num_to_str(u64 num, char *end, u8 base, bool upper);
+static void pad_before(kprintf_out_t *out, u64 field_length,
+                       const conversion_t *conv);
+static void pad_after(kprintf_out_t *out, u64 field_length,
+                      const conversion_t *conv);
+
+// "00", "01", ..., "99"
+static const char decimal_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+static const char lower_digits[] = "0123456789abcdef";
+static const char upper_digits[] = "0123456789ABCDEF";
+
+static char kprintf_bufs[MAX_CPUS][KPRINTF_BUF_SIZE];
 
 /*
  * Print a string to the serial port COM1
@@ -41,34 +108,123 @@ void kprintf(const char *fmt, ...) {
 }
 
 void kvprintf(const char *fmt, va_list ap) {
-    // 23 because 8 is the smallest base so it has a greater log and
-    // log(2**64 - 1, 8) = 22 + null terminator
-    char int_buf[23];
-    unsigned long long arg;
+    kvprintf_prefix(NULL, fmt, ap);
+}
+
+// Print prefix, if not NULL, and the formatted message in the same write.
+// Must not be called before percpu_init.
+void kvprintf_prefix(const char *prefix, const char *fmt, va_list ap) {
+    percpu_t *cpu = this_cpu();
+    char nested_buf[KPRINTF_NESTED_BUF_SIZE];
+    kprintf_out_t out = {
+        .buf = kprintf_bufs[cpu->id],
+        .size = KPRINTF_BUF_SIZE,
+        .len = 0,
+        .count = 0,
+        .flush = serial_sink,
+    };
+
+    cpu->kprintf_depth += 1;
+    if (cpu->kprintf_depth > 1) {
+        out.buf = nested_buf;
+        out.size = KPRINTF_NESTED_BUF_SIZE;
+    }
+
+    if (prefix != NULL) {
+        out_write(&out, prefix, strlen(prefix));
+    }
+    kvprintf_to(&out, fmt, ap);
+    out_flush(&out);
+
+    cpu->kprintf_depth -= 1;
+}
+
+// Format into buf, truncated to size - 1 characters and null terminated if
+// size is not 0.
+// Return the length of the whole formatted string, like snprintf.
+u64 ksnprintf(char *buf, u64 size, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    u64 len = kvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+
+    return len;
+}
+
+u64 kvsnprintf(char *buf, u64 size, const char *fmt, va_list ap) {
+    kprintf_out_t out = {
+        .buf = buf,
+        .size = size == 0 ? 0 : size - 1,
+        .len = 0,
+        .count = 0,
+        .flush = NULL,
+    };
+
+    kvprintf_to(&out, fmt, ap);
+    if (size != 0) {
+        buf[out.len] = '\0';
+    }
+
+    return out.count;
+}
+
+static void kvprintf_to(kprintf_out_t *out, const char *fmt, va_list ap) {
+    unsigned long long arg = 0;
     enum length_modifier length_modifier;
+    conversion_t conv;
     u8 base = 0;
-    char padding_char;
-    u64 field_width;
-    u64 num_field_length;
 
     for (u64 i = 0; fmt[i] != '\0'; i++) {
         if (fmt[i] == '%') {
             i += 1;
 
-            padding_char = ' ';
-            if (fmt[i] == '0') {
-                padding_char = '0';
-                i += 1;
+            conv.left = false;
+            conv.zero = false;
+            for (;; ++i) {
+                if (fmt[i] == '-') {
+                    conv.left = true;
+                } else if (fmt[i] == '0') {
+                    conv.zero = true;
+                } else {
+                    break;
+                }
             }
 
-            field_width = 0;
-            if (fmt[i] >= '1' && fmt[i] <= '9') {
+            conv.width = 0;
+            if (fmt[i] == '*') {
+                // A negative width is a - flag followed by a width
+                int width = va_arg(ap, int);
+                conv.left = conv.left || width < 0;
+                conv.width = width < 0 ? (u64)-(i64)width : (u64)width;
+                i += 1;
+            } else {
                 while (fmt[i] >= '0' && fmt[i] <= '9') {
-                    field_width = field_width * 10 + (fmt[i] - '0');
+                    conv.width = conv.width * 10 + (u64)(fmt[i] - '0');
                     i += 1;
                 }
             }
 
+            conv.has_precision = false;
+            conv.precision = 0;
+            if (fmt[i] == '.') {
+                i += 1;
+                conv.has_precision = true;
+                if (fmt[i] == '*') {
+                    // A negative precision is taken as if it were omitted
+                    int precision = va_arg(ap, int);
+                    conv.has_precision = precision >= 0;
+                    conv.precision = precision < 0 ? 0 : (u64)precision;
+                    i += 1;
+                } else {
+                    while (fmt[i] >= '0' && fmt[i] <= '9') {
+                        conv.precision =
+                            conv.precision * 10 + (u64)(fmt[i] - '0');
+                        i += 1;
+                    }
+                }
+            }
+
             switch (fmt[i]) {
             case 'h':
                 if (fmt[i + 1] == 'h') {
@@ -99,7 +255,7 @@ void kvprintf(const char *fmt, va_list ap) {
             case 'u':
             case 'o':
             case 'x':
-            case 'X':
+            case 'X': {
                 switch (fmt[i]) {
                 case 'd':
                 case 'i':
@@ -115,26 +271,27 @@ void kvprintf(const char *fmt, va_list ap) {
                     break;
                 }
 
+                bool num_signed = fmt[i] == 'd' || fmt[i] == 'i';
                 switch (length_modifier) {
                 case LM_NONE:
                 // Value promotable to int are promoted to int
                 case LM_HH:
                 case LM_H:
-                    if (fmt[i] == 'd' || fmt[i] == 'i') {
+                    if (num_signed) {
                         arg = (unsigned long long)va_arg(ap, int);
                     } else {
                         arg = (unsigned long long)va_arg(ap, unsigned int);
                     }
                     break;
                 case LM_L:
-                    if (fmt[i] == 'd' || fmt[i] == 'i') {
+                    if (num_signed) {
                         arg = (unsigned long long)va_arg(ap, long);
                     } else {
                         arg = (unsigned long long)va_arg(ap, unsigned long);
                     }
                     break;
                 case LM_LL:
-                    if (fmt[i] == 'd' || fmt[i] == 'i') {
+                    if (num_signed) {
                         arg = (unsigned long long)va_arg(ap, long long);
                     } else {
                         arg =
@@ -143,92 +300,303 @@ void kvprintf(const char *fmt, va_list ap) {
                     break;
                 }
 
-                num_field_length = num_to_str(arg, int_buf, base, fmt[i] == 'X',
-                                              fmt[i] == 'd' || fmt[i] == 'i');
-                pad(num_field_length, field_width, padding_char);
-                puts(int_buf);
+                if (num_signed && (i64)arg < 0) {
+                    format_num(out, -arg, "-", base, false, &conv);
+                } else {
+                    format_num(out, arg, "", base, fmt[i] == 'X', &conv);
+                }
                 break;
-            case 'c':
-                pad(1, field_width, padding_char);
-                putchar((char)va_arg(ap, int));
+            }
+            case 'c': {
+                char c = (char)va_arg(ap, int);
+                pad_before(out, 1, &conv);
+                out_write(out, &c, 1);
+                pad_after(out, 1, &conv);
                 break;
+            }
             case 's': {
+                // The precision is the maximum number of characters written
                 const char *s = va_arg(ap, const char *);
-                pad(strlen(s), field_width, padding_char);
-                puts(s);
+                u64 len = conv.has_precision ? strnlen(s, conv.precision)
+                                             : strlen(s);
+                pad_before(out, len, &conv);
+                out_write(out, s, len);
+                pad_after(out, len, &conv);
                 break;
             }
             case 'p':
                 arg = (unsigned long long)va_arg(ap, void *);
-                num_field_length = num_to_str(arg, int_buf, 8, false, false);
-                puts("0x");
-                pad(num_field_length, field_width, padding_char);
-                puts(int_buf);
+                format_num(out, arg, "0x", 16, false, &conv);
                 break;
             case '%':
             default:
                 // TODO: Handle modifiers here
-                putchar(fmt[i]);
+                out_write(out, &fmt[i], 1);
                 break;
             }
         } else {
-            putchar(fmt[i]);
+            // Copy the text up to the next conversion at once
+            const char *conversion = strchr(&fmt[i], '%');
+            u64 len = conversion == NULL ? strlen(&fmt[i])
+                                         : (u64)(conversion - &fmt[i]);
+            out_write(out, &fmt[i], len);
+            i += len - 1;
         }
     }
 }
 
-// str buffer must be big enough
-// base must be == 8 or == 10 or == 16
-static u64 num_to_str(u64 num, char *str, u8 base, bool upper,
-                      bool num_signed) {
-    static const char digits[16] = "0123456789abcdef";
+static void out_write(kprintf_out_t *out, const char *str, u64 n) {
+    out->count += n;
 
-    kassert(base == 8 || base == 10 || base == 16);
+    while (n > 0) {
+        if (out->len == out->size) {
+            if (out->flush == NULL) {
+                return;
+            }
+            out_flush(out);
+        }
 
-    u64 i = 0;
-    bool negative = false;
-    if (num == 0) {
-        str[i++] = '0';
-    } else if (num_signed && (i64)num < 0) {
-        str[i++] = '-';
-        num = (u64)(-(i64)num);
-        negative = true;
+        u64 room = out->size - out->len;
+        u64 len = n < room ? n : room;
+        memcpy((u8 *)out->buf + out->len, (const u8 *)str, len);
+        out->len += len;
+        str += len;
+        n -= len;
     }
+}
+
+static void out_fill(kprintf_out_t *out, char c, u64 n) {
+    out->count += n;
 
-    while (num > 0) {
-        char d = digits[num % base];
-        if (upper && 'a' <= d && d <= 'f') {
-            d = (char)(d - 'a' + 'A');
+    while (n > 0) {
+        if (out->len == out->size) {
+            if (out->flush == NULL) {
+                return;
+            }
+            out_flush(out);
         }
 
-        str[i++] = d;
-        num /= base;
+        u64 room = out->size - out->len;
+        u64 len = n < room ? n : room;
+        memset((u8 *)out->buf + out->len, (u8)c, len);
+        out->len += len;
+        n -= len;
+    }
+}
+
+static void out_flush(kprintf_out_t *out) {
+    if (out->flush != NULL && out->len > 0) {
+        out->flush(out->buf, out->len);
     }
-    str[i] = '\0';
-
-    // TODO: No revert needed
-    // Revert str
-    if (negative) {
-        for (u64 j = 0; j < (i - 1) / 2; j++) {
-            char tmp = str[j + 1];
-            str[j + 1] = str[i - j - 1];
-            str[i - j - 1] = tmp;
+    out->len = 0;
+}
+
+static void serial_sink(const char *buf, u64 len) {
+    serial_write(SERIAL_PORT_COM1, buf, len);
+}
+
+// Write prefix, then num in the given base, padded to the width of conv and
+// with at least as many digits as its precision
+static void format_num(kprintf_out_t *out, u64 num, const char *prefix,
+                       u8 base, bool upper, const conversion_t *conv) {
+    char buf[NUM_MAX_DIGITS];
+    char *end = buf + NUM_MAX_DIGITS;
+
+    // A precision of 0 leaves no digit for 0
+    char *digits = end;
+    if (num != 0 || !conv->has_precision || conv->precision != 0) {
+        digits = num_to_str(num, end, base, upper);
+    }
+
+    u64 num_digits = (u64)(end - digits);
+    u64 prefix_len = strlen(prefix);
+    u64 num_zeros = 0;
+    if (conv->has_precision && conv->precision > num_digits) {
+        num_zeros = conv->precision - num_digits;
+    }
+
+    u64 len = prefix_len + num_zeros + num_digits;
+    u64 num_spaces = conv->width > len ? conv->width - len : 0;
+    // The 0 flag pads between the prefix and the digits, but is ignored when
+    // a precision is given
+    if (conv->zero && !conv->left && !conv->has_precision) {
+        num_zeros += num_spaces;
+        num_spaces = 0;
+    }
+
+    if (!conv->left) {
+        out_fill(out, ' ', num_spaces);
+    }
+    out_write(out, prefix, prefix_len);
+    out_fill(out, '0', num_zeros);
+    out_write(out, digits, num_digits);
+    if (conv->left) {
+        out_fill(out, ' ', num_spaces);
+    }
+}
+
+// Write the digits of num right to left, the last one just before end.
+// base must be == 8 or == 10 or == 16.
+// Return the first digit.
+static char *num_to_str(u64 num, char *end, u8 base, bool upper) {
+    kassert(base == 8 || base == 10 || base == 16);
+
+    char *str = end;
+    if (base == 10) {
+        // Two digits per division
+        while (num >= 100) {
+            const char *pair = &decimal_pairs[(num % 100) * 2];
+            num /= 100;
+            str -= 2;
+            str[0] = pair[0];
+            str[1] = pair[1];
         }
-    } else {
-        for (u64 j = 0; j < i / 2; j++) {
-            char tmp = str[j];
-            str[j] = str[i - j - 1];
-            str[i - j - 1] = tmp;
+
+        if (num >= 10) {
+            const char *pair = &decimal_pairs[num * 2];
+            str -= 2;
+            str[0] = pair[0];
+            str[1] = pair[1];
+        } else {
+            str -= 1;
+            str[0] = (char)('0' + num);
         }
+    } else {
+        const char *digits = upper ? upper_digits : lower_digits;
+        u8 shift = base == 16 ? 4 : 3;
+        do {
+            str -= 1;
+            str[0] = digits[num & (base - 1U)];
+            num >>= shift;
+        } while (num != 0);
     }
 
-    return i;
+    return str;
 }
 
-static void pad(u64 field_length, u64 field_width, char padding_char) {
-    if (field_width > field_length) {
-        for (u64 i = 0; i < field_width - field_length; ++i) {
-            putchar(padding_char);
-        }
+// Pad a field of field_length characters to the width of conv, on the left
+// unless the field is left-justified
+static void pad_before(kprintf_out_t *out, u64 field_length,
+                       const conversion_t *conv) {
+    if (!conv->left && conv->width > field_length) {
+        out_fill(out, conv->zero ? '0' : ' ', conv->width - field_length);
+    }
+}
+
+static void pad_after(kprintf_out_t *out, u64 field_length,
+                      const conversion_t *conv) {
+    if (conv->left && conv->width > field_length) {
+        out_fill(out, ' ', conv->width - field_length);
     }
 }
+
+static char test_sink_buf[64];
+static u64 test_sink_len;
+static u64 test_sink_writes;
+
+static void test_sink(const char *buf, u64 len) {
+    kassert(test_sink_len + len <= sizeof(test_sink_buf));
+
+    memcpy((u8 *)test_sink_buf + test_sink_len, (const u8 *)buf, len);
+    test_sink_len += len;
+    test_sink_writes += 1;
+}
+
+__format(printf, 2, 3) static void test_printf(kprintf_out_t *out,
+                                               const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    kvprintf_to(out, fmt, ap);
+    va_end(ap);
+    out_flush(out);
+}
+
+DEFINE_TEST(test_ksnprintf) {
+    char buf[32];
+
+    u64 len = ksnprintf(buf, sizeof(buf), "a%db%5uc%d%s|%c%%", -12, 34U, 0,
+                        "str", 'x');
+    kassert(len == 18);
+    kassert(strncmp(buf, "a-12b   34c0str|x%", sizeof(buf)) == 0);
+
+    len = ksnprintf(buf, sizeof(buf), "%08lx %X %o", 0xabcUL, 0xdeadU, 8U);
+    kassert(len == 16);
+    kassert(strncmp(buf, "00000abc DEAD 10", sizeof(buf)) == 0);
+
+    // Truncated output is null terminated, the length is that of the whole
+    // string
+    len = ksnprintf(buf, 6, "%s%10d", "0123", 5);
+    kassert(len == 14);
+    kassert(strncmp(buf, "0123 ", sizeof(buf)) == 0);
+    len = ksnprintf(buf, 1, "abc");
+    kassert(len == 3 && buf[0] == '\0');
+    len = ksnprintf(NULL, 0, "%lu", 123456UL);
+    kassert(len == 6);
+}
+
+// Return whether fmt is formatted as expected, with the right length
+__format(printf, 2, 3) static bool test_format(const char *expected,
+                                               const char *fmt, ...) {
+    char buf[48];
+    va_list ap;
+
+    va_start(ap, fmt);
+    u64 len = kvsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    return len == strlen(expected) && strncmp(buf, expected, sizeof(buf)) == 0;
+}
+
+DEFINE_TEST(test_kprintf_numbers) {
+    kassert(test_format("0 9 10 99 100 999 1000 12345",
+                        "%d %d %d %d %d %d %d %d", 0, 9, 10, 99, 100, 999,
+                        1000, 12345));
+    kassert(test_format("18446744073709551615", "%lu", ~0UL));
+    kassert(test_format("-9223372036854775808", "%ld", (long)(1UL << 63)));
+    kassert(test_format("-2147483648", "%d", (int)(1U << 31)));
+    kassert(test_format("1777777777777777777777 0 7", "%lo %o %o", ~0UL, 0U,
+                        7U));
+    kassert(test_format("ffffffffffffffff FFFFFFFF 0", "%lx %X %x", ~0UL, ~0U,
+                        0U));
+    kassert(test_format("  0x1000 0x1f", "%8p %p", (void *)0x1000,
+                        (void *)0x1f));
+
+    // Width and precision
+    kassert(test_format("-0012|  -12|-12  |", "%05d|%5d|%-5d|", -12, -12,
+                        -12));
+    kassert(test_format("   007|007|0ab   |", "%6.3d|%2.3d|%-6.3x|", 7, 7,
+                        0xab));
+    kassert(test_format("||    |", "%.0d|%.0x|%4.0u|", 0, 0U, 0U));
+    kassert(test_format("   42|42   |0042", "%*d|%*d|%.*d", 5, 42, -5, 42, 4,
+                        42));
+    kassert(test_format("ab|   ab|abc|x  |", "%.2s|%5.2s|%.*s|%-3c|", "abc",
+                        "abc", -1, "abc", 'x'));
+}
+
+DEFINE_TEST(test_kprintf_flush) {
+    char buf[8];
+    kprintf_out_t out = {
+        .buf = buf,
+        .size = sizeof(buf),
+        .len = 0,
+        .count = 0,
+        .flush = test_sink,
+    };
+
+    // A message that fits is written at once
+    test_sink_len = 0;
+    test_sink_writes = 0;
+    test_printf(&out, "ab%dc", 7);
+    kassert(test_sink_writes == 1 && test_sink_len == 4);
+    kassert(memcmp((const u8 *)test_sink_buf, (const u8 *)"ab7c", 4) == 0);
+
+    // A longer one is written in parts, with nothing lost
+    test_sink_len = 0;
+    test_sink_writes = 0;
+    test_printf(&out, "%s%12d!", "0123456789", 42);
+    kassert(test_sink_writes == 3 && test_sink_len == 23);
+    kassert(memcmp((const u8 *)test_sink_buf,
+                   (const u8 *)"0123456789          42!", 23)
+            == 0);
+}
@@ -4,11 +4,18 @@
 #include <stdarg.h>
 
 #include "attributes.h"
+#include "types.h"
 
 void puts(const char *str);
 void putchar(char c);
 
 void kprintf(const char *fmt, ...) __format(printf, 1, 2);
 void kvprintf(const char *fmt, va_list ap) __format(printf, 1, 0);
+void kvprintf_prefix(const char *prefix, const char *fmt, va_list ap)
+    __format(printf, 2, 0);
+
+u64 ksnprintf(char *buf, u64 size, const char *fmt, ...) __format(printf, 3, 4);
+u64 kvsnprintf(char *buf, u64 size, const char *fmt, va_list ap)
+    __format(printf, 3, 0);
 
 #endif /* ! AVOCADOS_KPRINTF_H_ */
@@ -2,20 +2,50 @@
 
 #include <stdarg.h>
 
+#include "kassert.h"
 #include "kprintf.h"
+#include "tools/test.h"
+#include "types.h"
 
-static const char *level_str[] = {
-    [LOG_LEVEL_NONE] = "NONE",   [LOG_LEVEL_ERROR] = "ERROR",
-    [LOG_LEVEL_WARN] = "WARN",   [LOG_LEVEL_INFO] = "INFO",
-    [LOG_LEVEL_DEBUG] = "DEBUG",
+static const char *level_prefix[] = {
+    [LOG_LEVEL_NONE] = "[NONE] ",   [LOG_LEVEL_ERROR] = "[ERROR] ",
+    [LOG_LEVEL_WARN] = "[WARN] ",   [LOG_LEVEL_INFO] = "[INFO] ",
+    [LOG_LEVEL_DEBUG] = "[DEBUG] ",
 };
 
-// TODO: log only certain level
-void log(enum log_level level, const char *fmt, ...) {
-    kprintf("[%s] ", level_str[level]);
+// Everything compiled in is printed until a subsystem is told otherwise
+enum log_level log_levels[LOG_NUM_SUBSYSTEMS] = {
+    [0 ... LOG_NUM_SUBSYSTEMS - 1] = LOG_COMPILE_LEVEL,
+};
+
+void log_set_level(enum log_subsystem subsystem, enum log_level level) {
+    kassert(subsystem < LOG_NUM_SUBSYSTEMS);
 
+    log_levels[subsystem] = level;
+}
+
+// Called by log once the level is known to be enabled
+void log_print(enum log_level level, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    kvprintf(fmt, args);
+    kvprintf_prefix(level_prefix[level], fmt, args);
     va_end(args);
 }
+
+DEFINE_TEST(test_log_levels) {
+    enum log_level saved_level = log_levels[LOG_SUBSYSTEM];
+    u64 num_evaluations = 0;
+
+    log_set_level(LOG_SUBSYSTEM, LOG_LEVEL_NONE);
+    kassert(!log_enabled(LOG_SUBSYSTEM, LOG_LEVEL_ERROR));
+    // Arguments of disabled logs are not evaluated
+    log(LOG_LEVEL_ERROR, "Never printed %lu\n", ++num_evaluations);
+    kassert(num_evaluations == 0);
+
+    log_set_level(LOG_SUBSYSTEM, LOG_LEVEL_WARN);
+    kassert(log_enabled(LOG_SUBSYSTEM, LOG_LEVEL_WARN));
+    kassert(!log_enabled(LOG_SUBSYSTEM, LOG_LEVEL_INFO));
+    kassert(!log_enabled(LOG_SUBSYSTEM, LOG_COMPILE_LEVEL + 1));
+
+    log_set_level(LOG_SUBSYSTEM, saved_level);
+}
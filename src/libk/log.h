@@ -1,6 +1,20 @@
 #ifndef AVOCADOS_LOG_H_
 #define AVOCADOS_LOG_H_
 
+/*
+ * Messages below LOG_COMPILE_LEVEL are compiled out, the others are printed
+ * if their level is enabled for the subsystem of the file at run time. Both
+ * checks are made before the arguments are evaluated, so a disabled log costs
+ * at most a load and a comparison.
+ *
+ * A file sets its subsystem by defining LOG_SUBSYSTEM before any include, it
+ * defaults to LOG_SUBSYSTEM_KERNEL.
+ *
+ * With LOG_BINARY, messages are recorded by binlog instead of formatted.
+ */
+
+#include <stdbool.h>
+
 #include "attributes.h"
 
 enum log_level {
@@ -12,6 +26,54 @@ enum log_level {
     LOG_LEVEL_ALL = 5,
 };
 
-void log(enum log_level, const char *fmt, ...) __format(printf, 2, 3);
+enum log_subsystem {
+    LOG_SUBSYSTEM_KERNEL,
+    LOG_SUBSYSTEM_ARCH,
+    LOG_SUBSYSTEM_ISR,
+    LOG_SUBSYSTEM_PMM,
+    LOG_SUBSYSTEM_VMM,
+    LOG_SUBSYSTEM_DRIVERS,
+    LOG_NUM_SUBSYSTEMS,
+};
+
+// Debug messages are only kept in debug builds
+#ifndef LOG_COMPILE_LEVEL
+#ifdef DEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+#ifndef LOG_SUBSYSTEM
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_KERNEL
+#endif
+
+// Most verbose level printed by each subsystem, read by log without locking
+extern enum log_level log_levels[LOG_NUM_SUBSYSTEMS];
+
+#define log_enabled(SUBSYSTEM, LEVEL)                                          \
+    ((LEVEL) <= LOG_COMPILE_LEVEL && (LEVEL) <= log_levels[SUBSYSTEM])
+
+#ifdef LOG_BINARY
+#define log_emit binlog
+#else
+#define log_emit log_print
+#endif
+
+#define log(LEVEL, ...)                                                        \
+    do {                                                                       \
+        if (log_enabled(LOG_SUBSYSTEM, LEVEL)) {                               \
+            log_emit(LEVEL, __VA_ARGS__);                                      \
+        }                                                                      \
+    } while (false)
+
+void log_set_level(enum log_subsystem subsystem, enum log_level level);
+void log_print(enum log_level level, const char *fmt, ...)
+    __format(printf, 2, 3);
+
+#ifdef LOG_BINARY
+#include "binlog.h"
+#endif
 
 #endif /* ! AVOCADOS_LOG_H_ */
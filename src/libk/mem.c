@@ -1,9 +1,208 @@
+/*
+ * Fills and copies use the string instructions. With ERMS (Enhanced REP
+ * MOVSB/STOSB, Vol. 1 3.7.6), rep movsb and rep stosb pick the widest stores
+ * themselves and beat anything written by hand past a few bytes. Without it,
+ * quadwords are moved by rep movsq and rep stosq and only the tail goes byte
+ * by byte. The variant is chosen by alternatives_apply, until then the
+ * quadword one is used as it works on every CPU.
+ *
+ * clear_page and copy_page use non-temporal stores, which bypass the caches:
+ * a page cleared or copied in bulk is usually touched long after, by then it
+ * would only have evicted useful lines.
+ */
+
+#include "arch/alternative.h"
+#include "arch/cpu_features.h"
+#include "arch/paging.h"
+#include "kassert.h"
 #include "mem.h"
+#include "tools/test.h"
+#include "utils.h"
+
+// Below this size, the startup of a string instruction costs more than a loop
+#define MEM_SHORT_SIZE 8
+
+// Loads of words that may not be aligned
+typedef u64 __attribute__((aligned(1), may_alias)) unaligned_u64;
+
+// The string loops. They take the registers of the string instructions (rdi,
+// rsi, rcx, rax) and only clobber these and rdx.
+__asm__(".pushsection .text.mem_string_loops, \"ax\"\n"
+        "memset_stosq:\n"
+        "    movq %rcx, %rdx\n"
+        "    shrq $3, %rcx\n"
+        "    rep stosq\n"
+        "    movq %rdx, %rcx\n"
+        "    andq $7, %rcx\n"
+        "    rep stosb\n"
+        "    ret\n"
+        "memset_stosb:\n"
+        "    rep stosb\n"
+        "    ret\n"
+        "memcpy_movsq:\n"
+        "    movq %rcx, %rdx\n"
+        "    shrq $3, %rcx\n"
+        "    rep movsq\n"
+        "    movq %rdx, %rcx\n"
+        "    andq $7, %rcx\n"
+        "    rep movsb\n"
+        "    ret\n"
+        "memcpy_movsb:\n"
+        "    rep movsb\n"
+        "    ret\n"
+        ".popsection\n");
 
-// TODO: Avoid optimization ??
-// TODO: volatile
 void memset(u8 *mem, u8 value, u64 n) {
-    for (u64 i = 0; i < n; ++i) {
-        mem[i] = value;
+    if (n < MEM_SHORT_SIZE) {
+        for (u64 i = 0; i < n; ++i) {
+            mem[i] = value;
+        }
+        return;
+    }
+
+    __asm__ volatile(
+        ALTERNATIVE_CALL("memset_stosq", "memset_stosb", CPU_FEATURE_ERMS)
+        : "+D"(mem), "+c"(n)
+        : "a"((u64)value * 0x0101010101010101UL)
+        : "rdx", "memory");
+}
+
+// The ranges must not overlap
+void memcpy(u8 *dst, const u8 *src, u64 n) {
+    if (n < MEM_SHORT_SIZE) {
+        for (u64 i = 0; i < n; ++i) {
+            dst[i] = src[i];
+        }
+        return;
+    }
+
+    __asm__ volatile(
+        ALTERNATIVE_CALL("memcpy_movsq", "memcpy_movsb", CPU_FEATURE_ERMS)
+        : "+D"(dst), "+S"(src), "+c"(n)
+        : /* No input */
+        : "rdx", "memory");
+}
+
+// The ranges may overlap
+void memmove(u8 *dst, const u8 *src, u64 n) {
+    // A forward copy only reads bytes it has not overwritten yet
+    if (dst <= src || dst >= src + n) {
+        memcpy(dst, src, n);
+        return;
+    }
+
+    // Copy backward, by quadwords then the head. Backward string instructions
+    // are not enhanced and setting the direction flag would leak it into
+    // interrupt handlers.
+    u64 i = n;
+    for (; i >= sizeof(u64); i -= sizeof(u64)) {
+        *(unaligned_u64 *)(dst + i - sizeof(u64)) =
+            *(const unaligned_u64 *)(src + i - sizeof(u64));
+    }
+    for (; i > 0; --i) {
+        dst[i - 1] = src[i - 1];
+    }
+}
+
+// Return 0 if the ranges are equal, otherwise the difference between the
+// first bytes that differ
+int memcmp(const u8 *s1, const u8 *s2, u64 n) {
+    u64 i = 0;
+
+    // Skip the equal quadwords, the first difference is then found bytewise
+    for (; i + sizeof(u64) <= n; i += sizeof(u64)) {
+        if (*(const unaligned_u64 *)(s1 + i)
+            != *(const unaligned_u64 *)(s2 + i)) {
+            break;
+        }
+    }
+
+    for (; i < n; ++i) {
+        if (s1[i] != s2[i]) {
+            return (int)s1[i] - (int)s2[i];
+        }
     }
+
+    return 0;
+}
+
+void clear_page(void *page) {
+    kassert((u64)page % PAGE_SIZE == 0);
+
+    u64 *ptr = page;
+
+    for (u64 i = 0; i < PAGE_SIZE / sizeof(u64); i += 4) {
+        __asm__ volatile("movnti %1, 0(%0)\n"
+                         "movnti %1, 8(%0)\n"
+                         "movnti %1, 16(%0)\n"
+                         "movnti %1, 24(%0)\n"
+                         : /* No output */
+                         : "r"(&ptr[i]), "r"(0UL)
+                         : "memory");
+    }
+
+    // Non-temporal stores are weakly ordered
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+// The source is read through the caches, only the stores are non-temporal
+void copy_page(void *dst, const void *src) {
+    kassert((u64)dst % PAGE_SIZE == 0);
+    kassert((u64)src % PAGE_SIZE == 0);
+
+    u64 *dst_ptr = dst;
+    const u64 *src_ptr = src;
+
+    for (u64 i = 0; i < PAGE_SIZE / sizeof(u64); i += 4) {
+        u64 tmp0, tmp1, tmp2, tmp3;
+        __asm__ volatile("movq 0(%5), %0\n"
+                         "movq 8(%5), %1\n"
+                         "movq 16(%5), %2\n"
+                         "movq 24(%5), %3\n"
+                         "movnti %0, 0(%4)\n"
+                         "movnti %1, 8(%4)\n"
+                         "movnti %2, 16(%4)\n"
+                         "movnti %3, 24(%4)\n"
+                         : "=&r"(tmp0), "=&r"(tmp1), "=&r"(tmp2), "=&r"(tmp3)
+                         : "r"(&dst_ptr[i]), "r"(&src_ptr[i])
+                         : "memory");
+    }
+
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+DEFINE_TEST(test_mem) {
+    u8 buf[64];
+    u8 ref[64];
+
+    for (u8 i = 0; i < 64; ++i) {
+        ref[i] = i;
+    }
+
+    memset(buf, 0xab, 64);
+    memset(buf + 3, 0x5a, 21);
+    kassert(buf[2] == 0xab && buf[3] == 0x5a && buf[23] == 0x5a);
+    kassert(buf[24] == 0xab);
+
+    memcpy(buf, ref, 64);
+    kassert(memcmp(buf, ref, 64) == 0);
+    memcpy(buf + 1, ref + 50, 13);
+    kassert(memcmp(buf + 1, ref + 50, 13) == 0);
+    kassert(buf[0] == 0 && buf[14] == 14);
+
+    // Overlapping moves in both directions
+    memcpy(buf, ref, 64);
+    memmove(buf + 5, buf, 40);
+    kassert(memcmp(buf + 5, ref, 40) == 0);
+    memcpy(buf, ref, 64);
+    memmove(buf, buf + 7, 50);
+    kassert(memcmp(buf, ref + 7, 50) == 0);
+    kassert(buf[50] == 50);
+
+    memcpy(buf, ref, 64);
+    buf[41] = 200;
+    kassert(memcmp(buf, ref, 64) > 0);
+    kassert(memcmp(ref, buf, 64) < 0);
+    kassert(memcmp(buf, ref, 41) == 0);
+    kassert(memcmp(buf, ref, 0) == 0);
 }
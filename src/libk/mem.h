@@ -4,5 +4,11 @@
 #include "types.h"
 
 void memset(u8 *mem, u8 value, u64 n);
+void memcpy(u8 *dst, const u8 *src, u64 n);
+void memmove(u8 *dst, const u8 *src, u64 n);
+int memcmp(const u8 *s1, const u8 *s2, u64 n);
+
+void clear_page(void *page);
+void copy_page(void *dst, const void *src);
 
 #endif /* ! AVOCADOS_MEM_H_ */
@@ -3,6 +3,7 @@
 #include <stdarg.h>
 
 #include "arch/instr.h"
+#include "binlog.h"
 #include "kprintf.h"
 
 // TODO: Mark kpanic function as cold
@@ -10,6 +11,10 @@
 // Report a fatal error and hang...
 noreturn void kpanic(const char *fmt, ...) {
     cli();
+#ifdef LOG_BINARY
+    // The logs leading to the panic
+    binlog_flush();
+#endif
 
     va_list ap;
     va_start(ap, fmt);
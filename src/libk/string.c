@@ -1,21 +1,212 @@
+/*
+ * The scans read a word of 8 bytes at a time and find the bytes they look for
+ * with the classic has-zero-byte trick: (w - 0x01..01) & ~w & 0x80..80 has the
+ * high bit of a byte set for the first zero byte of w, and possibly of bytes
+ * above it, never below. Words are read aligned, so a read never crosses into
+ * a page the string does not touch. The bytes of the first word that come
+ * before the string are forced to a value that cannot match.
+ */
+
+#include <stddef.h>
+
+#include "kassert.h"
+#include "mem.h"
 #include "string.h"
+#include "tools/test.h"
+#include "utils.h"
+
+#define WORD_SIZE sizeof(u64)
+#define WORD_ONES 0x0101010101010101UL
+#define WORD_HIGHS 0x8080808080808080UL
+
+// Words read from a string, whatever the type of the string
+typedef u64 __attribute__((may_alias)) word_t;
+
+// High bit of the first zero byte of word, 0 if there is none
+static inline u64 word_has_zero(u64 word) {
+    return (word - WORD_ONES) & ~word & WORD_HIGHS;
+}
+
+// Index of the byte of the lowest high bit of mask, which must not be 0
+static inline u64 word_first_byte(u64 mask) {
+    return (u64)__builtin_ctzl(mask) / 8;
+}
+
+// Bytes of the aligned word containing addr that come before addr
+static inline u64 word_head_mask(u64 addr) {
+    u64 offset = addr % WORD_SIZE;
+
+    return offset == 0 ? 0 : ~0UL >> (64 - offset * 8);
+}
+
+static inline const word_t *word_containing(const void *ptr) {
+    return (const word_t *)ALIGN_DOWN((u64)ptr, WORD_SIZE);
+}
 
 int strncmp(const char *s1, const char *s2, u64 n) {
     u64 i = 0;
-    while (i < n && s1[i] == s2[i] && s1[i] != '\0') {
-        i += 1;
+
+    // Words are only compared when both strings have the same alignment
+    if ((u64)s1 % WORD_SIZE == (u64)s2 % WORD_SIZE) {
+        for (; i < n && (u64)(s1 + i) % WORD_SIZE != 0; ++i) {
+            if (s1[i] != s2[i] || s1[i] == '\0') {
+                return s1[i] - s2[i];
+            }
+        }
+
+        for (; i + WORD_SIZE <= n; i += WORD_SIZE) {
+            u64 word = *(const word_t *)(s1 + i);
+            if (word != *(const word_t *)(s2 + i) || word_has_zero(word)) {
+                break;
+            }
+        }
     }
 
-    return i == n ? 0 : s1[i] - s2[i];
+    for (; i < n; ++i) {
+        if (s1[i] != s2[i] || s1[i] == '\0') {
+            return s1[i] - s2[i];
+        }
+    }
+
+    return 0;
 }
 
 u64 strlen(const char *s) {
-    u64 len = 0;
+    const word_t *ptr = word_containing(s);
+    u64 word = *ptr | word_head_mask((u64)s);
+
+    while (word_has_zero(word) == 0) {
+        ptr += 1;
+        word = *ptr;
+    }
+
+    return (u64)ptr + word_first_byte(word_has_zero(word)) - (u64)s;
+}
+
+// Return the length of s, or max_len if no null byte is in its first max_len
+// bytes. Nothing past them is read but the rest of their last word.
+u64 strnlen(const char *s, u64 max_len) {
+    if (max_len == 0) {
+        return 0;
+    }
+
+    u64 end = (u64)s + max_len;
+    const word_t *ptr = word_containing(s);
+    u64 word = *ptr | word_head_mask((u64)s);
 
-    while (*s != '\0') {
-        len += 1;
-        s += 1;
+    while (word_has_zero(word) == 0) {
+        ptr += 1;
+        if ((u64)ptr >= end) {
+            return max_len;
+        }
+        word = *ptr;
     }
 
-    return len;
+    u64 len = (u64)ptr + word_first_byte(word_has_zero(word)) - (u64)s;
+    return len < max_len ? len : max_len;
+}
+
+// Return the first occurrence of c in s, NULL if there is none. The null
+// byte is part of s.
+const char *strchr(const char *s, char c) {
+    u64 pattern = (u8)c * WORD_ONES;
+    // The bytes before s are replaced by bytes that are neither 0 nor c
+    u64 filler = ((u8)c == 0xff ? 0x01 : 0xff) * WORD_ONES;
+    u64 head = word_head_mask((u64)s);
+    const word_t *ptr = word_containing(s);
+    u64 word = (*ptr & ~head) | (filler & head);
+
+    u64 mask;
+    while ((mask = word_has_zero(word) | word_has_zero(word ^ pattern)) == 0) {
+        ptr += 1;
+        word = *ptr;
+    }
+
+    const char *res = (const char *)ptr + word_first_byte(mask);
+    return *res == c ? res : NULL;
+}
+
+// Return the first byte of the n bytes at mem equal to value, NULL if there is
+// none
+const u8 *memchr(const u8 *mem, u8 value, u64 n) {
+    if (n == 0) {
+        return NULL;
+    }
+
+    u64 pattern = value * WORD_ONES;
+    u64 end = (u64)mem + n;
+    const word_t *ptr = word_containing(mem);
+    // Flipping value out of the bytes before mem makes them non-zero
+    u64 word = (*ptr ^ pattern) | word_head_mask((u64)mem);
+
+    while (word_has_zero(word) == 0) {
+        ptr += 1;
+        if ((u64)ptr >= end) {
+            return NULL;
+        }
+        word = *ptr ^ pattern;
+    }
+
+    const u8 *res = (const u8 *)ptr + word_first_byte(word_has_zero(word));
+    return (u64)res < end ? res : NULL;
+}
+
+// Return the first occurrence of needle in haystack, NULL if there is none
+const u8 *memmem(const u8 *haystack, u64 haystack_len, const u8 *needle,
+                 u64 needle_len) {
+    if (needle_len == 0) {
+        return haystack;
+    }
+
+    const u8 *pos = haystack;
+    const u8 *last = haystack + haystack_len;
+    while ((u64)(last - pos) >= needle_len) {
+        // The first byte is searched by words, the rest compared in place
+        pos = memchr(pos, needle[0], (u64)(last - pos) - needle_len + 1);
+        if (pos == NULL) {
+            return NULL;
+        }
+        if (memcmp(pos + 1, needle + 1, needle_len - 1) == 0) {
+            return pos;
+        }
+        pos += 1;
+    }
+
+    return NULL;
+}
+
+DEFINE_TEST(test_string) {
+    // Aligned on a word so that every offset of the first word is tried
+    __align(8) char buf[48] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+    for (u64 offset = 0; offset < 16; ++offset) {
+        kassert(strlen(buf + offset) == 36 - offset);
+        kassert(strnlen(buf + offset, 5) == 5);
+        kassert(strnlen(buf + offset, 100) == 36 - offset);
+        kassert(strchr(buf + offset, 'z') == buf + 35);
+        kassert(strchr(buf + offset, '\0') == buf + 36);
+        kassert(memchr((const u8 *)buf + offset, 'z', 36 - offset)
+                == (const u8 *)buf + 35);
+        kassert(memchr((const u8 *)buf + offset, 'z', 35 - offset) == NULL);
+    }
+    // Bytes before the string must not match
+    kassert(strchr(buf + 3, '1') == NULL);
+    kassert(strchr(buf + 3, (char)0xff) == NULL);
+    kassert(memchr((const u8 *)buf + 3, '1', 20) == NULL);
+    kassert(strnlen(buf, 0) == 0);
+    kassert(memchr((const u8 *)buf, '0', 0) == NULL);
+
+    kassert(strncmp(buf, buf, 48) == 0);
+    kassert(strncmp(buf + 1, "123456789abcdefgh", 17) == 0);
+    kassert(strncmp(buf + 1, "123456789abcdefgH", 17) > 0);
+    kassert(strncmp(buf + 1, "123456789abcdefgH", 16) == 0);
+    kassert(strncmp("SRAT", "SLIT", 4) > 0);
+    kassert(strncmp("ab", "abc", 10) < 0);
+
+    const u8 *hay = (const u8 *)buf;
+    kassert(memmem(hay, 36, (const u8 *)"xyz", 3) == hay + 33);
+    kassert(memmem(hay, 35, (const u8 *)"xyz", 3) == NULL);
+    kassert(memmem(hay, 36, (const u8 *)"0", 1) == hay);
+    kassert(memmem(hay, 36, (const u8 *)"", 0) == hay);
+    kassert(memmem(hay, 2, (const u8 *)"012", 3) == NULL);
 }
@@ -5,5 +5,10 @@
 
 int strncmp(const char *s1, const char *s2, u64 n);
 u64 strlen(const char *s);
+u64 strnlen(const char *s, u64 max_len);
+const char *strchr(const char *s, char c);
+const u8 *memchr(const u8 *mem, u8 value, u64 n);
+const u8 *memmem(const u8 *haystack, u64 haystack_len, const u8 *needle,
+                 u64 needle_len);
 
 #endif /* ! AVOCADOS_STRING_H_ */
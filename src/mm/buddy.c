@@ -0,0 +1,306 @@
+#include <stdbool.h>
+
+#include "buddy.h"
+#include "libk/kassert.h"
+#include "libk/mem.h"
+#include "tools/test.h"
+#include "utils.h"
+
+static u64 buddy_num_blocks(u64 start_pfn, u64 end_pfn, u8 order);
+static u64 bitmap_bytes(u64 num_bits);
+static bool buddy_block_in_range(const buddy_t *buddy, u64 pfn, u8 order);
+static bool buddy_block_is_free(const buddy_t *buddy, u64 pfn, u8 order);
+static void buddy_mark_free(buddy_t *buddy, u64 pfn, u8 order);
+static void buddy_mark_used(buddy_t *buddy, u64 pfn, u8 order);
+static void buddy_insert(buddy_t *buddy, u64 pfn, u8 order);
+static u64 buddy_find_free_block(buddy_t *buddy, u8 order);
+
+// Number of aligned blocks of the given order overlapping the range
+static u64 buddy_num_blocks(u64 start_pfn, u64 end_pfn, u8 order) {
+    return ((end_pfn - 1) >> order) - (start_pfn >> order) + 1;
+}
+
+// Size in bytes of a bitmap_t with its chunks
+static u64 bitmap_bytes(u64 num_bits) {
+    return sizeof(bitmap_t)
+        + ALIGN_UP(num_bits, BITMAP_CHUNK_BITS) / BITS_PER_BYTE;
+}
+
+// Return the number of bytes of metadata needed to manage the given range
+u64 buddy_metadata_size(u64 start_pfn, u64 end_pfn) {
+    kassert(start_pfn < end_pfn);
+
+    u64 size = 0;
+    for (u8 order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+        u64 num_blocks = buddy_num_blocks(start_pfn, end_pfn, order);
+        u64 num_chunks = ALIGN_UP(num_blocks, BITMAP_CHUNK_BITS)
+            / BITMAP_CHUNK_BITS;
+        size += bitmap_bytes(num_blocks) + bitmap_bytes(num_chunks);
+    }
+
+    return size;
+}
+
+// metadata must be at least buddy_metadata_size(start_pfn, end_pfn) bytes long
+// and aligned on a bitmap_t. Every block of the range is initially allocated,
+// use buddy_add_free_range to give page frames to the allocator.
+void buddy_init(buddy_t *buddy, u64 start_pfn, u64 end_pfn, void *metadata) {
+    kassert(start_pfn < end_pfn);
+    kassert((u64)metadata % _Alignof(bitmap_t) == 0);
+
+    buddy->start_pfn = start_pfn;
+    buddy->end_pfn = end_pfn;
+
+    u8 *ptr = metadata;
+    for (u8 order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+        u64 num_blocks = buddy_num_blocks(start_pfn, end_pfn, order);
+        u64 num_chunks = ALIGN_UP(num_blocks, BITMAP_CHUNK_BITS)
+            / BITMAP_CHUNK_BITS;
+
+        buddy->num_free[order] = 0;
+        buddy->hint[order] = 0;
+
+        buddy->free_blocks[order] = (bitmap_t *)ptr;
+        buddy->free_blocks[order]->size = num_blocks;
+        memset((u8 *)buddy->free_blocks[order]->chunks, 0,
+               bitmap_bytes(num_blocks) - sizeof(bitmap_t));
+        ptr += bitmap_bytes(num_blocks);
+
+        // No free block yet so every chunk is full
+        buddy->full_chunks[order] = (bitmap_t *)ptr;
+        buddy->full_chunks[order]->size = num_chunks;
+        memset((u8 *)buddy->full_chunks[order]->chunks, 0xff,
+               bitmap_bytes(num_chunks) - sizeof(bitmap_t));
+        ptr += bitmap_bytes(num_chunks);
+    }
+}
+
+// Give the page frames [start_pfn, end_pfn) to the allocator. The page frames
+// must not be already free.
+void buddy_add_free_range(buddy_t *buddy, u64 start_pfn, u64 end_pfn) {
+    kassert(start_pfn >= buddy->start_pfn && end_pfn <= buddy->end_pfn);
+    kassert(start_pfn <= end_pfn);
+
+    // Split the range into the biggest aligned blocks it contains
+    u64 pfn = start_pfn;
+    while (pfn < end_pfn) {
+        u8 order = 0;
+        while (order < BUDDY_MAX_ORDER && (pfn & (1UL << order)) == 0
+               && pfn + (2UL << order) <= end_pfn) {
+            order += 1;
+        }
+
+        buddy_insert(buddy, pfn, order);
+        pfn += 1UL << order;
+    }
+}
+
+// Return the page frame number of the first page frame of the allocated block.
+// If no block is large enough, returns BUDDY_ALLOC_ERROR.
+u64 buddy_alloc(buddy_t *buddy, u8 order) {
+    kassert(order <= BUDDY_MAX_ORDER);
+
+    for (u8 curr_order = order; curr_order <= BUDDY_MAX_ORDER; ++curr_order) {
+        if (buddy->num_free[curr_order] == 0) {
+            continue;
+        }
+
+        u64 pfn = buddy_find_free_block(buddy, curr_order);
+        buddy_mark_used(buddy, pfn, curr_order);
+
+        // Split the block and give back the upper halves until we reach the
+        // requested order
+        while (curr_order > order) {
+            curr_order -= 1;
+            buddy_mark_free(buddy, pfn + (1UL << curr_order), curr_order);
+        }
+
+        return pfn;
+    }
+
+    return BUDDY_ALLOC_ERROR;
+}
+
+// Free a block previously returned by buddy_alloc with the same order.
+void buddy_free(buddy_t *buddy, u64 pfn, u8 order) {
+    kassert(order <= BUDDY_MAX_ORDER);
+    kassert(pfn % (1UL << order) == 0);
+    kassert(buddy_block_in_range(buddy, pfn, order));
+
+    // Catch double free: neither the block nor a block containing it can be
+    // free
+    for (u8 curr_order = order; curr_order <= BUDDY_MAX_ORDER; ++curr_order) {
+        u64 block_pfn = ALIGN_DOWN(pfn, 1UL << curr_order);
+        kassert(!buddy_block_in_range(buddy, block_pfn, curr_order)
+                || !buddy_block_is_free(buddy, block_pfn, curr_order));
+    }
+
+    buddy_insert(buddy, pfn, order);
+}
+
+static bool buddy_block_in_range(const buddy_t *buddy, u64 pfn, u8 order) {
+    return pfn >= buddy->start_pfn && pfn + (1UL << order) <= buddy->end_pfn;
+}
+
+static inline u64 buddy_block_idx(const buddy_t *buddy, u64 pfn, u8 order) {
+    return (pfn >> order) - (buddy->start_pfn >> order);
+}
+
+static bool buddy_block_is_free(const buddy_t *buddy, u64 pfn, u8 order) {
+    return bitmap_test(buddy->free_blocks[order],
+                       buddy_block_idx(buddy, pfn, order));
+}
+
+static void buddy_mark_free(buddy_t *buddy, u64 pfn, u8 order) {
+    u64 idx = buddy_block_idx(buddy, pfn, order);
+    u64 chunk_idx = idx / BITMAP_CHUNK_BITS;
+
+    bitmap_set(buddy->free_blocks[order], idx);
+    bitmap_clear(buddy->full_chunks[order], chunk_idx);
+    buddy->num_free[order] += 1;
+
+    if (chunk_idx / BITMAP_CHUNK_BITS < buddy->hint[order]) {
+        buddy->hint[order] = chunk_idx / BITMAP_CHUNK_BITS;
+    }
+}
+
+static void buddy_mark_used(buddy_t *buddy, u64 pfn, u8 order) {
+    u64 idx = buddy_block_idx(buddy, pfn, order);
+    u64 chunk_idx = idx / BITMAP_CHUNK_BITS;
+
+    bitmap_clear(buddy->free_blocks[order], idx);
+    if (buddy->free_blocks[order]->chunks[chunk_idx] == 0) {
+        bitmap_set(buddy->full_chunks[order], chunk_idx);
+    }
+    buddy->num_free[order] -= 1;
+}
+
+// Mark the block as free, merging it with its buddy as long as the buddy is
+// also free.
+static void buddy_insert(buddy_t *buddy, u64 pfn, u8 order) {
+    while (order < BUDDY_MAX_ORDER) {
+        u64 buddy_pfn = pfn ^ (1UL << order);
+        if (!buddy_block_in_range(buddy, buddy_pfn, order)
+            || !buddy_block_is_free(buddy, buddy_pfn, order)) {
+            break;
+        }
+
+        buddy_mark_used(buddy, buddy_pfn, order);
+        pfn &= ~(1UL << order);
+        order += 1;
+    }
+
+    buddy_mark_free(buddy, pfn, order);
+}
+
+// There must be at least one free block of the given order.
+// __builtin_ctzl compiles to tzcnt (which runs as bsf on CPUs without BMI1),
+// so a free block is found with one load of the summary and one load of
+// free_blocks per 4096 blocks skipped.
+static u64 buddy_find_free_block(buddy_t *buddy, u8 order) {
+    const bitmap_t *free_blocks = buddy->free_blocks[order];
+    const bitmap_t *full_chunks = buddy->full_chunks[order];
+
+    for (u64 i = buddy->hint[order];
+         i < ALIGN_UP(full_chunks->size, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
+         ++i) {
+        u64 non_full_chunks = ~full_chunks->chunks[i];
+        if (non_full_chunks != 0) {
+            buddy->hint[order] = i;
+
+            u64 chunk_idx =
+                i * BITMAP_CHUNK_BITS + (u64)__builtin_ctzl(non_full_chunks);
+            u64 idx = chunk_idx * BITMAP_CHUNK_BITS
+                + (u64)__builtin_ctzl(free_blocks->chunks[chunk_idx]);
+            return ((buddy->start_pfn >> order) + idx) << order;
+        }
+    }
+
+    kpanic("buddy: No free block of order %u while num_free is %lu\n", order,
+           buddy->num_free[order]);
+}
+
+DEFINE_TEST(test_buddy) {
+    u64 metadata[64];
+    buddy_t buddy;
+
+    // Unaligned range so that it is split in blocks of different orders
+    const u64 start_pfn = 5;
+    const u64 end_pfn = 5 + 64;
+    kassert(buddy_metadata_size(start_pfn, end_pfn) <= sizeof(metadata));
+
+    buddy_init(&buddy, start_pfn, end_pfn, metadata);
+    kassert(buddy_alloc(&buddy, 0) == BUDDY_ALLOC_ERROR);
+
+    buddy_add_free_range(&buddy, start_pfn, end_pfn);
+    // 5, 6-7, 8-15, 16-31, 32-63, 64-67, 68
+    kassert(buddy.num_free[0] == 2);
+    kassert(buddy.num_free[1] == 1);
+    kassert(buddy.num_free[2] == 1);
+    kassert(buddy.num_free[3] == 1);
+    kassert(buddy.num_free[4] == 1);
+    kassert(buddy.num_free[5] == 1);
+    kassert(buddy.num_free[6] == 0);
+
+    // No 64 frames aligned block in the range
+    kassert(buddy_alloc(&buddy, 6) == BUDDY_ALLOC_ERROR);
+
+    u64 pfn = buddy_alloc(&buddy, 3);
+    kassert(pfn == 8);
+
+    // The next order 3 blocks come from splitting 16-31
+    kassert(buddy_alloc(&buddy, 3) == 16);
+    kassert(buddy.num_free[3] == 1);
+    kassert(buddy_alloc(&buddy, 3) == 24);
+
+    buddy_free(&buddy, 24, 3);
+    buddy_free(&buddy, 16, 3);
+    buddy_free(&buddy, pfn, 3);
+
+    // Every frame is free again so blocks must have been merged back
+    kassert(buddy.num_free[3] == 1);
+    kassert(buddy.num_free[4] == 1);
+    kassert(buddy.num_free[5] == 1);
+
+    // Allocate every frame one by one
+    u64 num_allocated = 0;
+    while (buddy_alloc(&buddy, 0) != BUDDY_ALLOC_ERROR) {
+        num_allocated += 1;
+    }
+    kassert(num_allocated == end_pfn - start_pfn);
+    for (u8 order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+        kassert(buddy.num_free[order] == 0);
+    }
+
+    for (u64 i = start_pfn; i < end_pfn; ++i) {
+        buddy_free(&buddy, i, 0);
+    }
+    kassert(buddy.num_free[0] == 2);
+    kassert(buddy.num_free[5] == 1);
+}
+
+DEFINE_TEST(test_buddy_summary) {
+    // Too big for the kernel stack
+    static u64 metadata[320];
+    buddy_t buddy;
+
+    // 2 summary chunks at order 0
+    const u64 start_pfn = 0;
+    const u64 end_pfn = 2 * BITMAP_CHUNK_BITS * BITMAP_CHUNK_BITS;
+    kassert(buddy_metadata_size(start_pfn, end_pfn) <= sizeof(metadata));
+
+    buddy_init(&buddy, start_pfn, end_pfn, metadata);
+
+    buddy_add_free_range(&buddy, 5001, 5002);
+    kassert(buddy_alloc(&buddy, 0) == 5001);
+    kassert(buddy.hint[0] == 1);
+    kassert(buddy_alloc(&buddy, 0) == BUDDY_ALLOC_ERROR);
+
+    // Freeing before the hint moves it back
+    buddy_add_free_range(&buddy, 100, 101);
+    kassert(buddy.hint[0] == 0);
+    buddy_free(&buddy, 5001, 0);
+    kassert(buddy_alloc(&buddy, 0) == 100);
+    kassert(buddy_alloc(&buddy, 0) == 5001);
+    kassert(buddy_alloc(&buddy, 0) == BUDDY_ALLOC_ERROR);
+}
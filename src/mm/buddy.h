@@ -0,0 +1,44 @@
+#ifndef AVOCADOS_BUDDY_H_
+#define AVOCADOS_BUDDY_H_
+
+#include "attributes.h"
+#include "libk/bitmap.h"
+#include "types.h"
+
+// A block of order n is made of 2^n page frames, so the largest block is
+// 2^BUDDY_MAX_ORDER * 4 KiB = 4 MiB.
+#define BUDDY_MAX_ORDER 10
+
+#define BUDDY_ALLOC_ERROR 0xffffffffffffffffUL
+
+// Binary buddy allocator over the page frame numbers [start_pfn, end_pfn).
+// Blocks of order n start on a page frame number multiple of 2^n, so they are
+// also physically aligned on their size.
+typedef struct {
+    // First page frame number of the range
+    u64 start_pfn;
+    // Page frame number following the last page frame of the range
+    u64 end_pfn;
+    // Number of free blocks of each order
+    u64 num_free[BUDDY_MAX_ORDER + 1];
+    // For each order, one bit per aligned block of that order with 1 = the
+    // block is free and is not part of a bigger free block. Bit i of order n
+    // corresponds to the block starting at ((start_pfn >> n) + i) << n.
+    bitmap_t *free_blocks[BUDDY_MAX_ORDER + 1];
+    // Summary of free_blocks: one bit per chunk of free_blocks with 1 = the
+    // chunk has no free block. Searching a free block only reads one summary
+    // chunk per 4096 blocks. Bits past the last chunk are always set.
+    bitmap_t *full_chunks[BUDDY_MAX_ORDER + 1];
+    // Index of the first chunk of full_chunks that may have a zero bit, no
+    // free block exists before it
+    u64 hint[BUDDY_MAX_ORDER + 1];
+} buddy_t;
+
+u64 buddy_metadata_size(u64 start_pfn, u64 end_pfn);
+void buddy_init(buddy_t *buddy, u64 start_pfn, u64 end_pfn, void *metadata);
+void buddy_add_free_range(buddy_t *buddy, u64 start_pfn, u64 end_pfn);
+
+u64 buddy_alloc(buddy_t *buddy, u8 order) __warn_unused_result;
+void buddy_free(buddy_t *buddy, u64 pfn, u8 order);
+
+#endif /* ! AVOCADOS_BUDDY_H_ */
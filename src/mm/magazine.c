@@ -0,0 +1,243 @@
+/*
+ * Per-CPU page frame magazines, based on "Magazines and Vmem: Extending the
+ * Slab Allocator to Many CPUs and Arbitrary Resources" (Bonwick, Adams).
+ *
+ * A magazine is a page_frame_cache_t. Each CPU owns two of them: the loaded
+ * magazine and the previous one. Single frame allocations and frees are served
+ * from these two magazines without touching the memory regions or any data
+ * written by other CPUs. Only when both magazines are empty (resp. full) a
+ * full (resp. empty) magazine is exchanged with the depot shared by all CPUs,
+ * and only when the depot cannot help frames are moved from (resp. to) the
+ * buddy allocators, a whole magazine at a time with one batch call.
+ *
+ * Frames held in magazines are free but stay allocated from the point of view
+ * of the memory regions. Their refcount is 0, so that pmm_free catches a frame
+ * freed twice before it reaches a magazine.
+ *
+ * The magazines of a CPU are only touched by that CPU, so only the depot is
+ * locked, for the time of a magazine exchange.
+ */
+
+#include "arch/percpu.h"
+#include "arch/spinlock.h"
+#include "attributes.h"
+#include "magazine.h"
+#include "page_frame_cache.h"
+#include "pmm.h"
+
+// Number of magazines that are not loaded on a CPU
+#define DEPOT_NUM_MAGAZINES 32
+#define NUM_MAGAZINES (MAX_CPUS * 2 + DEPOT_NUM_MAGAZINES)
+
+typedef struct {
+    page_frame_cache_t *loaded;
+    page_frame_cache_t *previous;
+    // Only written by the owning CPU, see magazine_stats_t
+    u64 num_allocs;
+    u64 num_frees;
+    u64 alloc_misses;
+    u64 free_misses;
+} __align(CACHE_LINE_SIZE) cpu_magazines_t;
+
+// Every magazine is either owned by a CPU or in the depot, so both arrays can
+// hold all the magazines of the depot.
+typedef struct {
+    spinlock_t lock;
+    page_frame_cache_t *full[DEPOT_NUM_MAGAZINES];
+    u64 num_full;
+    page_frame_cache_t *empty[DEPOT_NUM_MAGAZINES];
+    u64 num_empty;
+} depot_t;
+
+static bool magazine_fill(page_frame_cache_t *magazine);
+static u64 magazine_empty(page_frame_cache_t *magazine);
+static void cpu_magazines_swap(cpu_magazines_t *cpu_magazines);
+static bool depot_exchange_empty(cpu_magazines_t *cpu_magazines);
+static bool depot_exchange_full(cpu_magazines_t *cpu_magazines);
+
+static page_frame_cache_t magazines[NUM_MAGAZINES];
+static cpu_magazines_t cpu_magazines[MAX_CPUS];
+static depot_t depot;
+
+void magazine_init(void) {
+    u64 magazine_idx = 0;
+
+    for (u32 i = 0; i < MAX_CPUS; ++i) {
+        magazines[magazine_idx].count = 0;
+        cpu_magazines[i].loaded = &magazines[magazine_idx];
+        magazine_idx += 1;
+
+        magazines[magazine_idx].count = 0;
+        cpu_magazines[i].previous = &magazines[magazine_idx];
+        magazine_idx += 1;
+
+        cpu_magazines[i].num_allocs = 0;
+        cpu_magazines[i].num_frees = 0;
+        cpu_magazines[i].alloc_misses = 0;
+        cpu_magazines[i].free_misses = 0;
+    }
+
+    depot.lock = SPINLOCK_INIT;
+    depot.num_full = 0;
+    depot.num_empty = 0;
+    while (magazine_idx < NUM_MAGAZINES) {
+        magazines[magazine_idx].count = 0;
+        depot.empty[depot.num_empty] = &magazines[magazine_idx];
+        depot.num_empty += 1;
+        magazine_idx += 1;
+    }
+}
+
+// Take a frame from the magazines of the current CPU.
+// Return false if no free frame is left.
+bool magazine_alloc(u64 *frame_addr) {
+    cpu_magazines_t *m = &cpu_magazines[cpu_id()];
+
+    if (page_frame_cache_is_empty(m->loaded)) {
+        if (!page_frame_cache_is_empty(m->previous)) {
+            cpu_magazines_swap(m);
+        } else if (depot_exchange_empty(m)) {
+            m->alloc_misses += 1;
+        } else {
+            if (!magazine_fill(m->loaded)) {
+                return false;
+            }
+            m->alloc_misses += 1;
+        }
+    }
+
+    m->num_allocs += 1;
+    *frame_addr = page_frame_cache_pop(m->loaded);
+    return true;
+}
+
+// Put a frame in the magazines of the current CPU
+void magazine_free(u64 frame_addr) {
+    cpu_magazines_t *m = &cpu_magazines[cpu_id()];
+
+    if (page_frame_cache_is_full(m->loaded)) {
+        if (!page_frame_cache_is_full(m->previous)) {
+            cpu_magazines_swap(m);
+        } else if (depot_exchange_full(m)) {
+            m->free_misses += 1;
+        } else {
+            magazine_empty(m->previous);
+            cpu_magazines_swap(m);
+            m->free_misses += 1;
+        }
+    }
+
+    m->num_frees += 1;
+    page_frame_cache_push(m->loaded, frame_addr);
+}
+
+// Give the frames of the full magazines of the depot back to the buddy
+// allocators. Return the number of frames freed.
+u64 magazine_drain_depot(void) {
+    u64 num_frames = 0;
+
+    spin_lock(&depot.lock);
+    while (depot.num_full > 0) {
+        depot.num_full -= 1;
+        page_frame_cache_t *magazine = depot.full[depot.num_full];
+        spin_unlock(&depot.lock);
+
+        // The magazine belongs to no one while it is emptied, so the buddy
+        // allocators are never called with the depot locked
+        num_frames += magazine_empty(magazine);
+
+        spin_lock(&depot.lock);
+        depot.empty[depot.num_empty] = magazine;
+        depot.num_empty += 1;
+    }
+    spin_unlock(&depot.lock);
+
+    return num_frames;
+}
+
+// Snapshot of the magazine counters. It is not atomic with respect to other
+// CPUs: counters of other CPUs may be read in the middle of an update.
+void magazine_stats(magazine_stats_t *stats) {
+    *stats = (magazine_stats_t){ 0 };
+
+    for (u32 i = 0; i < MAX_CPUS; ++i) {
+        const cpu_magazines_t *m = &cpu_magazines[i];
+
+        stats->num_frames += m->loaded->count + m->previous->count;
+        stats->alloc_hits += m->num_allocs - m->alloc_misses;
+        stats->free_hits += m->num_frees - m->free_misses;
+        stats->alloc_misses += m->alloc_misses;
+        stats->free_misses += m->free_misses;
+    }
+
+    spin_lock(&depot.lock);
+    stats->num_frames += depot.num_full * PAGE_FRAME_CACHE_SIZE;
+    spin_unlock(&depot.lock);
+}
+
+// Fill the magazine with frames from the buddy allocators.
+// Return false if no frame could be allocated.
+static bool magazine_fill(page_frame_cache_t *magazine) {
+    magazine->count += pmm_alloc_cache_batch(
+        &magazine->frame_addrs[magazine->count],
+        PAGE_FRAME_CACHE_SIZE - magazine->count, true);
+
+    return !page_frame_cache_is_empty(magazine);
+}
+
+// Give every frame of the magazine back to the buddy allocators.
+// Return the number of frames freed.
+static u64 magazine_empty(page_frame_cache_t *magazine) {
+    u64 num_frames = magazine->count;
+
+    pmm_free_cache_batch(magazine->frame_addrs, magazine->count);
+    magazine->count = 0;
+
+    return num_frames;
+}
+
+static void cpu_magazines_swap(cpu_magazines_t *m) {
+    page_frame_cache_t *tmp = m->loaded;
+    m->loaded = m->previous;
+    m->previous = tmp;
+}
+
+// Give back the empty previous magazine for a full one of the depot.
+// Return false if the depot has no full magazine.
+static bool depot_exchange_empty(cpu_magazines_t *m) {
+    spin_lock(&depot.lock);
+    if (depot.num_full == 0) {
+        spin_unlock(&depot.lock);
+        return false;
+    }
+
+    depot.empty[depot.num_empty] = m->previous;
+    depot.num_empty += 1;
+
+    m->previous = m->loaded;
+    depot.num_full -= 1;
+    m->loaded = depot.full[depot.num_full];
+    spin_unlock(&depot.lock);
+
+    return true;
+}
+
+// Give back the full previous magazine for an empty one of the depot.
+// Return false if the depot has no empty magazine.
+static bool depot_exchange_full(cpu_magazines_t *m) {
+    spin_lock(&depot.lock);
+    if (depot.num_empty == 0) {
+        spin_unlock(&depot.lock);
+        return false;
+    }
+
+    depot.full[depot.num_full] = m->previous;
+    depot.num_full += 1;
+
+    m->previous = m->loaded;
+    depot.num_empty -= 1;
+    m->loaded = depot.empty[depot.num_empty];
+    spin_unlock(&depot.lock);
+
+    return true;
+}
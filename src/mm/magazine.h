@@ -0,0 +1,26 @@
+#ifndef AVOCADOS_MAGAZINE_H_
+#define AVOCADOS_MAGAZINE_H_
+
+#include <stdbool.h>
+
+#include "types.h"
+
+typedef struct {
+    // Number of free frames held in magazines
+    u64 num_frames;
+    // Allocations and frees served by the magazines of the CPU
+    u64 alloc_hits;
+    u64 free_hits;
+    // Allocations and frees that went to the depot or the buddy allocators
+    u64 alloc_misses;
+    u64 free_misses;
+} magazine_stats_t;
+
+void magazine_init(void);
+
+bool magazine_alloc(u64 *frame_addr);
+void magazine_free(u64 frame_addr);
+u64 magazine_drain_depot(void);
+void magazine_stats(magazine_stats_t *stats);
+
+#endif /* ! AVOCADOS_MAGAZINE_H_ */
@@ -0,0 +1,423 @@
+/*
+ * Boot-time physical memory allocator.
+ *
+ * memblock only knows two sets of physical ranges: the available memory, given
+ * by the multiboot memory map, and the reserved memory, starting with the
+ * kernel image. Allocating a range reserves it. This is all the PMM needs to
+ * place its own metadata and the page tables that map it, so that it does not
+ * have to guess where free memory is.
+ *
+ * Both sets start in arrays of the kernel image. When one of them runs low on
+ * free slots, it moves to an array twice as large, allocated and mapped with
+ * memblock itself, so that memory maps of any length fit. The few slots kept
+ * free cover the ranges reserved while the array grows.
+ *
+ * Once the PMM has built its memory regions, it marks every reserved range as
+ * allocated in them and memblock is retired.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_PMM
+
+#include "arch/paging.h"
+#include "libk/kassert.h"
+#include "libk/log.h"
+#include "libk/mem.h"
+#include "libk/panic.h"
+#include "memblock.h"
+#include "pmm.h"
+#include "tools/test.h"
+#include "utils.h"
+
+extern u64 _sboot;
+extern u64 _eboot;
+extern u64 _skern;
+extern u64 _ekern;
+
+static void memblock_add_range(memblock_ranges_t *type, u64 base, u64 end);
+static void memblock_grow(memblock_ranges_t *type);
+static void memblock_insert(memblock_ranges_t *type, u64 base, u64 end);
+static u64 memblock_find(const memblock_ranges_t *mem,
+                         const memblock_ranges_t *res, u64 size, u64 align,
+                         u64 min_addr, u64 max_addr);
+static u64 memblock_alloc_table(void);
+
+// Number of ranges of each kind before the arrays grow
+#define MEMBLOCK_INIT_RANGES 128
+// Free slots left when an array grows: the new array and the page tables
+// mapping it are reserved before the ranges are copied
+#define MEMBLOCK_GROW_SLACK 8
+
+// Arrays moved out of the kernel image are mapped from there, in the 2MiB
+// below the early ACPI window
+#define MEMBLOCK_ARRAYS_ADDR 0x000000000fa00000
+#define MEMBLOCK_ARRAYS_END_ADDR 0x000000000fc00000
+
+static memblock_range_t memory_init_ranges[MEMBLOCK_INIT_RANGES];
+static memblock_range_t reserved_init_ranges[MEMBLOCK_INIT_RANGES];
+static memblock_ranges_t memory = {
+    .capacity = MEMBLOCK_INIT_RANGES,
+    .ranges = memory_init_ranges,
+};
+static memblock_ranges_t reserved = {
+    .capacity = MEMBLOCK_INIT_RANGES,
+    .ranges = reserved_init_ranges,
+};
+// Where the next array is mapped
+static u64 arrays_virt_addr = MEMBLOCK_ARRAYS_ADDR;
+// Set while an array grows, the slack covers the ranges inserted meanwhile
+static bool growing = false;
+static bool retired = false;
+
+// Add every available entry of the memory map and reserve the kernel image.
+// The entries are copied so the memory map can be overwritten afterwards.
+// ACPI reclaimable memory and the boot range are added but stay reserved until
+// their owner hands them to the PMM with pmm_free_reserved.
+void memblock_init(const struct multiboot_tag_mmap *mmap_tag) {
+    for (u64 i = 0; sizeof(struct multiboot_tag_mmap)
+                 + i * sizeof(struct multiboot_mmap_entry)
+             < mmap_tag->size;
+         i++) {
+        const struct multiboot_mmap_entry *entry = &mmap_tag->entries[i];
+        if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
+            memblock_add(entry->addr, entry->addr + entry->len);
+        } else if (entry->type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE) {
+            memblock_add(entry->addr, entry->addr + entry->len);
+            memblock_reserve(entry->addr, entry->addr + entry->len);
+        }
+    }
+
+    log(LOG_LEVEL_WARN,
+        "memblock: Physical memory outside 0x%016lx-0x%016lx will be "
+        "considered free\n",
+        (u64)&_sboot, (u64)&_ekern);
+    memblock_reserve((u64)&_sboot, (u64)&_eboot);
+    memblock_reserve((u64)&_skern, (u64)&_ekern);
+}
+
+// Add the page frames fully contained in [base, end) to the available memory
+void memblock_add(u64 base, u64 end) {
+    memblock_add_range(&memory, ALIGN_UP(base, PAGE_SIZE),
+                       ALIGN_DOWN(end, PAGE_SIZE));
+}
+
+// Reserve every page frame overlapping [base, end)
+void memblock_reserve(u64 base, u64 end) {
+    memblock_add_range(&reserved, ALIGN_DOWN(base, PAGE_SIZE),
+                       ALIGN_UP(end, PAGE_SIZE));
+}
+
+// Allocate and reserve size bytes aligned on align, a power of two multiple of
+// PAGE_SIZE, anywhere in available memory.
+// Return the physical address of the range or MEMBLOCK_ALLOC_ERROR.
+u64 memblock_alloc(u64 size, u64 align) {
+    return memblock_alloc_range(size, align, 0, MEMBLOCK_ALLOC_ERROR);
+}
+
+// Same as memblock_alloc but the range must fit in [min_addr, max_addr). The
+// highest free range is taken so that low memory stays available for devices.
+u64 memblock_alloc_range(u64 size, u64 align, u64 min_addr, u64 max_addr) {
+    if (retired) {
+        kpanic("memblock: Allocation after the PMM took over\n");
+    }
+
+    size = ALIGN_UP(size, PAGE_SIZE);
+    u64 base =
+        memblock_find(&memory, &reserved, size, align, min_addr, max_addr);
+    if (base != MEMBLOCK_ALLOC_ERROR) {
+        memblock_add_range(&reserved, base, base + size);
+    }
+
+    return base;
+}
+
+// Map size bytes of physical memory at phys_addr to virt_addr. Missing paging
+// structures are allocated with memblock, so they are reserved too. Wherever
+// both addresses are aligned on LARGE_PAGE_SIZE, 2 MiB pages are used so that
+// large ranges need few page tables.
+void memblock_map(u64 virt_addr, u64 phys_addr, u64 size) {
+    kassert(virt_addr % PAGE_SIZE == 0);
+    kassert(phys_addr % PAGE_SIZE == 0);
+
+    size = ALIGN_UP(size, PAGE_SIZE);
+
+    // A new table is reached through recursive paging as soon as the entry
+    // referencing it is present, and is zeroed so that no entry is present
+    u64 k = 0;
+    while (k < size) {
+        u64 addr = virt_addr + k;
+
+        pml4e_t *pml4e = get_pml4e(addr);
+        if (!pml4e->present) {
+            *pml4e = (pml4e_t){
+                .present = 1,
+                .rw = 1,
+                .us = 0,
+                .addr = BIT_RANGE(memblock_alloc_table(), 12, 51),
+                .xd = 0,
+            };
+            memset((u8 *)ALIGN_DOWN((u64)get_pdpte(addr), PAGE_SIZE), 0,
+                   PAGE_SIZE);
+        }
+
+        pdpte_t *pdpte = get_pdpte(addr);
+        if (!pdpte->present) {
+            *pdpte = (pdpte_t){
+                .present = 1,
+                .rw = 1,
+                .us = 0,
+                .addr = BIT_RANGE(memblock_alloc_table(), 12, 51),
+                .xd = 0,
+            };
+            memset((u8 *)ALIGN_DOWN((u64)get_pde(addr), PAGE_SIZE), 0,
+                   PAGE_SIZE);
+        }
+
+        pde_t *pde = get_pde(addr);
+        if (!pde->present && addr % LARGE_PAGE_SIZE == 0
+            && (phys_addr + k) % LARGE_PAGE_SIZE == 0
+            && size - k >= LARGE_PAGE_SIZE) {
+            *(pde_large_t *)pde = (pde_large_t){
+                .present = 1,
+                .rw = 1,
+                .us = 0,
+                .ps = 1,
+                .addr = BIT_RANGE(phys_addr + k, 21, 51),
+                .xd = 1,
+            };
+            k += LARGE_PAGE_SIZE;
+            continue;
+        }
+        if (!pde->present) {
+            *pde = (pde_t){
+                .present = 1,
+                .rw = 1,
+                .us = 0,
+                .addr = BIT_RANGE(memblock_alloc_table(), 12, 51),
+                .xd = 0,
+            };
+            memset((u8 *)ALIGN_DOWN((u64)get_pte(addr), PAGE_SIZE), 0,
+                   PAGE_SIZE);
+        }
+
+        pte_t *pte = get_pte(addr);
+        kassert(!pte->present);
+        *pte = (pte_t){
+            .present = 1,
+            .rw = 1,
+            .us = 0,
+            .addr = BIT_RANGE(phys_addr + k, 12, 51),
+            .xd = 1,
+        };
+        k += PAGE_SIZE;
+    }
+}
+
+const memblock_ranges_t *memblock_memory(void) {
+    return &memory;
+}
+
+const memblock_ranges_t *memblock_reserved(void) {
+    return &reserved;
+}
+
+// Forbid any further allocation, the PMM owns physical memory from now on
+void memblock_retire(void) {
+    retired = true;
+
+    log(LOG_LEVEL_INFO, "memblock: %lu available and %lu reserved ranges\n",
+        memory.count, reserved.count);
+}
+
+// Insert [base, end) in memory or reserved, which grows first if it runs low
+// on free slots
+static void memblock_add_range(memblock_ranges_t *type, u64 base, u64 end) {
+    if (!growing && type->count + MEMBLOCK_GROW_SLACK >= type->capacity) {
+        memblock_grow(type);
+    }
+
+    memblock_insert(type, base, end);
+}
+
+// Move the ranges to an array twice as large, taken from available memory
+static void memblock_grow(memblock_ranges_t *type) {
+    growing = true;
+
+    u64 capacity = type->capacity * 2;
+    u64 size = ALIGN_UP(capacity * sizeof(memblock_range_t), PAGE_SIZE);
+    if (arrays_virt_addr + size > MEMBLOCK_ARRAYS_END_ADDR) {
+        kpanic("memblock: No virtual memory left for %lu ranges\n", capacity);
+    }
+
+    u64 phys_addr = memblock_find(&memory, &reserved, size, PAGE_SIZE, 0,
+                                  MEMBLOCK_ALLOC_ERROR);
+    if (phys_addr == MEMBLOCK_ALLOC_ERROR) {
+        kpanic("memblock: No memory left for %lu ranges\n", capacity);
+    }
+
+    // Reserved before it is mapped, so that the page tables go elsewhere
+    memblock_insert(&reserved, phys_addr, phys_addr + size);
+    memblock_map(arrays_virt_addr, phys_addr, size);
+
+    memblock_range_t *ranges = (memblock_range_t *)arrays_virt_addr;
+    memcpy((u8 *)ranges, (const u8 *)type->ranges,
+           type->count * sizeof(memblock_range_t));
+    type->ranges = ranges;
+    type->capacity = capacity;
+    arrays_virt_addr += size;
+
+    growing = false;
+
+    log(LOG_LEVEL_DEBUG, "memblock: Room for %lu ranges at 0x%016lx\n",
+        capacity, phys_addr);
+}
+
+// Add [base, end) to the ranges, merging it with the ranges it overlaps or
+// touches
+static void memblock_insert(memblock_ranges_t *type, u64 base, u64 end) {
+    if (base >= end) {
+        return;
+    }
+
+    // Ranges [first, last) are merged with the new one
+    u64 first = 0;
+    while (first < type->count && type->ranges[first].end < base) {
+        first += 1;
+    }
+    u64 last = first;
+    while (last < type->count && type->ranges[last].base <= end) {
+        if (type->ranges[last].base < base) {
+            base = type->ranges[last].base;
+        }
+        if (type->ranges[last].end > end) {
+            end = type->ranges[last].end;
+        }
+        last += 1;
+    }
+
+    if (first == last) {
+        if (type->count == type->capacity) {
+            kpanic("memblock: More than %lu ranges\n", type->capacity);
+        }
+
+        for (u64 i = type->count; i > first; --i) {
+            type->ranges[i] = type->ranges[i - 1];
+        }
+        type->count += 1;
+    } else {
+        // Keep the first merged range and drop the others
+        u64 num_merged = last - first - 1;
+        for (u64 i = first + 1; i + num_merged < type->count; ++i) {
+            type->ranges[i] = type->ranges[i + num_merged];
+        }
+        type->count -= num_merged;
+    }
+
+    type->ranges[first] = (memblock_range_t){ .base = base, .end = end };
+}
+
+// Return the highest base address of size bytes aligned on align, in
+// [min_addr, max_addr), inside a range of mem and outside of the ranges of
+// res, or MEMBLOCK_ALLOC_ERROR
+static u64 memblock_find(const memblock_ranges_t *mem,
+                         const memblock_ranges_t *res, u64 size, u64 align,
+                         u64 min_addr, u64 max_addr) {
+    kassert(align != 0 && (align & (align - 1)) == 0);
+
+    for (u64 i = mem->count; i > 0; --i) {
+        u64 range_base = mem->ranges[i - 1].base;
+        u64 range_end = mem->ranges[i - 1].end;
+        if (range_base < min_addr) {
+            range_base = min_addr;
+        }
+        if (range_end > max_addr) {
+            range_end = max_addr;
+        }
+
+        // Move the candidate below every reserved range it overlaps, the
+        // reserved ranges being sorted a single pass from the top is enough
+        u64 j = res->count;
+        while (range_end >= range_base + size) {
+            u64 base = ALIGN_DOWN(range_end - size, align);
+            if (base < range_base) {
+                break;
+            }
+
+            while (j > 0 && res->ranges[j - 1].base >= base + size) {
+                j -= 1;
+            }
+            if (j == 0 || res->ranges[j - 1].end <= base) {
+                return base;
+            }
+            range_end = res->ranges[j - 1].base;
+        }
+    }
+
+    return MEMBLOCK_ALLOC_ERROR;
+}
+
+// Allocate a paging structure, which cannot fail at boot
+static u64 memblock_alloc_table(void) {
+    u64 phys_addr = memblock_alloc(PAGING_STRUCT_SIZE, PAGING_STRUCT_SIZE);
+    if (phys_addr == MEMBLOCK_ALLOC_ERROR) {
+        kpanic("memblock: No memory left for a paging structure\n");
+    }
+
+    return phys_addr;
+}
+
+DEFINE_TEST(test_memblock_insert) {
+    memblock_range_t storage[4];
+    memblock_ranges_t ranges = { .count = 0, .capacity = 4, .ranges = storage };
+
+    memblock_insert(&ranges, 0x5000, 0x6000);
+    memblock_insert(&ranges, 0x1000, 0x2000);
+    memblock_insert(&ranges, 0x8000, 0x9000);
+    kassert(ranges.count == 3);
+    kassert(ranges.ranges[0].base == 0x1000);
+    kassert(ranges.ranges[2].base == 0x8000);
+
+    // Touching ranges are merged
+    memblock_insert(&ranges, 0x2000, 0x3000);
+    kassert(ranges.count == 3);
+    kassert(ranges.ranges[0].end == 0x3000);
+
+    // A range overlapping two others merges all of them
+    memblock_insert(&ranges, 0x5800, 0x8800);
+    kassert(ranges.count == 2);
+    kassert(ranges.ranges[1].base == 0x5000);
+    kassert(ranges.ranges[1].end == 0x9000);
+
+    memblock_insert(&ranges, 0x0000, 0xa000);
+    kassert(ranges.count == 1);
+    kassert(ranges.ranges[0].base == 0x0000);
+    kassert(ranges.ranges[0].end == 0xa000);
+}
+
+DEFINE_TEST(test_memblock_find) {
+    memblock_range_t mem_storage[2];
+    memblock_range_t res_storage[1];
+    memblock_ranges_t mem = {
+        .count = 0,
+        .capacity = 2,
+        .ranges = mem_storage,
+    };
+    memblock_ranges_t res = {
+        .count = 0,
+        .capacity = 1,
+        .ranges = res_storage,
+    };
+
+    memblock_insert(&mem, 0x10000, 0x20000);
+    memblock_insert(&mem, 0x40000, 0x48000);
+    memblock_insert(&res, 0x44000, 0x46000);
+
+    // Highest free range first, below the reserved one
+    kassert(memblock_find(&mem, &res, 0x2000, 0x1000, 0, ~0UL) == 0x46000);
+    kassert(memblock_find(&mem, &res, 0x4000, 0x1000, 0, ~0UL) == 0x40000);
+    kassert(memblock_find(&mem, &res, 0x6000, 0x8000, 0, ~0UL) == 0x18000);
+    kassert(memblock_find(&mem, &res, 0x2000, 0x1000, 0, 0x40000) == 0x1e000);
+    kassert(memblock_find(&mem, &res, 0x2000, 0x1000, 0x20000, 0x44000)
+            == 0x42000);
+    kassert(memblock_find(&mem, &res, 0x10001, 0x1000, 0, ~0UL)
+            == MEMBLOCK_ALLOC_ERROR);
+}
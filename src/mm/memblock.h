@@ -0,0 +1,39 @@
+#ifndef AVOCADOS_MEMBLOCK_H_
+#define AVOCADOS_MEMBLOCK_H_
+
+#include <stdbool.h>
+
+#include "attributes.h"
+#include "multiboot2.h"
+#include "types.h"
+
+#define MEMBLOCK_ALLOC_ERROR 0xffffffffffffffffUL
+
+// Physical address range [base, end)
+typedef struct {
+    u64 base;
+    u64 end;
+} memblock_range_t;
+
+// Ranges sorted by address, neither overlapping nor touching
+typedef struct {
+    u64 count;
+    // Number of ranges the array can hold
+    u64 capacity;
+    memblock_range_t *ranges;
+} memblock_ranges_t;
+
+void memblock_init(const struct multiboot_tag_mmap *mmap_tag);
+void memblock_add(u64 base, u64 end);
+void memblock_reserve(u64 base, u64 end);
+
+u64 memblock_alloc(u64 size, u64 align) __warn_unused_result;
+u64 memblock_alloc_range(u64 size, u64 align, u64 min_addr,
+                         u64 max_addr) __warn_unused_result;
+void memblock_map(u64 virt_addr, u64 phys_addr, u64 size);
+
+const memblock_ranges_t *memblock_memory(void);
+const memblock_ranges_t *memblock_reserved(void);
+void memblock_retire(void);
+
+#endif /* ! AVOCADOS_MEMBLOCK_H_ */
@@ -0,0 +1,218 @@
+/*
+ * NUMA topology: which node each range of physical memory and each CPU belongs
+ * to, and the distance between nodes. It is filled from the ACPI SRAT and SLIT
+ * before pmm_init so that memory regions never span two nodes.
+ *
+ * Without a SRAT, every CPU and every page frame belongs to node 0.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_PMM
+
+#include <stdbool.h>
+
+#include "arch/instr.h"
+#include "arch/percpu.h"
+#include "libk/kassert.h"
+#include "libk/log.h"
+#include "numa.h"
+
+typedef struct {
+    u64 base_addr;
+    u64 end_addr;
+    u32 node;
+} numa_memory_range_t;
+
+typedef struct {
+    u32 apic_id;
+    u32 node;
+} numa_cpu_t;
+
+static u32 num_nodes = 1;
+// Proximity domain of each node
+static u32 node_domains[NUMA_MAX_NODES];
+static bool srat_found = false;
+
+static numa_memory_range_t memory_ranges[NUMA_MAX_MEMORY_RANGES];
+static u32 num_memory_ranges = 0;
+
+static numa_cpu_t cpus[NUMA_MAX_CPUS];
+static u32 num_cpus = 0;
+
+// 0 means unknown
+static u8 distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+// For each node, every node sorted by increasing distance
+static u32 fallback_nodes[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Return the node of the proximity domain, creating it if needed.
+// Return NUMA_NO_NODE if NUMA_MAX_NODES nodes already exist.
+u32 numa_add_domain(u32 proximity_domain) {
+    u32 node = numa_domain_to_node(proximity_domain);
+    if (node != NUMA_NO_NODE) {
+        return node;
+    }
+
+    // Node 0 exists before any SRAT entry is seen, give it to the first domain
+    if (!srat_found) {
+        srat_found = true;
+        num_nodes = 0;
+    }
+
+    if (num_nodes == NUMA_MAX_NODES) {
+        log(LOG_LEVEL_WARN, "NUMA: Too many proximity domains, ignoring %u\n",
+            proximity_domain);
+        return NUMA_NO_NODE;
+    }
+
+    node_domains[num_nodes] = proximity_domain;
+    num_nodes += 1;
+    return num_nodes - 1;
+}
+
+// Return NUMA_NO_NODE if the proximity domain has no node
+u32 numa_domain_to_node(u32 proximity_domain) {
+    if (!srat_found) {
+        return NUMA_NO_NODE;
+    }
+
+    for (u32 node = 0; node < num_nodes; ++node) {
+        if (node_domains[node] == proximity_domain) {
+            return node;
+        }
+    }
+
+    return NUMA_NO_NODE;
+}
+
+void numa_add_memory_range(u32 node, u64 base_addr, u64 len) {
+    kassert(node < num_nodes);
+
+    if (num_memory_ranges == NUMA_MAX_MEMORY_RANGES) {
+        log(LOG_LEVEL_WARN,
+            "NUMA: Too many memory ranges, 0x%016lx-0x%016lx goes to node 0\n",
+            base_addr, base_addr + len);
+        return;
+    }
+
+    memory_ranges[num_memory_ranges] = (numa_memory_range_t){
+        .base_addr = base_addr,
+        .end_addr = base_addr + len,
+        .node = node,
+    };
+    num_memory_ranges += 1;
+}
+
+void numa_add_cpu(u32 apic_id, u32 node) {
+    kassert(node < num_nodes);
+
+    if (num_cpus == NUMA_MAX_CPUS) {
+        log(LOG_LEVEL_WARN, "NUMA: Too many CPUs, APIC %u goes to node 0\n",
+            apic_id);
+        return;
+    }
+
+    cpus[num_cpus] = (numa_cpu_t){ .apic_id = apic_id, .node = node };
+    num_cpus += 1;
+}
+
+void numa_set_distance(u32 from, u32 to, u8 distance) {
+    kassert(from < num_nodes && to < num_nodes);
+
+    distances[from][to] = distance;
+}
+
+// Must be called once the topology is known, before any call to
+// numa_fallback_nodes.
+void numa_build_fallback_lists(void) {
+    for (u32 node = 0; node < num_nodes; ++node) {
+        u32 *fallback = fallback_nodes[node];
+
+        // Insertion sort by distance, the node itself comes first
+        for (u32 i = 0; i < num_nodes; ++i) {
+            u32 other = (node + i) % num_nodes;
+            u8 distance = numa_distance(node, other);
+
+            u32 j = i;
+            while (j > 0 && numa_distance(node, fallback[j - 1]) > distance) {
+                fallback[j] = fallback[j - 1];
+                j -= 1;
+            }
+            fallback[j] = other;
+        }
+    }
+
+    log(LOG_LEVEL_INFO, "NUMA: %u node(s)\n", num_nodes);
+}
+
+// Set the node of the calling CPU from its initial APIC ID
+void numa_cpu_init(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    u32 apic_id = ebx >> 24;
+
+    this_cpu()->node = 0;
+    for (u32 i = 0; i < num_cpus; ++i) {
+        if (cpus[i].apic_id == apic_id) {
+            this_cpu()->node = cpus[i].node;
+            break;
+        }
+    }
+}
+
+u32 numa_num_nodes(void) {
+    return num_nodes;
+}
+
+// Physical memory not described by the SRAT belongs to node 0
+u32 numa_node_of_addr(u64 phys_addr) {
+    for (u32 i = 0; i < num_memory_ranges; ++i) {
+        if (phys_addr >= memory_ranges[i].base_addr
+            && phys_addr < memory_ranges[i].end_addr) {
+            return memory_ranges[i].node;
+        }
+    }
+
+    return 0;
+}
+
+// Return the end of the physical memory starting at phys_addr that belongs to
+// numa_node_of_addr(phys_addr)
+u64 numa_node_span_end(u64 phys_addr) {
+    u64 end_addr = UINT64_MAX;
+
+    for (u32 i = 0; i < num_memory_ranges; ++i) {
+        if (phys_addr >= memory_ranges[i].base_addr
+            && phys_addr < memory_ranges[i].end_addr) {
+            return memory_ranges[i].end_addr;
+        }
+
+        if (memory_ranges[i].base_addr > phys_addr
+            && memory_ranges[i].base_addr < end_addr) {
+            end_addr = memory_ranges[i].base_addr;
+        }
+    }
+
+    return end_addr;
+}
+
+// Without a SLIT, remote nodes are all at NUMA_REMOTE_DISTANCE
+u8 numa_distance(u32 from, u32 to) {
+    kassert(from < num_nodes && to < num_nodes);
+
+    if (distances[from][to] != 0) {
+        return distances[from][to];
+    }
+
+    return from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
+
+// Return the numa_num_nodes() nodes to allocate from, nearest first, for a
+// request made on the given node
+const u32 *numa_fallback_nodes(u32 node) {
+    kassert(node < num_nodes);
+
+    return fallback_nodes[node];
+}
+
+u32 numa_cpu_node(void) {
+    return this_cpu()->node;
+}
@@ -0,0 +1,32 @@
+#ifndef AVOCADOS_NUMA_H_
+#define AVOCADOS_NUMA_H_
+
+#include "types.h"
+
+#define NUMA_MAX_NODES 16
+#define NUMA_MAX_MEMORY_RANGES 32
+#define NUMA_MAX_CPUS 256
+
+#define NUMA_NO_NODE 0xffffffffU
+
+// Relative memory latency between nodes as reported by the ACPI SLIT, local
+// memory is 10
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+u32 numa_add_domain(u32 proximity_domain);
+u32 numa_domain_to_node(u32 proximity_domain);
+void numa_add_memory_range(u32 node, u64 base_addr, u64 len);
+void numa_add_cpu(u32 apic_id, u32 node);
+void numa_set_distance(u32 from, u32 to, u8 distance);
+void numa_build_fallback_lists(void);
+void numa_cpu_init(void);
+
+u32 numa_num_nodes(void);
+u32 numa_node_of_addr(u64 phys_addr);
+u64 numa_node_span_end(u64 phys_addr);
+u8 numa_distance(u32 from, u32 to);
+const u32 *numa_fallback_nodes(u32 node);
+u32 numa_cpu_node(void);
+
+#endif /* ! AVOCADOS_NUMA_H_ */
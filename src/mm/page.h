@@ -0,0 +1,33 @@
+#ifndef AVOCADOS_PAGE_H_
+#define AVOCADOS_PAGE_H_
+
+#include "types.h"
+
+// The page frame is never handed out: kernel image, PMM metadata...
+#define PAGE_FLAG_RESERVED (1 << 0)
+// The page frame is the first one of an allocated block, order is valid
+#define PAGE_FLAG_HEAD (1 << 1)
+// The page frame belongs to the DMA zone, see pmm_alloc_contig
+#define PAGE_FLAG_DMA (1 << 2)
+
+// Descriptor of a page frame. Every memory region has one per page frame,
+// indexed by page frame number.
+typedef struct page {
+    // Link in a list of pages (LRU, free list...), owned by the user of the
+    // page frame
+    struct page *next;
+    struct page *prev;
+    // Number of users of the page frame, 1 when freshly allocated
+    u32 refcount;
+    // PAGE_FLAG_*
+    u16 flags;
+    union {
+        // Order of the allocated block when PAGE_FLAG_HEAD is set
+        u8 order;
+        // Length of the run allocated by pmm_alloc_contig when both
+        // PAGE_FLAG_HEAD and PAGE_FLAG_DMA are set
+        u16 num_frames;
+    };
+} page_t;
+
+#endif /* ! AVOCADOS_PAGE_H_ */
@@ -0,0 +1,178 @@
+/*
+ * Page coloring: the page frames whose physical addresses select the same sets
+ * of a physically indexed cache have the same color. Frames of different
+ * colors never evict each other, so giving disjoint colors to two workloads
+ * partitions the cache between them.
+ *
+ * The color of a frame is the part of its frame number below the size of a way
+ * of the last level cache. The geometry comes from the deterministic cache
+ * parameters leaf of CPUID (Vol. 2A 3.3 CPUID, leaf 04H). Without it there is
+ * a single color and colored allocations are plain allocations.
+ *
+ * Each color has a bin of free frames. An empty bin is refilled with a batch
+ * of page_color_count() frames: the buddy allocators hand out aligned blocks
+ * first, so a batch usually holds one frame of every color and the frames of
+ * the other colors fill the other bins. Frames held in bins are free but stay
+ * allocated from the point of view of the memory regions, like frames in
+ * magazines.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_PMM
+
+#include "arch/instr.h"
+#include "arch/spinlock.h"
+#include "libk/kassert.h"
+#include "libk/log.h"
+#include "page_color.h"
+#include "page_frame_cache.h"
+#include "pmm.h"
+#include "utils.h"
+
+// Batches tried by page_color_alloc before giving up on a color
+#define PAGE_COLOR_MAX_REFILLS 4
+
+#define CPUID_CACHE_TYPE_NULL 0
+#define CPUID_CACHE_TYPE_INSTRUCTION 2
+
+static bool page_color_refill(void);
+
+static spinlock_t lock = SPINLOCK_INIT;
+// Only the first num_colors bins are used, protected by lock
+static page_frame_cache_t bins[PAGE_COLOR_MAX];
+static u32 num_colors = 1;
+// Size of the cache the colors are computed for, 0 if unknown
+static u64 cache_size = 0;
+// Frames of a refill, protected by lock
+static u64 refill_frames[PAGE_COLOR_MAX];
+
+// Compute the number of colors of the last level cache
+void page_color_init(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 4) {
+        log(LOG_LEVEL_WARN, "Page coloring: No cache parameters leaf\n");
+        return;
+    }
+
+    u64 way_size = 0;
+    u32 level = 0;
+    for (u32 subleaf = 0;; ++subleaf) {
+        cpuid(4, subleaf, &eax, &ebx, &ecx, &edx);
+
+        u32 type = (u32)BIT_RANGE(eax, 0, 4);
+        if (type == CPUID_CACHE_TYPE_NULL) {
+            break;
+        }
+        if (type == CPUID_CACHE_TYPE_INSTRUCTION
+            || BIT_RANGE(eax, 5, 7) < level) {
+            continue;
+        }
+
+        u64 ways = BIT_RANGE(ebx, 22, 31) + 1;
+        u64 partitions = BIT_RANGE(ebx, 12, 21) + 1;
+        u64 line_size = BIT_RANGE(ebx, 0, 11) + 1;
+        u64 sets = (u64)ecx + 1;
+
+        level = (u32)BIT_RANGE(eax, 5, 7);
+        way_size = partitions * line_size * sets;
+        cache_size = way_size * ways;
+    }
+
+    // Colors must be selected by frame number bits
+    num_colors = 1;
+    while (num_colors * 2 <= PAGE_COLOR_MAX
+           && num_colors * 2UL * PAGE_SIZE <= way_size) {
+        num_colors *= 2;
+    }
+
+    log(LOG_LEVEL_INFO, "Page coloring: %u colors for a L%u cache of %lu KiB\n",
+        num_colors, level, cache_size >> 10);
+}
+
+u32 page_color_count(void) {
+    return num_colors;
+}
+
+u64 page_color_cache_size(void) {
+    return cache_size;
+}
+
+u32 page_color_of(u64 frame_addr) {
+    return (u32)(frame_addr / PAGE_SIZE) & (num_colors - 1);
+}
+
+// Take a free frame of the given color.
+// Return false if no frame of that color could be found.
+bool page_color_alloc(u32 color, u64 *frame_addr) {
+    kassert(color < num_colors);
+
+    spin_lock(&lock);
+    for (u32 i = 0; i < PAGE_COLOR_MAX_REFILLS; ++i) {
+        if (!page_frame_cache_is_empty(&bins[color])) {
+            *frame_addr = page_frame_cache_pop(&bins[color]);
+            spin_unlock(&lock);
+            return true;
+        }
+
+        if (!page_color_refill()) {
+            break;
+        }
+    }
+    spin_unlock(&lock);
+
+    return false;
+}
+
+// Give the frames of every bin back to the buddy allocators.
+// Return the number of frames freed.
+u64 page_color_drain(void) {
+    u64 num_frames = 0;
+
+    spin_lock(&lock);
+    for (u32 color = 0; color < num_colors; ++color) {
+        page_frame_cache_t *bin = &bins[color];
+        pmm_free_cache_batch(bin->frame_addrs, bin->count);
+        num_frames += bin->count;
+        bin->count = 0;
+    }
+    spin_unlock(&lock);
+
+    return num_frames;
+}
+
+// Return the number of free frames held in bins
+u64 page_color_num_frames(void) {
+    u64 num_frames = 0;
+
+    spin_lock(&lock);
+    for (u32 color = 0; color < num_colors; ++color) {
+        num_frames += bins[color].count;
+    }
+    spin_unlock(&lock);
+
+    return num_frames;
+}
+
+// Put a batch of frames in the bins of their colors, the frames that do not
+// fit go back to the buddy allocators. The lock must be held.
+// Return false if no frame is left.
+static bool page_color_refill(void) {
+    u64 n = pmm_alloc_cache_batch(refill_frames, num_colors, false);
+    if (n == 0) {
+        return false;
+    }
+
+    u64 num_overflow = 0;
+    for (u64 i = 0; i < n; ++i) {
+        page_frame_cache_t *bin = &bins[page_color_of(refill_frames[i])];
+        if (page_frame_cache_is_full(bin)) {
+            refill_frames[num_overflow] = refill_frames[i];
+            num_overflow += 1;
+        } else {
+            page_frame_cache_push(bin, refill_frames[i]);
+        }
+    }
+    pmm_free_cache_batch(refill_frames, num_overflow);
+
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef AVOCADOS_PAGE_COLOR_H_
+#define AVOCADOS_PAGE_COLOR_H_
+
+#include <stdbool.h>
+
+#include "types.h"
+
+// Maximum number of colors, a power of two. Caches with larger ways are
+// partitioned into fewer colors made of several sets of frames.
+#define PAGE_COLOR_MAX 256
+
+void page_color_init(void);
+
+u32 page_color_count(void);
+u64 page_color_cache_size(void);
+u32 page_color_of(u64 frame_addr);
+
+bool page_color_alloc(u32 color, u64 *frame_addr);
+u64 page_color_drain(void);
+u64 page_color_num_frames(void);
+
+void page_color_bench(void);
+
+#endif /* ! AVOCADOS_PAGE_COLOR_H_ */
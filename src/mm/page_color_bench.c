@@ -0,0 +1,179 @@
+/*
+ * Benchmark of page coloring. Two memory intensive loops, each reading a
+ * buffer of half the cache the colors are computed for, run in turns as if
+ * they shared the cache. Frames of a long running system are scattered, so the
+ * uncolored buffers take random frames out of a larger pool: some sets get
+ * more pages than they have ways and the loops evict each other. The colored
+ * buffers take one half of the colors each and fit side by side.
+ *
+ * It is only built with KERNEL_BENCH=1 and runs at the end of kmain.
+ */
+
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_PMM
+
+#include "arch/instr.h"
+#include "arch/paging.h"
+#include "arch/percpu.h"
+#include "libk/kassert.h"
+#include "libk/log.h"
+#include "page_color.h"
+#include "pmm.h"
+#include "vmm.h"
+
+// Where the buffers are mapped, after the local APIC, IOAPIC and HPET
+#define BENCH_VIRT_ADDR 0x0000001200000000UL
+// Frames of each buffer at most
+#define BENCH_MAX_FRAMES 4096
+// Uncolored buffers take their frames out of this many times more frames
+#define BENCH_POOL_FACTOR 4
+#define BENCH_NUM_ROUNDS 32
+
+static bool bench_run(u64 num_frames, bool colored, u64 *cycles);
+static bool bench_alloc_colored(u64 num_frames);
+static bool bench_alloc_scattered(u64 num_frames);
+static u64 bench_random(u64 *state);
+
+static u64 frames[2][BENCH_MAX_FRAMES];
+static u64 pool[BENCH_MAX_FRAMES * BENCH_POOL_FACTOR];
+
+// Log the cycles per cache line read by the loops, with and without coloring
+void page_color_bench(void) {
+    if (page_color_count() == 1) {
+        log(LOG_LEVEL_INFO, "Page coloring: Benchmark skipped, no colors\n");
+        return;
+    }
+
+    u64 num_frames = page_color_cache_size() / 2 / PAGE_SIZE;
+    if (num_frames > BENCH_MAX_FRAMES) {
+        num_frames = BENCH_MAX_FRAMES;
+    }
+
+    u64 uncolored;
+    u64 colored;
+    if (!bench_run(num_frames, false, &uncolored)
+        || !bench_run(num_frames, true, &colored)) {
+        log(LOG_LEVEL_WARN,
+            "Page coloring: Benchmark skipped, not enough free frames\n");
+        return;
+    }
+
+    log(LOG_LEVEL_INFO,
+        "Page coloring: %lu cycles per line uncolored, %lu colored\n",
+        uncolored, colored);
+}
+
+// Store the average cycles to read a cache line in cycles.
+// Return false if the buffers could not be allocated.
+static bool bench_run(u64 num_frames, bool colored, u64 *cycles) {
+    bool allocated = colored ? bench_alloc_colored(num_frames)
+                             : bench_alloc_scattered(num_frames);
+    if (!allocated) {
+        return false;
+    }
+
+    for (u64 buf = 0; buf < 2; ++buf) {
+        for (u64 i = 0; i < num_frames; ++i) {
+            u64 virt_addr = BENCH_VIRT_ADDR
+                + (buf * BENCH_MAX_FRAMES + i) * PAGE_SIZE;
+            u64 res = vmm_map_physical(virt_addr, frames[buf][i], PAGE_SIZE,
+                                       VMM_ALLOC_RW);
+            kassert(res != VMM_ALLOC_ERROR);
+        }
+    }
+
+    // The first round loads the buffers and is not counted
+    u64 total_cycles = 0;
+    for (u64 round = 0; round <= BENCH_NUM_ROUNDS; ++round) {
+        for (u64 buf = 0; buf < 2; ++buf) {
+            volatile const u64 *data =
+                (const u64 *)(BENCH_VIRT_ADDR
+                              + buf * BENCH_MAX_FRAMES * PAGE_SIZE);
+
+            u64 start = rdtsc();
+            for (u64 offset = 0; offset < num_frames * PAGE_SIZE;
+                 offset += CACHE_LINE_SIZE) {
+                (void)data[offset / sizeof(u64)];
+            }
+            if (round > 0) {
+                total_cycles += rdtsc() - start;
+            }
+        }
+    }
+
+    // vmm_free gives the frames back to the PMM
+    for (u64 buf = 0; buf < 2; ++buf) {
+        for (u64 i = 0; i < num_frames; ++i) {
+            u64 virt_addr = BENCH_VIRT_ADDR
+                + (buf * BENCH_MAX_FRAMES + i) * PAGE_SIZE;
+            vmm_free(virt_addr);
+            invlpg(virt_addr);
+        }
+    }
+
+    *cycles = total_cycles
+        / (BENCH_NUM_ROUNDS * 2 * num_frames * (PAGE_SIZE / CACHE_LINE_SIZE));
+    return true;
+}
+
+// Fill each buffer with frames of one half of the colors.
+// Return false, with every frame freed, if a color has no frame left.
+static bool bench_alloc_colored(u64 num_frames) {
+    u32 half = page_color_count() / 2;
+
+    for (u64 buf = 0; buf < 2; ++buf) {
+        for (u64 i = 0; i < num_frames; ++i) {
+            frames[buf][i] = pmm_alloc_colored((u32)(buf * half + i % half));
+            if (frames[buf][i] != PMM_ALLOC_ERROR) {
+                continue;
+            }
+
+            for (u64 k = 0; k < buf * num_frames + i; ++k) {
+                pmm_free(frames[k / num_frames][k % num_frames]);
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Fill both buffers with frames picked at random out of a pool of
+// BENCH_POOL_FACTOR times more frames, the rest of the pool is freed.
+// Return false, with every frame freed, if the pool could not be allocated.
+static bool bench_alloc_scattered(u64 num_frames) {
+    u64 pool_size = num_frames * BENCH_POOL_FACTOR;
+    u64 num_allocated = pmm_alloc_batch(pool, pool_size);
+    if (num_allocated != pool_size) {
+        pmm_free_batch(pool, num_allocated);
+        return false;
+    }
+
+    // Fisher-Yates shuffle
+    u64 state = 0x5eed;
+    for (u64 i = pool_size - 1; i > 0; --i) {
+        u64 j = bench_random(&state) % (i + 1);
+        u64 frame_addr = pool[i];
+        pool[i] = pool[j];
+        pool[j] = frame_addr;
+    }
+
+    for (u64 i = 0; i < num_frames; ++i) {
+        frames[0][i] = pool[i];
+        frames[1][i] = pool[num_frames + i];
+    }
+    pmm_free_batch(pool + 2 * num_frames, pool_size - 2 * num_frames);
+
+    return true;
+}
+
+// xorshift64 (Marsaglia)
+static u64 bench_random(u64 *state) {
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
@@ -1,6 +1,10 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_PMM
+
 #include <stddef.h>
 
 #include "arch/paging.h"
+#include "arch/spinlock.h"
+#include "buddy.h"
 #include "libk/bitmap.h"
 #include "libk/kassert.h"
 #include "libk/kprintf.h"
@@ -8,207 +12,295 @@
 #include "libk/log.h"
 #include "libk/mem.h"
 #include "libk/string.h"
-#include "page_frame_cache.h"
+#include "magazine.h"
+#include "memblock.h"
+#include "numa.h"
+#include "page.h"
+#include "page_color.h"
 #include "pmm.h"
 #include "types.h"
 #include "utils.h"
+#include "zero_pool.h"
 
-extern u64 _skern;
-extern u64 _ekern;
-
-extern pml4_t pml4;
-
+// Memory regions are created by pmm_init and never change afterwards, only
+// their allocation state does. Each region has its own lock so that CPUs
+// working on different regions never contend.
 typedef struct memory_map {
     struct memory_map *next;
     // Base physical address of the memory region
     u64 base_addr;
     // Length in bytes of the memory region
     u64 len;
-    page_frame_cache_t cache;
+    // NUMA node of every page frame of the memory region
+    u32 node;
+    // Protects num_free, buddy, the bitmap and the page descriptors
+    spinlock_t lock;
+    // Number of page frames free in bitmap
+    u64 num_free;
+    // Free blocks of the memory region
+    buddy_t buddy;
+    // Descriptors of the page frames of the memory region, indexed by
+    // (page frame number - base_addr / PAGE_SIZE)
+    page_t *pages;
     // Page frame allocation state of the memory region. Each bit corresponds to
     // a page frame with 0 = free and 1 = allocated.
     bitmap_t bitmap;
 } memory_map_t;
 
+static memory_map_t *memory_map_create(u64 virt_addr, u64 base_addr,
+                                       u64 end_addr);
+static void memory_map_setup(memory_map_t *memory_map);
 static void memory_map_reserve(memory_map_t *memory_map, u64 base,
                                u64 num_frames);
 static void memory_map_reserve_range(memory_map_t *memory_map, u64 base,
                                      u64 end);
+static u64 memory_map_metadata_size(u64 base_addr, u64 len);
+static void memory_map_carve_dma_zone(memory_map_t *memory_map);
+static void memory_map_init_buddy(memory_map_t *memory_map);
+static void memory_map_add_free_frames(memory_map_t *memory_map, u64 start_idx,
+                                       u64 end_idx);
+static void memory_map_add_section(memory_map_t *memory_map);
+static memory_map_t *memory_map_find(u64 phys_addr);
+static page_t *memory_map_page(memory_map_t *memory_map, u64 phys_addr);
+static void memory_map_mark_allocated(memory_map_t *memory_map, u64 pfn,
+                                      u8 order, bool single_block);
+static u64 memory_map_alloc_pages(u8 order, u32 node);
+static u64 memory_map_alloc_batch(u64 *frames, u64 n, u32 node);
+static bool memory_map_free_run(memory_map_t *memory_map, u64 phys_addr,
+                                u64 num_frames, u32 refcount);
+static void memory_map_free_batch(const u64 *frames, u64 n, u32 refcount);
+static void memory_map_count_allocated(memory_map_t *memory_map,
+                                       u64 num_frames);
+static void memory_map_count_freed(memory_map_t *memory_map, u64 num_frames);
+static void frame_hand_out(u64 phys_addr);
+static void frame_take_back(u64 phys_addr);
+static u64 alloc_batch(u64 *frames, u64 n, bool drain_color_bins);
 
 static memory_map_t *memory_map = NULL;
 
-#define MAX_MMAP_ENTRIES 20
 // Let's map memory map at 0x0000 0000 1000 0000
 #define MEMORY_MAP_ADDR 0x0000000010000000
+// ACPI tables are mapped from there, which leaves almost 64 GiB of metadata:
+// enough for the whole PMM_MAX_PHYS_ADDR
+#define MEMORY_MAP_END_ADDR 0x0000001000000000
+
+// Memory regions are found from a physical address through sections of
+// 2^PMM_SECTION_SHIFT page frames (128 MiB)
+#define PMM_SECTION_SHIFT 15
+// Physical memory above this address is ignored
+#define PMM_MAX_PHYS_ADDR (1UL << 40)
+#define PMM_NUM_SECTIONS (PMM_MAX_PHYS_ADDR / (PAGE_SIZE << PMM_SECTION_SHIFT))
+// Marks a section shared by several memory regions
+#define PMM_SECTION_SHARED ((memory_map_t *)1)
+
+// Memory region of each section, NULL if there is none
+static memory_map_t *sections[PMM_NUM_SECTIONS];
+
+// Size of the DMA zone, carved out of the first memory region below
+// PMM_DMA_ZONE_LIMIT that is large enough
+#define PMM_DMA_ZONE_SIZE (8UL << 20)
+#define PMM_DMA_ZONE_LIMIT (4UL << 30)
+// DMA buffers are at least aligned on this
+#define PMM_DMA_ZONE_ALIGN (64UL << 10)
+
+// The length of a run of the DMA zone is recorded in a u16 of its first frame
+_Static_assert(PMM_DMA_ZONE_SIZE / PAGE_SIZE <= 0xffff);
+
+// Frames of the DMA zone are never given to the buddy allocators. They are
+// allocated as runs of any length by scanning the bitmap of their region.
+typedef struct {
+    // NULL if no region could hold the zone
+    memory_map_t *region;
+    // Frame indices of the zone in the bitmap of the region
+    u64 start_idx;
+    u64 end_idx;
+    // Number of free frames in the zone, protected by the lock of the region
+    u64 num_free;
+} dma_zone_t;
+
+static dma_zone_t dma_zone = { .region = NULL };
+
+// Sum of the sizes of every memory region, see pmm_stats
+static u64 total_frames = 0;
+// Calls to pmm_alloc_zeroed that found a frame in the zero pool or not,
+// updated atomically
+static u64 num_zeroed_hits = 0;
+static u64 num_zeroed_misses = 0;
 
 /*
- * Physical memory outside of kernel range (&_skern to &_ekern) is
- * considered free. So beware to copy boot information into kernel range
- * before calling this function. Let's put each bitmap in its region... So
- * that we can be sure it is able to store it
+ * Build a memory region for each range of available memory known to memblock,
+ * split at NUMA node boundaries. The metadata of every region is allocated and
+ * mapped with memblock first, then every range reserved in memblock, metadata
+ * included, is marked as allocated and the free frames go to the buddy
+ * allocators. memblock must not be used afterwards.
  */
-void pmm_init(const struct multiboot_tag_mmap *mmap_tag) {
+void pmm_init(void) {
     kassert(memory_map == NULL);
 
-    log(LOG_LEVEL_WARN,
-        "PMM: Physical memory outside 0x%016lx-0x%016lx will be considered "
-        "free\n",
-        (u64)&_skern, (u64)&_ekern);
+    const memblock_ranges_t *available = memblock_memory();
 
-    // Copy available memory map entries on the stack (in kernel range)
-    u32 num_available_mmap_entries = 0;
-    struct multiboot_mmap_entry available_mmap_entries[MAX_MMAP_ENTRIES] = {
-        0
-    };
-    for (u64 i = 0; sizeof(struct multiboot_tag_mmap)
-                 + i * sizeof(struct multiboot_mmap_entry)
-             < mmap_tag->size
-         && num_available_mmap_entries < MAX_MMAP_ENTRIES;
-         i++) {
-        if (mmap_tag->entries[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
-            available_mmap_entries[num_available_mmap_entries] =
-                mmap_tag->entries[i];
-            num_available_mmap_entries += 1;
-        }
-    }
-    if (num_available_mmap_entries >= MAX_MMAP_ENTRIES) {
-        kpanic("Cannot store every available memory entries on the stack");
-    }
-
-    u8 first = 1;
     // WARN: Must be a multiple of PAGE_SIZE
     u64 memory_map_virt_addr = MEMORY_MAP_ADDR;
     memory_map_t *prev_memory_map = NULL;
-    memory_map_t *curr_memory_map = NULL;
-    for (u64 i = 0; i < num_available_mmap_entries; i++) {
-        // TODO: Function
-        // Compute memory_map_t size with flexible array member
-        u64 memory_map_size = sizeof(memory_map_t)
-            + ALIGN_UP(available_mmap_entries[i].len,
-                       PAGE_SIZE * BITMAP_CHUNK_BITS)
-                / (PAGE_SIZE * 8);
-
-        // TODO: Improve first check
-        // WARN: Maybe _kern is not the first memory region
-        u64 offset = 0;
-        if (curr_memory_map == NULL) {
-            // Store the memory map after the kernel range
-            offset = ALIGN_UP((u64)&_ekern, PAGE_SIZE);
+    for (u64 i = 0; i < available->count; i++) {
+        u64 base_addr = available->ranges[i].base;
+        u64 end_addr = available->ranges[i].end;
+        if (base_addr >= PMM_MAX_PHYS_ADDR) {
+            break;
         }
-        u64 memory_map_phys_addr =
-            ALIGN_UP(available_mmap_entries[i].addr + offset, PAGE_SIZE);
-
-        // Setup paging structures for memory map
-        pml4e_t *pml4e = get_pml4e(memory_map_virt_addr);
-        if (!pml4e->present) {
-            // TODO: Map
-            kpanic("Not implemented: pml4e not present\n");
+        if (end_addr > PMM_MAX_PHYS_ADDR) {
+            log(LOG_LEVEL_WARN,
+                "PMM: Ignoring memory above 0x%016lx in region 0x%016lx\n",
+                PMM_MAX_PHYS_ADDR, base_addr);
+            end_addr = PMM_MAX_PHYS_ADDR;
         }
 
-        pdpte_t *pdpte = get_pdpte(memory_map_virt_addr);
-        if (!pdpte->present) {
-            // TODO: Map
-            kpanic("Not implemented: pdpte not present\n");
-        }
+        // A memory region never spans two NUMA nodes
+        while (base_addr < end_addr) {
+            u64 region_end_addr = numa_node_span_end(base_addr);
+            if (region_end_addr > end_addr) {
+                region_end_addr = end_addr;
+            }
 
-        u64 res = 0;
-        pde_t *pde = get_pde(memory_map_virt_addr);
-        if (!pde->present) {
-            // TODO: Remove res
-            // Store the page table after the memory map
-            u64 phys_addr =
-                ALIGN_UP(memory_map_phys_addr + memory_map_size, PAGE_SIZE)
-                + res * PAGE_SIZE;
-            *pde = (pde_t){
-                .present = 1,
-                .rw = 1,
-                .us = 0,
-                .addr = BIT_RANGE(phys_addr, 12, 51),
-                .xd = 0,
-            };
-
-            // Zero initialize the table so that present bits are 0
-            memset(
-                (u8 *)ALIGN_DOWN((u64)get_pte(memory_map_virt_addr), PAGE_SIZE),
-                0, PAGE_SIZE);
-            res += 1;
-        }
+            // Metadata of a few MiB is mapped with 2 MiB pages, which
+            // requires the same alignment on both sides
+            u64 size = memory_map_metadata_size(base_addr,
+                                                region_end_addr - base_addr);
+            if (size >= LARGE_PAGE_SIZE) {
+                memory_map_virt_addr =
+                    ALIGN_UP(memory_map_virt_addr, LARGE_PAGE_SIZE);
+            }
+            if (memory_map_virt_addr + size > MEMORY_MAP_END_ADDR) {
+                kpanic("PMM: No virtual memory left for the metadata of "
+                       "region 0x%016lx\n",
+                       base_addr);
+            }
 
-        // Assert that we only need one pde
-        kassert(memory_map_virt_addr / (PAGE_SIZE * 512)
-                == (memory_map_virt_addr + memory_map_size)
-                    / (PAGE_SIZE * 512));
-
-        for (u64 k = 0; k < ALIGN_UP(memory_map_size, PAGE_SIZE);
-             k += PAGE_SIZE) {
-            pte_t *pte = get_pte(memory_map_virt_addr + k);
-
-            kassert(!pte->present);
-            u64 phys_addr = memory_map_phys_addr + k;
-            *pte = (pte_t){
-                .present = 1,
-                .rw = 1,
-                .us = 0,
-                .addr = BIT_RANGE(phys_addr, 12, 51),
-                .xd = 1,
-            };
-        }
+            memory_map_t *curr_memory_map = memory_map_create(
+                memory_map_virt_addr, base_addr, region_end_addr);
+            base_addr = region_end_addr;
+            if (curr_memory_map == NULL) {
+                continue;
+            }
 
-        curr_memory_map = (memory_map_t *)memory_map_virt_addr;
-        curr_memory_map->next = NULL;
-        curr_memory_map->base_addr = available_mmap_entries[i].addr;
-        curr_memory_map->len =
-            ALIGN_DOWN(available_mmap_entries[i].len, PAGE_SIZE);
-        curr_memory_map->cache.count = 0;
-        curr_memory_map->bitmap.size = curr_memory_map->len / PAGE_SIZE;
-        memset((u8 *)&curr_memory_map->bitmap.chunks, 0,
-               ALIGN_UP(curr_memory_map->bitmap.size, BITS_PER_BYTE)
-                   / BITS_PER_BYTE);
-
-        kassert(curr_memory_map->len % PAGE_SIZE == 0);
-        kassert(curr_memory_map->base_addr % PAGE_SIZE == 0);
-        // Assert that curr_memory_map->base_addr + curr_memory_map->len must
-        // not overflow
-        kassert(curr_memory_map->len
-                <= UINT64_MAX - curr_memory_map->base_addr);
-
-        if (memory_map == NULL) {
-            memory_map = curr_memory_map;
-
-            memory_map_reserve_range(curr_memory_map,
-                                     ALIGN_DOWN((u64)&_skern, PAGE_SIZE),
-                                     ALIGN_UP((u64)&_ekern, PAGE_SIZE));
-        } else {
-            prev_memory_map->next = curr_memory_map;
-        }
+            if (prev_memory_map == NULL) {
+                memory_map = curr_memory_map;
+            } else {
+                prev_memory_map->next = curr_memory_map;
+            }
 
-        // Reserve memory map pages + page table pages (see res)
-        memory_map_reserve_range(
-            curr_memory_map, memory_map_phys_addr,
-            ALIGN_UP(memory_map_phys_addr + memory_map_size, PAGE_SIZE)
-                + res * PAGE_SIZE);
-
-        // Bitmap are u64 but the memory region length may not be a
-        // multiple of PAGE_SIZE * 64, so we need to mark these frames as
-        // allocated.
-        for (u64 frame_idx = curr_memory_map->bitmap.size; frame_idx
-             < ALIGN_UP(curr_memory_map->bitmap.size, BITMAP_CHUNK_BITS);
-             ++frame_idx) {
-            curr_memory_map->bitmap.chunks[frame_idx / BITMAP_CHUNK_BITS] |= 1UL
-                << (frame_idx % BITMAP_CHUNK_BITS);
+            prev_memory_map = curr_memory_map;
+            memory_map_virt_addr += ALIGN_UP(size, PAGE_SIZE);
         }
+    }
+
+    // Every metadata page and page table is allocated, the PMM takes over
+    memblock_retire();
+    list_for_each(m, memory_map) {
+        memory_map_setup(m);
+    }
+
+    magazine_init();
+    zero_pool_init();
+    page_color_init();
+
+    log(LOG_LEVEL_INFO, "PMM: PMM initialized\n");
+}
+
+// Create the memory region of the page frames in [base_addr, end_addr), with
+// its metadata mapped at virt_addr. The metadata is allocated in the region
+// when possible so that it is local to the NUMA node of the region. Every
+// frame is free until memory_map_setup is called.
+// Return NULL if no memory is left for the metadata.
+static memory_map_t *memory_map_create(u64 virt_addr, u64 base_addr,
+                                       u64 end_addr) {
+    u64 memory_map_size =
+        memory_map_metadata_size(base_addr, end_addr - base_addr);
+    u64 align = PAGE_SIZE;
+    if (virt_addr % LARGE_PAGE_SIZE == 0
+        && memory_map_size >= LARGE_PAGE_SIZE) {
+        align = LARGE_PAGE_SIZE;
+    }
+
+    u64 memory_map_phys_addr =
+        memblock_alloc_range(memory_map_size, align, base_addr, end_addr);
+    if (memory_map_phys_addr == MEMBLOCK_ALLOC_ERROR) {
+        memory_map_phys_addr = memblock_alloc(memory_map_size, align);
+    }
+    if (memory_map_phys_addr == MEMBLOCK_ALLOC_ERROR) {
+        memory_map_phys_addr = memblock_alloc(memory_map_size, PAGE_SIZE);
+    }
+    if (memory_map_phys_addr == MEMBLOCK_ALLOC_ERROR) {
+        log(LOG_LEVEL_WARN,
+            "PMM: No memory left for the metadata of region "
+            "0x%016lx-0x%016lx\n",
+            base_addr, end_addr);
+        return NULL;
+    }
+
+    memblock_map(virt_addr, memory_map_phys_addr, memory_map_size);
 
-        // TODO: Remove that
-        if (first) {
-            kprintf("0x%016lx\n", curr_memory_map->bitmap.chunks[0]);
+    memory_map_t *m = (memory_map_t *)virt_addr;
+    m->next = NULL;
+    m->base_addr = base_addr;
+    m->len = end_addr - base_addr;
+    m->node = numa_node_of_addr(base_addr);
+    m->lock = SPINLOCK_INIT;
+    m->bitmap.size = m->len / PAGE_SIZE;
+    memset((u8 *)&m->bitmap.chunks, 0,
+           ALIGN_UP(m->bitmap.size, BITMAP_CHUNK_BITS) / BITS_PER_BYTE);
+    m->num_free = m->bitmap.size;
+    total_frames += m->bitmap.size;
+    m->pages = (page_t *)(virt_addr + memory_map_size
+                          - m->bitmap.size * sizeof(page_t));
+    memset((u8 *)m->pages, 0, m->bitmap.size * sizeof(page_t));
+
+    kassert(m->len % PAGE_SIZE == 0);
+    kassert(m->base_addr % PAGE_SIZE == 0);
+
+    return m;
+}
+
+// Mark the frames reserved in memblock as allocated, then hand the free frames
+// of the memory region to its buddy allocator
+static void memory_map_setup(memory_map_t *m) {
+    u64 end_addr = m->base_addr + m->len;
+
+    // Reserved ranges are sorted, so only the ones overlapping the region are
+    // looked at closely
+    const memblock_ranges_t *reserved = memblock_reserved();
+    for (u64 i = 0; i < reserved->count; ++i) {
+        u64 base = reserved->ranges[i].base;
+        u64 end = reserved->ranges[i].end;
+        if (end <= m->base_addr) {
+            continue;
+        }
+        if (base >= end_addr) {
+            break;
         }
 
-        prev_memory_map = curr_memory_map;
-        memory_map_virt_addr += ALIGN_UP(memory_map_size, PAGE_SIZE);
-        first = 0;
+        memory_map_reserve_range(m, base > m->base_addr ? base : m->base_addr,
+                                 end < end_addr ? end : end_addr);
     }
 
-    log(LOG_LEVEL_INFO, "PMM: PMM initialized\n");
+    // Bitmap are u64 but the memory region length may not be a multiple of
+    // PAGE_SIZE * 64, so we need to mark these frames as allocated.
+    for (u64 frame_idx = m->bitmap.size;
+         frame_idx < ALIGN_UP(m->bitmap.size, BITMAP_CHUNK_BITS); ++frame_idx) {
+        m->bitmap.chunks[frame_idx / BITMAP_CHUNK_BITS] |= 1UL
+            << (frame_idx % BITMAP_CHUNK_BITS);
+    }
+
+    if (dma_zone.region == NULL) {
+        memory_map_carve_dma_zone(m);
+    }
+
+    // Every reservation is done, give the free frames to the buddy allocator
+    memory_map_init_buddy(m);
+    memory_map_add_section(m);
+
+    log(LOG_LEVEL_DEBUG, "PMM: Region 0x%016lx-0x%016lx in NUMA node %u\n",
+        m->base_addr, end_addr, m->node);
 }
 
 // It is assumed that the range is unallocated
@@ -218,9 +310,14 @@ static void memory_map_reserve(memory_map_t *m, u64 base, u64 num_frames) {
     kassert(base % PAGE_SIZE == 0);
     // Check range
     kassert(base >= m->base_addr
-            && base + num_frames * PAGE_SIZE < m->base_addr + m->len);
+            && base + num_frames * PAGE_SIZE <= m->base_addr + m->len);
 
-    bitmap_set_range(&m->bitmap, (base - m->base_addr) / PAGE_SIZE, num_frames);
+    u64 frame_idx = (base - m->base_addr) / PAGE_SIZE;
+    bitmap_set_range(&m->bitmap, frame_idx, frame_idx + num_frames);
+    memory_map_count_allocated(m, num_frames);
+    for (u64 i = 0; i < num_frames; ++i) {
+        m->pages[frame_idx + i].flags |= PAGE_FLAG_RESERVED;
+    }
 }
 
 // end excluded
@@ -233,60 +330,892 @@ static void memory_map_reserve_range(memory_map_t *m, u64 base, u64 end) {
     return memory_map_reserve(m, base, (end - base) / PAGE_SIZE);
 }
 
-// Return the physical address of the allocated frame.
-// If unable to find a free frame, returns PMM_ALLOC_ERROR.
-u64 pmm_alloc(void) {
-    u64 phys_addr = PMM_ALLOC_ERROR;
+// Compute the size of the memory_map_t (with its flexible array member), of
+// the buddy allocator metadata that follows it and of the page descriptors
+// stored at the end
+static u64 memory_map_metadata_size(u64 base_addr, u64 len) {
+    u64 base_pfn = base_addr / PAGE_SIZE;
+    u64 end_pfn = base_pfn + len / PAGE_SIZE;
 
-    list_for_each(m, memory_map) {
-        if (!page_frame_cache_is_empty(&m->cache)) {
-            phys_addr = page_frame_cache_pop(&m->cache);
+    u64 size = sizeof(memory_map_t)
+        + ALIGN_UP(len, PAGE_SIZE * BITMAP_CHUNK_BITS) / (PAGE_SIZE * 8)
+        + buddy_metadata_size(base_pfn, end_pfn);
+
+    return ALIGN_UP(size, _Alignof(page_t))
+        + (end_pfn - base_pfn) * sizeof(page_t);
+}
+
+// Make the memory region hold the DMA zone if it has PMM_DMA_ZONE_SIZE free
+// frames below PMM_DMA_ZONE_LIMIT, aligned on PMM_DMA_ZONE_ALIGN
+static void memory_map_carve_dma_zone(memory_map_t *m) {
+    u64 base_pfn = m->base_addr / PAGE_SIZE;
+    u64 align_frames = PMM_DMA_ZONE_ALIGN / PAGE_SIZE;
+    u64 num_frames = PMM_DMA_ZONE_SIZE / PAGE_SIZE;
+
+    u64 end_idx = m->bitmap.size;
+    if (m->base_addr + m->len > PMM_DMA_ZONE_LIMIT) {
+        if (m->base_addr >= PMM_DMA_ZONE_LIMIT) {
+            return;
+        }
+        end_idx = (PMM_DMA_ZONE_LIMIT - m->base_addr) / PAGE_SIZE;
+    }
+
+    // Alignment is on physical addresses, not on frame indices
+    u64 start_idx = bitmap_find_zero_run(&m->bitmap, 0, end_idx, num_frames,
+                                         align_frames, base_pfn);
+    if (start_idx == end_idx) {
+        return;
+    }
+
+    for (u64 i = start_idx; i < start_idx + num_frames; ++i) {
+        m->pages[i].flags |= PAGE_FLAG_DMA;
+    }
+
+    dma_zone = (dma_zone_t){
+        .region = m,
+        .start_idx = start_idx,
+        .end_idx = start_idx + num_frames,
+        .num_free = num_frames,
+    };
+
+    log(LOG_LEVEL_INFO, "PMM: DMA zone 0x%016lx-0x%016lx\n",
+        m->base_addr + start_idx * PAGE_SIZE,
+        m->base_addr + (start_idx + num_frames) * PAGE_SIZE);
+}
+
+// Initialize the buddy allocator of the memory region with the frames that are
+// free in its bitmap, except the frames of the DMA zone. The buddy metadata is
+// stored right after the bitmap.
+static void memory_map_init_buddy(memory_map_t *m) {
+    u64 base_pfn = m->base_addr / PAGE_SIZE;
+    void *buddy_metadata =
+        (u8 *)m->bitmap.chunks
+        + ALIGN_UP(m->bitmap.size, BITMAP_CHUNK_BITS) / BITS_PER_BYTE;
+
+    buddy_init(&m->buddy, base_pfn, base_pfn + m->bitmap.size, buddy_metadata);
+
+    if (m == dma_zone.region) {
+        memory_map_add_free_frames(m, 0, dma_zone.start_idx);
+        memory_map_add_free_frames(m, dma_zone.end_idx, m->bitmap.size);
+    } else {
+        memory_map_add_free_frames(m, 0, m->bitmap.size);
+    }
+}
+
+// Give every run of free frames in [start_idx, end_idx) to the buddy
+// allocator. The bitmap is searched a chunk at a time, so that large regions
+// are set up quickly.
+static void memory_map_add_free_frames(memory_map_t *m, u64 start_idx,
+                                       u64 end_idx) {
+    u64 base_pfn = m->base_addr / PAGE_SIZE;
 
-            bitmap_set(&m->bitmap, (phys_addr - m->base_addr) / PAGE_SIZE);
+    u64 frame_idx = start_idx;
+    while (frame_idx < end_idx) {
+        u64 run_start = bitmap_find_next_zero(&m->bitmap, frame_idx, end_idx);
+        if (run_start == end_idx) {
             break;
         }
+        u64 run_end = bitmap_find_next_set(&m->bitmap, run_start, end_idx);
 
-        // Find first unallocated page frame
-        for (u64 i = 0; i
-             < ALIGN_UP(m->bitmap.size, BITMAP_CHUNK_BITS) / BITMAP_CHUNK_BITS;
-             ++i) {
-            if (m->bitmap.chunks[i] != 0xffffffffffffffff) {
-                for (u64 j = 0; j < BITMAP_CHUNK_BITS; j++) {
-                    if (((m->bitmap.chunks[i] >> j) & 1) == 0) {
-                        m->bitmap.chunks[i] |= (1UL << j);
+        buddy_add_free_range(&m->buddy, base_pfn + run_start,
+                             base_pfn + run_end);
+        frame_idx = run_end;
+    }
+}
+
+// Record the memory region in the sections it overlaps
+static void memory_map_add_section(memory_map_t *m) {
+    u64 first_section = m->base_addr / (PAGE_SIZE << PMM_SECTION_SHIFT);
+    u64 last_section =
+        (m->base_addr + m->len - 1) / (PAGE_SIZE << PMM_SECTION_SHIFT);
+
+    for (u64 section = first_section; section <= last_section; ++section) {
+        sections[section] =
+            sections[section] == NULL ? m : PMM_SECTION_SHARED;
+    }
+}
+
+// Return the memory region containing the given physical address or NULL.
+static memory_map_t *memory_map_find(u64 phys_addr) {
+    u64 section = phys_addr / (PAGE_SIZE << PMM_SECTION_SHIFT);
+    if (section >= PMM_NUM_SECTIONS) {
+        return NULL;
+    }
+
+    memory_map_t *m = sections[section];
+    if (m != PMM_SECTION_SHARED) {
+        if (m != NULL && phys_addr >= m->base_addr
+            && phys_addr < m->base_addr + m->len) {
+            return m;
+        }
+        return NULL;
+    }
+
+    // Only sections at the boundary of memory regions need a walk
+    list_for_each(region, memory_map) {
+        if (phys_addr >= region->base_addr
+            && phys_addr < region->base_addr + region->len) {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+// Return the descriptor of the page frame at phys_addr in the memory region
+static page_t *memory_map_page(memory_map_t *m, u64 phys_addr) {
+    return &m->pages[(phys_addr - m->base_addr) / PAGE_SIZE];
+}
+
+// Mark the 2^order frames at pfn as allocated, as a single block if
+// single_block is true or as 2^order blocks of order 0 otherwise.
+static void memory_map_mark_allocated(memory_map_t *m, u64 pfn, u8 order,
+                                      bool single_block) {
+    u64 frame_idx = pfn - m->base_addr / PAGE_SIZE;
+    bitmap_set_range(&m->bitmap, frame_idx, frame_idx + (1UL << order));
+    memory_map_count_allocated(m, 1UL << order);
+
+    u64 num_heads = single_block ? 1 : 1UL << order;
+    for (u64 i = 0; i < num_heads; ++i) {
+        page_t *page = &m->pages[frame_idx + i];
+        page->flags |= PAGE_FLAG_HEAD;
+        page->order = single_block ? order : 0;
+        page->refcount = 1;
+    }
+}
+
+// Allocate a block from the first memory region that has one large enough,
+// looking at the nodes nearest to the given one first.
+static u64 memory_map_alloc_pages(u8 order, u32 node) {
+    const u32 *nodes = numa_fallback_nodes(node);
+
+    for (u32 i = 0; i < numa_num_nodes(); ++i) {
+        list_for_each(m, memory_map) {
+            if (m->node != nodes[i]) {
+                continue;
+            }
+
+            spin_lock(&m->lock);
+            u64 pfn = buddy_alloc(&m->buddy, order);
+            if (pfn != BUDDY_ALLOC_ERROR) {
+                memory_map_mark_allocated(m, pfn, order, true);
+            }
+            spin_unlock(&m->lock);
+
+            if (pfn != BUDDY_ALLOC_ERROR) {
+                return pfn * PAGE_SIZE;
+            }
+        }
+    }
+
+    return PMM_ALLOC_ERROR;
+}
+
+// Allocate up to n frames, taking the biggest buddy blocks that fit in what is
+// left to allocate so that each block costs a single bitmap update. The nodes
+// nearest to the given one are used first.
+// Return the number of frames stored in frames.
+static u64 memory_map_alloc_batch(u64 *frames, u64 n, u32 node) {
+    const u32 *nodes = numa_fallback_nodes(node);
+    u64 num_allocated = 0;
+
+    for (u32 k = 0; k < numa_num_nodes() && num_allocated < n; ++k) {
+        list_for_each(m, memory_map) {
+            if (m->node != nodes[k]) {
+                continue;
+            }
 
-                        phys_addr = m->base_addr
-                            + (i * BITMAP_CHUNK_BITS + j) * PAGE_SIZE;
+            spin_lock(&m->lock);
+            u8 order = PMM_MAX_ORDER;
+            while (num_allocated < n) {
+                while (order > 0 && (1UL << order) > n - num_allocated) {
+                    order -= 1;
+                }
 
+                u64 pfn = buddy_alloc(&m->buddy, order);
+                if (pfn == BUDDY_ALLOC_ERROR) {
+                    // No block of this order or more is left in this region
+                    if (order == 0) {
                         break;
                     }
+                    order -= 1;
+                    continue;
+                }
+
+                memory_map_mark_allocated(m, pfn, order, false);
+                for (u64 i = 0; i < 1UL << order; ++i) {
+                    frames[num_allocated] = (pfn + i) * PAGE_SIZE;
+                    num_allocated += 1;
                 }
             }
+            spin_unlock(&m->lock);
+
+            if (num_allocated == n) {
+                break;
+            }
         }
     }
 
-    return phys_addr;
+    return num_allocated;
 }
 
-// Free the frame at the given physical address.
+// Give num_frames contiguous frames of the memory region back to its buddy
+// allocator. Each of them must be an allocated block of order 0 whose refcount
+// is the given one: 1 for frames owned by a caller, 0 for frames held by the
+// caches of the PMM. The refcounts are exchanged atomically, as pmm_free does
+// without the lock of the region.
+// Return false, with every frame left as is, if one of them is not valid.
+static bool memory_map_free_run(memory_map_t *m, u64 phys_addr, u64 num_frames,
+                                u32 refcount) {
+    u64 frame_idx = (phys_addr - m->base_addr) / PAGE_SIZE;
+
+    spin_lock(&m->lock);
+    for (u64 i = 0; i < num_frames; ++i) {
+        page_t *page = &m->pages[frame_idx + i];
+        u32 expected = refcount;
+        if (!(page->flags & PAGE_FLAG_HEAD) || page->order != 0
+            || (page->flags & PAGE_FLAG_DMA)
+            || !__atomic_compare_exchange_n(&page->refcount, &expected, 0,
+                                            false, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+            // Give the frames checked so far back to their owner
+            for (u64 k = 0; k < i; ++k) {
+                __atomic_store_n(&m->pages[frame_idx + k].refcount, refcount,
+                                 __ATOMIC_RELAXED);
+            }
+            spin_unlock(&m->lock);
+            return false;
+        }
+    }
+
+    for (u64 i = 0; i < num_frames; ++i) {
+        m->pages[frame_idx + i].flags &= (u16)~PAGE_FLAG_HEAD;
+    }
+
+    bitmap_clear_range(&m->bitmap, frame_idx, frame_idx + num_frames);
+    memory_map_count_freed(m, num_frames);
+    buddy_add_free_range(&m->buddy, phys_addr / PAGE_SIZE,
+                         phys_addr / PAGE_SIZE + num_frames);
+    spin_unlock(&m->lock);
+
+    return true;
+}
+
+// Free n page frames whose refcount is the given one, see
+// memory_map_free_run. Runs of contiguous frames are released with a single
+// bitmap update.
 // Panic if invalid address is passed.
-void pmm_free(u64 phys_addr) {
+static void memory_map_free_batch(const u64 *frames, u64 n, u32 refcount) {
+    u64 i = 0;
+    while (i < n) {
+        u64 phys_addr = frames[i];
+        kassert(phys_addr % PAGE_SIZE == 0);
+
+        memory_map_t *m = memory_map_find(phys_addr);
+        if (m == NULL) {
+            kpanic("pmm: Cannot free frame at 0x%016lx which is outside of "
+                   "mapped memory regions\n",
+                   phys_addr);
+        }
+
+        u64 num_frames = 1;
+        while (i + num_frames < n
+               && frames[i + num_frames] == phys_addr + num_frames * PAGE_SIZE
+               && frames[i + num_frames] < m->base_addr + m->len) {
+            num_frames += 1;
+        }
+
+        if (!memory_map_free_run(m, phys_addr, num_frames, refcount)) {
+            kpanic("pmm: Invalid free in the run of %lu frames at 0x%016lx\n",
+                   num_frames, phys_addr);
+        }
+        i += num_frames;
+    }
+}
+
+// Allocate 2^order physically contiguous page frames aligned on their size,
+// preferably from the NUMA node of the current CPU.
+// Return the physical address of the first frame.
+// If unable to find a free block, returns PMM_ALLOC_ERROR.
+u64 pmm_alloc_pages(u8 order) {
+    return pmm_alloc_pages_node(order, numa_cpu_node());
+}
+
+// Same as pmm_alloc_pages but prefer the given NUMA node, then the other nodes
+// by increasing distance.
+u64 pmm_alloc_pages_node(u8 order, u32 node) {
+    kassert(order <= PMM_MAX_ORDER);
+
+    u64 phys_addr = memory_map_alloc_pages(order, node);
+    // Frames parked in the depot, in color bins or on the dirty list of the
+    // zero pool may be enough to form a block
+    if (phys_addr == PMM_ALLOC_ERROR
+        && magazine_drain_depot() + page_color_drain() + zero_pool_drain_dirty()
+               > 0) {
+        phys_addr = memory_map_alloc_pages(order, node);
+    }
+
+    return phys_addr;
+}
+
+// Free 2^order page frames allocated by pmm_alloc_pages with the same order.
+// Panic if invalid address is passed or if the frames are already free, held
+// by a cache of the PMM included.
+void pmm_free_pages(u64 phys_addr, u8 order) {
+    kassert(order <= PMM_MAX_ORDER);
+    kassert(phys_addr % ((u64)PAGE_SIZE << order) == 0);
+
+    memory_map_t *m = memory_map_find(phys_addr);
+    if (m == NULL) {
+        kpanic("pmm: Cannot free frames at 0x%016lx which is outside of "
+               "mapped memory regions\n",
+               phys_addr);
+    }
+
+    spin_lock(&m->lock);
+    page_t *page = memory_map_page(m, phys_addr);
+    // The refcount is exchanged atomically, as pmm_free does without the lock
+    u32 refcount = 1;
+    if (!(page->flags & PAGE_FLAG_HEAD) || page->order != order
+        || (page->flags & PAGE_FLAG_DMA)
+        || !__atomic_compare_exchange_n(&page->refcount, &refcount, 0, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        kpanic("pmm: Invalid free of frames at 0x%016lx\n", phys_addr);
+    }
+    page->flags &= (u16)~PAGE_FLAG_HEAD;
+
+    u64 frame_idx = (phys_addr - m->base_addr) / PAGE_SIZE;
+    bitmap_clear_range(&m->bitmap, frame_idx, frame_idx + (1UL << order));
+    memory_map_count_freed(m, 1UL << order);
+    buddy_free(&m->buddy, phys_addr / PAGE_SIZE, order);
+    spin_unlock(&m->lock);
+}
+
+// Allocate n page frames which are not necessarily contiguous and store their
+// physical addresses in frames. Frames of the NUMA node of the current CPU are
+// preferred.
+// Return the number of frames allocated, which is less than n only if physical
+// memory is exhausted.
+u64 pmm_alloc_batch(u64 *frames, u64 n) {
+    return alloc_batch(frames, n, true);
+}
+
+// Same as pmm_alloc_batch, for the frame caches of the PMM: magazines, color
+// bins and zero pool. The frames are free until pmm_alloc hands them out, so
+// pmm_free panics on them in the meantime. They go back to the buddy
+// allocators through pmm_free_cache_batch.
+// The color bins refill themselves with their lock held, they pass false for
+// drain_color_bins.
+u64 pmm_alloc_cache_batch(u64 *frames, u64 n, bool drain_color_bins) {
+    u64 num_allocated = alloc_batch(frames, n, drain_color_bins);
+
+    for (u64 i = 0; i < num_allocated; ++i) {
+        page_t *page = pmm_phys_to_page(frames[i]);
+        __atomic_store_n(&page->refcount, 0, __ATOMIC_RELAXED);
+    }
+
+    return num_allocated;
+}
+
+// Free n page frames allocated by pmm_alloc_batch or pmm_alloc. Runs of
+// contiguous frames are released with a single bitmap update.
+// Panic if invalid address is passed or if a frame is already free, held by a
+// cache of the PMM included.
+void pmm_free_batch(const u64 *frames, u64 n) {
+    memory_map_free_batch(frames, n, 1);
+}
+
+// Give n page frames of the caches of the PMM, allocated by
+// pmm_alloc_cache_batch, back to the buddy allocators.
+// Panic if invalid address is passed or if a frame is not held by a cache.
+void pmm_free_cache_batch(const u64 *frames, u64 n) {
+    memory_map_free_batch(frames, n, 0);
+}
+
+// Allocate num_frames physically contiguous page frames from the DMA zone. The
+// first frame is aligned on align bytes, a power of two, and the last byte is
+// at most max_phys_addr.
+// Return the physical address of the first frame.
+// If unable to find such a run of frames, returns PMM_ALLOC_ERROR.
+u64 pmm_alloc_contig(u64 num_frames, u64 align, u64 max_phys_addr) {
+    kassert(num_frames > 0);
+    kassert(align != 0 && (align & (align - 1)) == 0);
+
+    memory_map_t *m = dma_zone.region;
+    if (m == NULL) {
+        return PMM_ALLOC_ERROR;
+    }
+
+    // Alignment is on physical addresses, not on frame indices
+    u64 align_frames = align < PAGE_SIZE ? 1 : align / PAGE_SIZE;
+    u64 base_pfn = m->base_addr / PAGE_SIZE;
+
+    // Only frames whose last byte is at most max_phys_addr can be used. The
+    // limit is compared before adding 1 to it, max_phys_addr is often ~0UL.
+    u64 end_idx = dma_zone.end_idx;
+    if (max_phys_addr < m->base_addr) {
+        return PMM_ALLOC_ERROR;
+    }
+    if (max_phys_addr - m->base_addr < end_idx * PAGE_SIZE - 1) {
+        end_idx = (max_phys_addr - m->base_addr + 1) / PAGE_SIZE;
+    }
+
+    spin_lock(&m->lock);
+    u64 idx = bitmap_find_zero_run(&m->bitmap, dma_zone.start_idx, end_idx,
+                                   num_frames, align_frames, base_pfn);
+    if (idx == end_idx) {
+        spin_unlock(&m->lock);
+        return PMM_ALLOC_ERROR;
+    }
+
+    bitmap_set_range(&m->bitmap, idx, idx + num_frames);
+    memory_map_count_allocated(m, num_frames);
+    dma_zone.num_free -= num_frames;
+
+    page_t *page = &m->pages[idx];
+    page->flags |= PAGE_FLAG_HEAD;
+    page->num_frames = (u16)num_frames;
+    page->refcount = 1;
+    spin_unlock(&m->lock);
+
+    return m->base_addr + idx * PAGE_SIZE;
+}
+
+// Free num_frames page frames allocated by pmm_alloc_contig with the same
+// number of frames.
+// Panic if invalid address is passed or if num_frames is not the length of
+// the run, which is recorded in the descriptor of its first frame.
+void pmm_free_contig(u64 phys_addr, u64 num_frames) {
     kassert(phys_addr % PAGE_SIZE == 0);
 
+    memory_map_t *m = dma_zone.region;
+    if (m == NULL || phys_addr < m->base_addr) {
+        kpanic("pmm: Frames at 0x%016lx are not in the DMA zone\n", phys_addr);
+    }
+
+    u64 idx = (phys_addr - m->base_addr) / PAGE_SIZE;
+    spin_lock(&m->lock);
+    if (idx < dma_zone.start_idx || idx >= dma_zone.end_idx
+        || !(m->pages[idx].flags & PAGE_FLAG_HEAD)) {
+        kpanic("pmm: Invalid free of DMA frames at 0x%016lx\n", phys_addr);
+    }
+    if (m->pages[idx].num_frames != num_frames) {
+        kpanic("pmm: Free of %lu DMA frames at 0x%016lx allocated as %u\n",
+               num_frames, phys_addr, m->pages[idx].num_frames);
+    }
+
+    kassert(bitmap_find_next_zero(&m->bitmap, idx, idx + num_frames)
+            == idx + num_frames);
+
+    m->pages[idx].flags &= (u16)~PAGE_FLAG_HEAD;
+    m->pages[idx].refcount = 0;
+    bitmap_clear_range(&m->bitmap, idx, idx + num_frames);
+    memory_map_count_freed(m, num_frames);
+    dma_zone.num_free += num_frames;
+    spin_unlock(&m->lock);
+}
+
+// Give the reserved frames fully contained in [base, end) to the buddy
+// allocators, once their content is not needed anymore (boot code, ACPI
+// tables...). Frames that are not reserved are left alone.
+// Return the number of frames freed.
+u64 pmm_free_reserved(u64 base, u64 end) {
+    base = ALIGN_UP(base, PAGE_SIZE);
+    end = ALIGN_DOWN(end, PAGE_SIZE);
+
+    u64 num_freed = 0;
     list_for_each(m, memory_map) {
-        if (phys_addr >= m->base_addr && phys_addr < m->base_addr + m->len) {
-            if (!page_frame_cache_is_full(&m->cache)) {
-                page_frame_cache_push(&m->cache,
-                                      ALIGN_DOWN(phys_addr, PAGE_SIZE));
+        u64 start_idx = 0;
+        u64 end_idx = m->bitmap.size;
+        if (base >= m->base_addr + m->len || end <= m->base_addr) {
+            continue;
+        }
+        if (base > m->base_addr) {
+            start_idx = (base - m->base_addr) / PAGE_SIZE;
+        }
+        if (end < m->base_addr + m->len) {
+            end_idx = (end - m->base_addr) / PAGE_SIZE;
+        }
+
+        spin_lock(&m->lock);
+        u64 frame_idx = start_idx;
+        while (frame_idx < end_idx) {
+            if (!(m->pages[frame_idx].flags & PAGE_FLAG_RESERVED)) {
+                frame_idx += 1;
+                continue;
             }
 
-            bitmap_clear(&m->bitmap, (phys_addr - m->base_addr) / PAGE_SIZE);
-            return;
+            // Release the whole run of reserved frames at once
+            u64 run_start = frame_idx;
+            while (frame_idx < end_idx
+                   && (m->pages[frame_idx].flags & PAGE_FLAG_RESERVED)) {
+                m->pages[frame_idx].flags &= (u16)~PAGE_FLAG_RESERVED;
+                frame_idx += 1;
+            }
+
+            u64 num_frames = frame_idx - run_start;
+            u64 base_pfn = m->base_addr / PAGE_SIZE;
+            bitmap_clear_range(&m->bitmap, run_start, frame_idx);
+            memory_map_count_freed(m, num_frames);
+            buddy_add_free_range(&m->buddy, base_pfn + run_start,
+                                 base_pfn + frame_idx);
+            num_freed += num_frames;
+        }
+        spin_unlock(&m->lock);
+    }
+
+    return num_freed;
+}
+
+// Keep the free frame counter in sync with the bitmap of the memory region.
+// The lock of the region must be held.
+static void memory_map_count_allocated(memory_map_t *m, u64 num_frames) {
+    kassert(m->num_free >= num_frames);
+
+    m->num_free -= num_frames;
+}
+
+static void memory_map_count_freed(memory_map_t *m, u64 num_frames) {
+    m->num_free += num_frames;
+
+    kassert(m->num_free <= m->bitmap.size);
+}
+
+// Return hits / (hits + misses) in per mille, 0 if there is no access
+static u32 hit_rate(u64 hits, u64 misses) {
+    if (hits + misses == 0) {
+        return 0;
+    }
+
+    return (u32)(hits * 1000 / (hits + misses));
+}
+
+// Fill stats with the current state of the PMM. Only the free blocks are
+// walked, per order and per region, every other value is a counter. Regions
+// are locked one at a time so the snapshot is consistent per region only.
+void pmm_stats(pmm_stats_t *stats) {
+    *stats = (pmm_stats_t){ 0 };
+
+    stats->total_frames = total_frames;
+    stats->zeroed_frames = zero_pool_count();
+
+    magazine_stats_t magazine;
+    magazine_stats(&magazine);
+    stats->cached_frames = magazine.num_frames + page_color_num_frames()
+        + zero_pool_num_dirty();
+    stats->alloc_hit_rate =
+        hit_rate(magazine.alloc_hits, magazine.alloc_misses);
+    stats->free_hit_rate = hit_rate(magazine.free_hits, magazine.free_misses);
+    stats->zeroed_hit_rate =
+        hit_rate(__atomic_load_n(&num_zeroed_hits, __ATOMIC_RELAXED),
+                 __atomic_load_n(&num_zeroed_misses, __ATOMIC_RELAXED));
+
+    u64 buddy_free_frames = 0;
+    list_for_each(m, memory_map) {
+        spin_lock(&m->lock);
+        stats->free_frames += m->num_free;
+        if (m == dma_zone.region) {
+            stats->dma_free_frames = dma_zone.num_free;
+        }
+        for (u8 order = 0; order <= PMM_MAX_ORDER; ++order) {
+            stats->free_blocks[order] += m->buddy.num_free[order];
+            buddy_free_frames += m->buddy.num_free[order] << order;
+        }
+        spin_unlock(&m->lock);
+    }
+
+    // Unusable free space index (Gorman, Whitcroft): free frames in blocks
+    // smaller than the order cannot serve an allocation of that order
+    u64 unusable_frames = 0;
+    for (u8 order = 0; order <= PMM_MAX_ORDER; ++order) {
+        if (buddy_free_frames > 0) {
+            stats->fragmentation[order] =
+                (u32)(unusable_frames * 1000 / buddy_free_frames);
+        }
+        unusable_frames += stats->free_blocks[order] << order;
+    }
+}
+
+void pmm_print_stats(void) {
+    pmm_stats_t stats;
+    pmm_stats(&stats);
+
+    puts("PMM statistics:\n");
+    kprintf("  Frames: %lu total, %lu free, %lu cached, %lu zeroed\n",
+            stats.total_frames, stats.free_frames, stats.cached_frames,
+            stats.zeroed_frames);
+    kprintf("  DMA zone: %lu free frames\n", stats.dma_free_frames);
+    kprintf("  Magazine hit rate: %u/1000 alloc, %u/1000 free\n",
+            stats.alloc_hit_rate, stats.free_hit_rate);
+    kprintf("  Zero pool hit rate: %u/1000\n", stats.zeroed_hit_rate);
+    for (u8 order = 0; order <= PMM_MAX_ORDER; ++order) {
+        kprintf("  Order %2u: %6lu free blocks, fragmentation %4u/1000\n",
+                order, stats.free_blocks[order], stats.fragmentation[order]);
+    }
+}
+
+// Check that the allocation state of every memory region is consistent and
+// panic otherwise: the free frame counters match the bitmap, and every frame
+// of a free buddy block is free in the bitmap and outside of the DMA zone.
+// Every frame of a region is visited, so it is only meant for tests.
+void pmm_check(void) {
+    list_for_each(m, memory_map) {
+        spin_lock(&m->lock);
+
+        u64 num_free =
+            m->bitmap.size - bitmap_popcount(&m->bitmap, 0, m->bitmap.size);
+        kassert(num_free == m->num_free);
+
+        u64 num_dma_free = 0;
+        if (m == dma_zone.region) {
+            u64 num_dma_frames = dma_zone.end_idx - dma_zone.start_idx;
+            num_dma_free = num_dma_frames
+                - bitmap_popcount(&m->bitmap, dma_zone.start_idx,
+                                  dma_zone.end_idx);
+            kassert(num_dma_free == dma_zone.num_free);
+        }
+
+        u64 num_buddy_free = 0;
+        u64 base_pfn = m->base_addr / PAGE_SIZE;
+        for (u8 order = 0; order <= PMM_MAX_ORDER; ++order) {
+            const bitmap_t *free_blocks = m->buddy.free_blocks[order];
+            u64 num_blocks = bitmap_popcount(free_blocks, 0, free_blocks->size);
+            kassert(num_blocks == m->buddy.num_free[order]);
+
+            u64 i = bitmap_find_next_set(free_blocks, 0, free_blocks->size);
+            while (i < free_blocks->size) {
+                u64 pfn = ((m->buddy.start_pfn >> order) + i) << order;
+                kassert(pfn >= base_pfn
+                        && pfn + (1UL << order) <= base_pfn + m->bitmap.size);
+                u64 frame_idx = pfn - base_pfn;
+                kassert(bitmap_popcount(&m->bitmap, frame_idx,
+                                        frame_idx + (1UL << order))
+                        == 0);
+                for (u64 k = 0; k < 1UL << order; ++k) {
+                    kassert(!(m->pages[frame_idx + k].flags & PAGE_FLAG_DMA));
+                }
+
+                i = bitmap_find_next_set(free_blocks, i + 1, free_blocks->size);
+            }
+            num_buddy_free += num_blocks << order;
         }
+        kassert(num_buddy_free + num_dma_free == m->num_free);
+
+        spin_unlock(&m->lock);
+    }
+}
+
+// Allocate a frame from every memory region, the highest one included, and
+// clear it, so that the metadata and the memory of every region are known to
+// be reachable.
+void pmm_test_regions(void) {
+    list_for_each(m, memory_map) {
+        spin_lock(&m->lock);
+        u64 pfn = buddy_alloc(&m->buddy, 0);
+        if (pfn != BUDDY_ALLOC_ERROR) {
+            memory_map_mark_allocated(m, pfn, 0, true);
+        }
+        spin_unlock(&m->lock);
+
+        // Every frame of the region may be reserved
+        if (pfn == BUDDY_ALLOC_ERROR) {
+            continue;
+        }
+
+        zero_pool_clear_frame(pfn * PAGE_SIZE);
+        pmm_free_pages(pfn * PAGE_SIZE, 0);
+
+        log(LOG_LEVEL_DEBUG,
+            "PMM: Frame 0x%016lx of region 0x%016lx is usable\n",
+            pfn * PAGE_SIZE, m->base_addr);
+    }
+}
+
+// Check that pmm_alloc_contig never returns a frame that ends above the
+// address limit, when the limit is not the last byte of a frame. The first
+// frame of the DMA zone must be free.
+void pmm_test_dma_zone(void) {
+    if (dma_zone.region == NULL) {
+        return;
+    }
+
+    u64 zone_addr = dma_zone.region->base_addr + dma_zone.start_idx * PAGE_SIZE;
+
+    // The first frame ends 1 byte too high
+    u64 phys_addr = pmm_alloc_contig(1, PAGE_SIZE, zone_addr + PAGE_SIZE - 2);
+    if (phys_addr != PMM_ALLOC_ERROR) {
+        kpanic("pmm: DMA frame 0x%016lx is above the limit\n", phys_addr);
+    }
+
+    phys_addr = pmm_alloc_contig(1, PAGE_SIZE, zone_addr + PAGE_SIZE - 1);
+    if (phys_addr != zone_addr) {
+        kpanic("pmm: DMA frame 0x%016lx is not free\n", zone_addr);
+    }
+    pmm_free_contig(phys_addr, 1);
+
+    // Only the first frame fits under a limit in the middle of the second one
+    phys_addr = pmm_alloc_contig(2, PAGE_SIZE, zone_addr + PAGE_SIZE + 42);
+    if (phys_addr != PMM_ALLOC_ERROR) {
+        kpanic("pmm: DMA frames 0x%016lx are above the limit\n", phys_addr);
+    }
+}
+
+// Check that a frame freed by pmm_free, which now waits in a cache of the PMM,
+// cannot be freed again through pmm_free_batch
+void pmm_test_free_cached(void) {
+    u64 phys_addr = pmm_alloc();
+    if (phys_addr == PMM_ALLOC_ERROR) {
+        kpanic("pmm: No frame left to test\n");
+    }
+    pmm_free(phys_addr);
+
+    memory_map_t *m = memory_map_find(phys_addr);
+    if (memory_map_free_run(m, phys_addr, 1, 1)) {
+        kpanic("pmm: Cached frame 0x%016lx was freed again\n", phys_addr);
+    }
+
+    const page_t *page = memory_map_page(m, phys_addr);
+    if (!(page->flags & PAGE_FLAG_HEAD) || page->refcount != 0
+        || !bitmap_test(&m->bitmap, (phys_addr - m->base_addr) / PAGE_SIZE)) {
+        kpanic("pmm: Cached frame 0x%016lx was changed by a rejected free\n",
+               phys_addr);
+    }
+}
+
+// Return the descriptor of the page frame at the given physical address, or
+// NULL if the frame is not managed by the PMM.
+page_t *pmm_phys_to_page(u64 phys_addr) {
+    memory_map_t *m = memory_map_find(phys_addr);
+    if (m == NULL) {
+        return NULL;
+    }
+
+    return memory_map_page(m, phys_addr);
+}
+
+// Return the physical address of the allocated frame.
+// If unable to find a free frame, returns PMM_ALLOC_ERROR.
+u64 pmm_alloc(void) {
+    u64 phys_addr;
+    // Zeroed frames are still free frames
+    if (!magazine_alloc(&phys_addr) && !zero_pool_pop(&phys_addr)) {
+        return PMM_ALLOC_ERROR;
+    }
+    frame_hand_out(phys_addr);
+
+    return phys_addr;
+}
+
+// Return the physical address of a frame filled with zeros.
+// If unable to find a free frame, returns PMM_ALLOC_ERROR.
+u64 pmm_alloc_zeroed(void) {
+    u64 phys_addr;
+    if (zero_pool_pop(&phys_addr)) {
+        __atomic_fetch_add(&num_zeroed_hits, 1, __ATOMIC_RELAXED);
+        frame_hand_out(phys_addr);
+        return phys_addr;
+    }
+    __atomic_fetch_add(&num_zeroed_misses, 1, __ATOMIC_RELAXED);
+
+    // The idle refill did not keep up, clear a frame on the spot
+    phys_addr = pmm_alloc();
+    if (phys_addr != PMM_ALLOC_ERROR) {
+        zero_pool_clear_frame(phys_addr);
+    }
+
+    return phys_addr;
+}
+
+// Return the physical address of a frame of the given color, in
+// [0, pmm_num_colors()). Frames of different colors do not share sets of the
+// last level cache. Colored frames are freed with pmm_free.
+// If unable to find a free frame of that color, returns PMM_ALLOC_ERROR.
+u64 pmm_alloc_colored(u32 color) {
+    kassert(color < page_color_count());
+
+    if (page_color_count() == 1) {
+        return pmm_alloc();
+    }
+
+    u64 phys_addr;
+    if (!page_color_alloc(color, &phys_addr)) {
+        return PMM_ALLOC_ERROR;
+    }
+    kassert(page_color_of(phys_addr) == color);
+    frame_hand_out(phys_addr);
+
+    return phys_addr;
+}
+
+// Return the number of page colors, 1 if the cache geometry is unknown
+u32 pmm_num_colors(void) {
+    return page_color_count();
+}
+
+// Free the frame at the given physical address.
+// The frame goes to the dirty list of the zero pool if the pool lacks zeroed
+// frames, to the magazines of the current CPU otherwise.
+// Panic if invalid address is passed or if the frame is already free.
+void pmm_free(u64 phys_addr) {
+    kassert(phys_addr % PAGE_SIZE == 0);
+
+    frame_take_back(phys_addr);
+    if (!zero_pool_push_dirty(phys_addr)) {
+        magazine_free(phys_addr);
+    }
+}
+
+// Frames held by the caches of the PMM are free but allocated from the point
+// of view of the memory regions. Their refcount tells them apart: 1 while a
+// caller of pmm_alloc owns the frame, 0 while it waits in a cache.
+static void frame_hand_out(u64 phys_addr) {
+    page_t *page = pmm_phys_to_page(phys_addr);
+    kassert(page != NULL);
+    kassert(__atomic_load_n(&page->refcount, __ATOMIC_RELAXED) == 0);
+
+    __atomic_store_n(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// Panic unless the frame is a block of order 0 owned by a caller of pmm_alloc,
+// then mark it free. The refcount is exchanged atomically so that two CPUs
+// freeing the same frame cannot both succeed.
+static void frame_take_back(u64 phys_addr) {
+    page_t *page = pmm_phys_to_page(phys_addr);
+    if (page == NULL) {
+        kpanic("pmm: Cannot free frame at 0x%016lx which is outside of "
+               "mapped memory regions\n",
+               phys_addr);
+    }
+
+    u32 refcount = 1;
+    if (!(page->flags & PAGE_FLAG_HEAD) || page->order != 0
+        || (page->flags & PAGE_FLAG_DMA)
+        || !__atomic_compare_exchange_n(&page->refcount, &refcount, 0, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        kpanic("pmm: Invalid free of frame 0x%016lx\n", phys_addr);
+    }
+}
+
+// Allocate up to n frames from the memory regions, see pmm_alloc_batch.
+// Return the number of frames stored in frames.
+static u64 alloc_batch(u64 *frames, u64 n, bool drain_color_bins) {
+    u32 node = numa_cpu_node();
+
+    u64 num_allocated = memory_map_alloc_batch(frames, n, node);
+    if (num_allocated == n) {
+        return num_allocated;
+    }
+
+    // Frames parked in the depot, in color bins or on the dirty list of the
+    // zero pool may be enough to complete the batch
+    u64 num_drained = magazine_drain_depot() + zero_pool_drain_dirty();
+    if (drain_color_bins) {
+        num_drained += page_color_drain();
+    }
+    if (num_drained > 0) {
+        num_allocated += memory_map_alloc_batch(frames + num_allocated,
+                                                n - num_allocated, node);
     }
 
-    kpanic(
-        "pmm: Cannot free frame at 0x%016lx which is outside of mapped memory "
-        "regions\n",
-        phys_addr);
+    return num_allocated;
 }
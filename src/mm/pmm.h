@@ -1,18 +1,76 @@
 #ifndef AVOCADOS_PMM_H_
 #define AVOCADOS_PMM_H_
 
+#include "arch/paging.h"
 #include "attributes.h"
-#include "multiboot2.h"
+#include "buddy.h"
+#include "page.h"
 #include "types.h"
 
-// Pages in physical memory are called page frames. (Vol. 3A 2.1.5)
-// TODO: Assert that page frame size is a power of two
-#define PAGE_SIZE 4096U
-
 #define PMM_ALLOC_ERROR 0xffffffffffffffffUL
 
-void pmm_init(const struct multiboot_tag_mmap *mmap_tag);
+// pmm_alloc_pages can allocate up to 2^PMM_MAX_ORDER contiguous page frames
+#define PMM_MAX_ORDER BUDDY_MAX_ORDER
+
+typedef struct {
+    // Page frames managed by the PMM, reserved ones included
+    u64 total_frames;
+    // Page frames free in the memory regions: buddy allocators and DMA zone
+    u64 free_frames;
+    // Free page frames held in magazines, color bins and on the dirty list of
+    // the zero pool, counted as allocated by the regions
+    u64 cached_frames;
+    // Page frames in the zero pool, counted as allocated by the regions
+    u64 zeroed_frames;
+    // Free page frames of the DMA zone
+    u64 dma_free_frames;
+    // Number of free blocks of each order in the buddy allocators
+    u64 free_blocks[PMM_MAX_ORDER + 1];
+    // Fragmentation index of each order, in per mille: share of the free
+    // frames of the buddy allocators that cannot serve an allocation of that
+    // order
+    u32 fragmentation[PMM_MAX_ORDER + 1];
+    // Share of pmm_alloc and pmm_free calls served by the magazines of the
+    // CPU, in per mille
+    u32 alloc_hit_rate;
+    u32 free_hit_rate;
+    // Share of pmm_alloc_zeroed calls served by the zero pool, in per mille
+    u32 zeroed_hit_rate;
+} pmm_stats_t;
+
+void pmm_init(void);
 u64 pmm_alloc(void) __warn_unused_result;
+u64 pmm_alloc_zeroed(void) __warn_unused_result;
 void pmm_free(u64 addr);
 
+u64 pmm_alloc_colored(u32 color) __warn_unused_result;
+u32 pmm_num_colors(void);
+
+u64 pmm_alloc_pages(u8 order) __warn_unused_result;
+u64 pmm_alloc_pages_node(u8 order, u32 node) __warn_unused_result;
+void pmm_free_pages(u64 addr, u8 order);
+
+u64 pmm_alloc_batch(u64 *frames, u64 n) __warn_unused_result;
+u64 pmm_alloc_cache_batch(u64 *frames, u64 n,
+                          bool drain_color_bins) __warn_unused_result;
+void pmm_free_batch(const u64 *frames, u64 n);
+void pmm_free_cache_batch(const u64 *frames, u64 n);
+
+u64 pmm_alloc_contig(u64 num_frames, u64 align,
+                     u64 max_phys_addr) __warn_unused_result;
+void pmm_free_contig(u64 phys_addr, u64 num_frames);
+
+u64 pmm_free_reserved(u64 base, u64 end);
+
+page_t *pmm_phys_to_page(u64 phys_addr);
+
+void pmm_stats(pmm_stats_t *stats);
+void pmm_print_stats(void);
+
+void pmm_check(void);
+void pmm_test_regions(void);
+void pmm_test_dma_zone(void);
+void pmm_test_free_cached(void);
+void pmm_stress_test(u64 seed, u64 num_rounds);
+
 #endif /* ! AVOCADOS_PMM_H_ */
@@ -0,0 +1,179 @@
+/*
+ * Stress test of the PMM: random allocations and frees through every entry
+ * point, meant to be run by every CPU at the same time and followed by
+ * pmm_check once they are all done.
+ *
+ * Frames handed to the test are stamped through the prev link of the
+ * descriptor of their first frame, which belongs to the owner of the frames.
+ * A frame handed out twice is caught when one of its owners finds the stamp of
+ * the other one.
+ */
+
+#include <stddef.h>
+
+#include "libk/kassert.h"
+#include "libk/kprintf.h"
+#include "pmm.h"
+
+// Number of allocations held at the same time by a CPU
+#define STRESS_NUM_SLOTS 64
+// Largest number of frames allocated at once by pmm_alloc_batch
+#define STRESS_MAX_BATCH 8
+
+typedef enum {
+    STRESS_EMPTY,
+    STRESS_ALLOC,
+    STRESS_ALLOC_ZEROED,
+    STRESS_ALLOC_PAGES,
+    STRESS_ALLOC_BATCH,
+    STRESS_ALLOC_CONTIG,
+    STRESS_NUM_KINDS,
+} stress_kind_t;
+
+typedef struct {
+    stress_kind_t kind;
+    // Order of pmm_alloc_pages or number of frames of the other kinds
+    u64 size;
+    u64 frames[STRESS_MAX_BATCH];
+} stress_slot_t;
+
+static void stress_alloc(stress_slot_t *slot, u64 *state);
+static void stress_free(stress_slot_t *slot);
+static void stress_stamp(stress_slot_t *slot, u64 frame_addr);
+static void stress_unstamp(stress_slot_t *slot, u64 frame_addr);
+static u64 stress_random(u64 *state);
+
+// Run num_rounds random allocations or frees, then free everything.
+// Panic if a frame is handed out twice.
+void pmm_stress_test(u64 seed, u64 num_rounds) {
+    stress_slot_t slots[STRESS_NUM_SLOTS] = { 0 };
+    // xorshift must not start from 0
+    u64 state = seed | 1;
+
+    for (u64 round = 0; round < num_rounds; ++round) {
+        stress_slot_t *slot = &slots[stress_random(&state) % STRESS_NUM_SLOTS];
+        if (slot->kind == STRESS_EMPTY) {
+            stress_alloc(slot, &state);
+        } else {
+            stress_free(slot);
+        }
+    }
+
+    for (u64 i = 0; i < STRESS_NUM_SLOTS; ++i) {
+        if (slots[i].kind != STRESS_EMPTY) {
+            stress_free(&slots[i]);
+        }
+    }
+}
+
+// Fill the slot with an allocation of a random kind, leave it empty if the
+// allocation fails
+static void stress_alloc(stress_slot_t *slot, u64 *state) {
+    u64 r = stress_random(state);
+    stress_kind_t kind = (stress_kind_t)(1 + r % (STRESS_NUM_KINDS - 1));
+    r /= STRESS_NUM_KINDS - 1;
+
+    u64 phys_addr = PMM_ALLOC_ERROR;
+    slot->size = 1;
+    switch (kind) {
+    case STRESS_ALLOC:
+        phys_addr = pmm_alloc();
+        break;
+    case STRESS_ALLOC_ZEROED:
+        phys_addr = pmm_alloc_zeroed();
+        break;
+    case STRESS_ALLOC_PAGES:
+        slot->size = r % 4;
+        phys_addr = pmm_alloc_pages((u8)slot->size);
+        break;
+    case STRESS_ALLOC_BATCH:
+        slot->size = pmm_alloc_batch(slot->frames, 1 + r % STRESS_MAX_BATCH);
+        if (slot->size == 0) {
+            return;
+        }
+        break;
+    case STRESS_ALLOC_CONTIG:
+        slot->size = 1 + r % 4;
+        phys_addr = pmm_alloc_contig(slot->size, PAGE_SIZE << (r / 4 % 4),
+                                     PMM_ALLOC_ERROR);
+        break;
+    default:
+        kpanic("pmm_stress_test: Invalid allocation kind %u\n", kind);
+    }
+
+    if (kind != STRESS_ALLOC_BATCH) {
+        if (phys_addr == PMM_ALLOC_ERROR) {
+            return;
+        }
+        slot->frames[0] = phys_addr;
+    }
+
+    slot->kind = kind;
+    u64 num_stamps = kind == STRESS_ALLOC_BATCH ? slot->size : 1;
+    for (u64 i = 0; i < num_stamps; ++i) {
+        stress_stamp(slot, slot->frames[i]);
+    }
+}
+
+static void stress_free(stress_slot_t *slot) {
+    u64 num_stamps = slot->kind == STRESS_ALLOC_BATCH ? slot->size : 1;
+    for (u64 i = 0; i < num_stamps; ++i) {
+        stress_unstamp(slot, slot->frames[i]);
+    }
+
+    switch (slot->kind) {
+    case STRESS_ALLOC:
+    case STRESS_ALLOC_ZEROED:
+        pmm_free(slot->frames[0]);
+        break;
+    case STRESS_ALLOC_PAGES:
+        pmm_free_pages(slot->frames[0], (u8)slot->size);
+        break;
+    case STRESS_ALLOC_BATCH:
+        pmm_free_batch(slot->frames, slot->size);
+        break;
+    case STRESS_ALLOC_CONTIG:
+        pmm_free_contig(slot->frames[0], slot->size);
+        break;
+    default:
+        kpanic("pmm_stress_test: Invalid allocation kind %u\n", slot->kind);
+    }
+
+    slot->kind = STRESS_EMPTY;
+}
+
+// The slot lives on the stack of the CPU running the test, so its address is
+// a stamp unique to both the CPU and the slot
+static void stress_stamp(stress_slot_t *slot, u64 frame_addr) {
+    page_t *page = pmm_phys_to_page(frame_addr);
+    kassert(page != NULL);
+
+    page_t *prev = __atomic_exchange_n(&page->prev, (page_t *)slot,
+                                       __ATOMIC_RELAXED);
+    if (prev != NULL) {
+        kpanic("pmm_stress_test: Frame 0x%016lx handed out twice\n",
+               frame_addr);
+    }
+}
+
+static void stress_unstamp(stress_slot_t *slot, u64 frame_addr) {
+    page_t *page = pmm_phys_to_page(frame_addr);
+
+    page_t *prev = __atomic_exchange_n(&page->prev, NULL, __ATOMIC_RELAXED);
+    if (prev != (page_t *)slot) {
+        kpanic("pmm_stress_test: Frame 0x%016lx handed out twice\n",
+               frame_addr);
+    }
+}
+
+// xorshift64 (Marsaglia)
+static u64 stress_random(u64 *state) {
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
@@ -1,7 +1,8 @@
+#define LOG_SUBSYSTEM LOG_SUBSYSTEM_VMM
+
 #include "arch/paging.h"
 #include "libk/kassert.h"
 #include "libk/log.h"
-#include "libk/mem.h"
 #include "mm/pmm.h"
 #include "mm/vmm.h"
 
@@ -63,7 +64,7 @@ u64 vmm_alloc(u64 addr, u32 flags) {
     pte_t *pte = get_pte(addr);
     kassert(!pte->present);
 
-    u64 page_phys_addr = pmm_alloc();
+    u64 page_phys_addr = pmm_alloc_zeroed();
     if (page_phys_addr == PMM_ALLOC_ERROR) {
         goto failed_page_alloc;
     }
@@ -75,7 +76,6 @@ u64 vmm_alloc(u64 addr, u32 flags) {
         .addr = BIT_RANGE(page_phys_addr, 12, 51),
         .xd = ((flags & VMM_ALLOC_EXEC) ? 0U : 1U) & 1,
     };
-    memset((u8 *)addr, 0, PAGE_SIZE);
 
     return addr;
 
@@ -135,7 +135,8 @@ static u64 vmm_alloc_paging_structs(u64 addr) {
     if (!pml4e->present) {
         log(LOG_LEVEL_DEBUG, "VMM: pml4e not present\n");
 
-        u64 pdpt_phys_addr = pmm_alloc();
+        // A zeroed table has no present entry
+        u64 pdpt_phys_addr = pmm_alloc_zeroed();
         if (pdpt_phys_addr == PMM_ALLOC_ERROR) {
             goto failed_pdpt_alloc;
         }
@@ -147,16 +148,14 @@ static u64 vmm_alloc_paging_structs(u64 addr) {
             .addr = BIT_RANGE(pdpt_phys_addr, 12, 51),
             .xd = 0,
         };
-
-        // Zero initialize the table so that present bits are 0
-        memset((u8 *)ALIGN_DOWN((u64)get_pdpte(addr), PAGE_SIZE), 0, PAGE_SIZE);
     }
 
     pdpte_t *pdpte = get_pdpte(addr);
     if (!pdpte->present) {
         log(LOG_LEVEL_DEBUG, "VMM: pdpte not present\n");
 
-        u64 pdt_phys_addr = pmm_alloc();
+        // A zeroed table has no present entry
+        u64 pdt_phys_addr = pmm_alloc_zeroed();
         if (pdt_phys_addr == PMM_ALLOC_ERROR) {
             goto failed_pdt_alloc;
         }
@@ -168,16 +167,14 @@ static u64 vmm_alloc_paging_structs(u64 addr) {
             .addr = BIT_RANGE(pdt_phys_addr, 12, 51),
             .xd = 0,
         };
-
-        // Zero initialize the table so that present bits are 0
-        memset((u8 *)ALIGN_DOWN((u64)get_pde(addr), PAGE_SIZE), 0, PAGE_SIZE);
     }
 
     pde_t *pde = get_pde(addr);
     if (!pde->present) {
         log(LOG_LEVEL_DEBUG, "VMM: pde not present\n");
 
-        u64 pt_phys_addr = pmm_alloc();
+        // A zeroed table has no present entry
+        u64 pt_phys_addr = pmm_alloc_zeroed();
         if (pt_phys_addr == PMM_ALLOC_ERROR) {
             goto failed_pt_alloc;
         }
@@ -189,9 +186,6 @@ static u64 vmm_alloc_paging_structs(u64 addr) {
             .addr = BIT_RANGE(pt_phys_addr, 12, 51),
             .xd = 0,
         };
-
-        // Zero initialize the table so that present bits are 0
-        memset((u8 *)ALIGN_DOWN((u64)get_pte(addr), PAGE_SIZE), 0, PAGE_SIZE);
     }
 
     return 0;
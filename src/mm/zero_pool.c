@@ -0,0 +1,211 @@
+/*
+ * Pool of page frames that are known to be filled with zeros.
+ *
+ * Free frames are dirty: they go back to the magazines and the buddy
+ * allocators with whatever content they had. While the pool lacks zeroed
+ * frames, pmm_free parks freed frames on the dirty list of the pool instead.
+ * zero_pool_refill clears the dirty frames first, then frames of the buddy
+ * allocators, and keeps them here so that pmm_alloc_zeroed does not pay for
+ * the clearing. The pool is filled once at boot, then refilled by the idle
+ * loop with interrupts enabled.
+ *
+ * A frame is cleared through a window: a virtual page per CPU whose page table
+ * entry is pointed at the frame. The page table of the windows lives in the
+ * kernel image, which is identity mapped, so that no frame has to be allocated
+ * to set it up.
+ *
+ * The pool is shared by all CPUs and locked only to push or pop frames, never
+ * while a frame is cleared.
+ */
+
+#include "arch/instr.h"
+#include "arch/paging.h"
+#include "arch/percpu.h"
+#include "arch/spinlock.h"
+#include "libk/kassert.h"
+#include "libk/mem.h"
+#include "pmm.h"
+#include "utils.h"
+#include "zero_pool.h"
+
+// The 2MiB right below the PMM metadata, whose page directory pointer table
+// entry is set up at boot
+#define ZERO_POOL_WINDOW_ADDR 0x000000000fe00000
+
+// Number of frames cleared between two checks of the pool size
+#define ZERO_POOL_REFILL_BATCH 16
+
+typedef struct {
+    spinlock_t lock;
+    u64 count;
+    u64 frame_addrs[ZERO_POOL_SIZE];
+    // Freed frames waiting to be cleared. There are never more zeroed and
+    // dirty frames than ZERO_POOL_SIZE.
+    u64 num_dirty;
+    u64 dirty_addrs[ZERO_POOL_SIZE];
+} zero_pool_t;
+
+static u64 zero_pool_take_dirty(u64 *frames, u64 n);
+
+static pt_t window_pt;
+static zero_pool_t zero_pool;
+
+void zero_pool_init(void) {
+    _Static_assert(MAX_CPUS <= PAGING_STRUCT_SIZE / sizeof(pte_t));
+    kassert(ZERO_POOL_WINDOW_ADDR % (PAGE_SIZE * 512) == 0);
+    kassert(get_pml4e(ZERO_POOL_WINDOW_ADDR)->present);
+    kassert(get_pdpte(ZERO_POOL_WINDOW_ADDR)->present);
+
+    pde_t *pde = get_pde(ZERO_POOL_WINDOW_ADDR);
+    kassert(!pde->present);
+
+    // window_pt is in bss, so every entry is already not present
+    *pde = (pde_t){
+        .present = 1,
+        .rw = 1,
+        .us = 0,
+        .addr = BIT_RANGE((u64)&window_pt, 12, 51),
+        .xd = 1,
+    };
+
+    zero_pool.lock = SPINLOCK_INIT;
+    zero_pool.count = 0;
+    zero_pool.num_dirty = 0;
+}
+
+// Take a zeroed frame from the pool.
+// Return false if the pool is empty.
+bool zero_pool_pop(u64 *frame_addr) {
+    spin_lock(&zero_pool.lock);
+    if (zero_pool.count == 0) {
+        spin_unlock(&zero_pool.lock);
+        return false;
+    }
+
+    zero_pool.count -= 1;
+    *frame_addr = zero_pool.frame_addrs[zero_pool.count];
+    spin_unlock(&zero_pool.lock);
+
+    return true;
+}
+
+// Return the number of zeroed frames in the pool, which may already be stale
+u64 zero_pool_count(void) {
+    return __atomic_load_n(&zero_pool.count, __ATOMIC_RELAXED);
+}
+
+// Return the number of freed frames waiting to be cleared, which may already
+// be stale
+u64 zero_pool_num_dirty(void) {
+    return __atomic_load_n(&zero_pool.num_dirty, __ATOMIC_RELAXED);
+}
+
+// Keep a freed frame on the dirty list if the pool lacks zeroed frames.
+// Return false if the frame is not needed and must be freed as usual.
+bool zero_pool_push_dirty(u64 frame_addr) {
+    kassert(frame_addr % PAGE_SIZE == 0);
+
+    // Once the pool is full, frees do not touch its lock
+    if (zero_pool_count() + zero_pool_num_dirty() >= ZERO_POOL_SIZE) {
+        return false;
+    }
+
+    spin_lock(&zero_pool.lock);
+    if (zero_pool.count + zero_pool.num_dirty >= ZERO_POOL_SIZE) {
+        spin_unlock(&zero_pool.lock);
+        return false;
+    }
+
+    zero_pool.dirty_addrs[zero_pool.num_dirty] = frame_addr;
+    zero_pool.num_dirty += 1;
+    spin_unlock(&zero_pool.lock);
+
+    return true;
+}
+
+// Give every frame of the dirty list back to the buddy allocators.
+// Return the number of frames freed.
+u64 zero_pool_drain_dirty(void) {
+    u64 frames[ZERO_POOL_SIZE];
+
+    u64 n = zero_pool_take_dirty(frames, ZERO_POOL_SIZE);
+    pmm_free_cache_batch(frames, n);
+
+    return n;
+}
+
+// Clear dirty frames until the pool is full or no free frame is left. Frames
+// of the dirty list are used before the ones of the buddy allocators.
+void zero_pool_refill(void) {
+    u64 frames[ZERO_POOL_REFILL_BATCH];
+
+    u64 count;
+    while ((count = zero_pool_count()) < ZERO_POOL_SIZE) {
+        u64 n = ZERO_POOL_SIZE - count;
+        if (n > ZERO_POOL_REFILL_BATCH) {
+            n = ZERO_POOL_REFILL_BATCH;
+        }
+
+        u64 num_dirty = zero_pool_take_dirty(frames, n);
+        n = num_dirty
+            + pmm_alloc_cache_batch(&frames[num_dirty], n - num_dirty, true);
+        if (n == 0) {
+            return;
+        }
+
+        // Only push frames once they are cleared
+        for (u64 i = 0; i < n; ++i) {
+            zero_pool_clear_frame(frames[i]);
+        }
+
+        // Other CPUs may have filled the pool in the meantime
+        spin_lock(&zero_pool.lock);
+        u64 num_pushed = 0;
+        while (num_pushed < n && zero_pool.count < ZERO_POOL_SIZE) {
+            zero_pool.frame_addrs[zero_pool.count] = frames[num_pushed];
+            zero_pool.count += 1;
+            num_pushed += 1;
+        }
+        spin_unlock(&zero_pool.lock);
+
+        if (num_pushed < n) {
+            pmm_free_cache_batch(&frames[num_pushed], n - num_pushed);
+            return;
+        }
+    }
+}
+
+// Move up to n frames of the dirty list to frames.
+// Return the number of frames moved.
+static u64 zero_pool_take_dirty(u64 *frames, u64 n) {
+    spin_lock(&zero_pool.lock);
+    if (n > zero_pool.num_dirty) {
+        n = zero_pool.num_dirty;
+    }
+    zero_pool.num_dirty -= n;
+    memcpy((u8 *)frames,
+           (const u8 *)&zero_pool.dirty_addrs[zero_pool.num_dirty],
+           n * sizeof(u64));
+    spin_unlock(&zero_pool.lock);
+
+    return n;
+}
+
+// Fill the frame with zeros through the window of the current CPU
+void zero_pool_clear_frame(u64 frame_addr) {
+    kassert(frame_addr % PAGE_SIZE == 0);
+
+    u32 id = cpu_id();
+    u64 window_addr = ZERO_POOL_WINDOW_ADDR + id * PAGE_SIZE;
+
+    window_pt[id] = (pte_t){
+        .present = 1,
+        .rw = 1,
+        .us = 0,
+        .addr = BIT_RANGE(frame_addr, 12, 51),
+        .xd = 1,
+    };
+    invlpg(window_addr);
+
+    clear_page((void *)window_addr);
+}
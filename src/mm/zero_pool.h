@@ -0,0 +1,21 @@
+#ifndef AVOCADOS_ZERO_POOL_H_
+#define AVOCADOS_ZERO_POOL_H_
+
+#include <stdbool.h>
+
+#include "types.h"
+
+// Number of zeroed page frames kept in the pool
+#define ZERO_POOL_SIZE 64
+
+void zero_pool_init(void);
+
+bool zero_pool_pop(u64 *frame_addr);
+void zero_pool_refill(void);
+void zero_pool_clear_frame(u64 frame_addr);
+u64 zero_pool_count(void);
+bool zero_pool_push_dirty(u64 frame_addr);
+u64 zero_pool_drain_dirty(void);
+u64 zero_pool_num_dirty(void);
+
+#endif /* ! AVOCADOS_ZERO_POOL_H_ */
@@ -20,8 +20,8 @@ typedef struct {
     void test_name(void);                                                      \
                                                                                \
     static __attribute__((used, section(".test_descriptors")))                 \
-    const test_descriptor_t test_descriptor = { .name = #test_name,            \
-                                                .test = test_name };           \
+    const test_descriptor_t test_name##_descriptor = { .name = #test_name,     \
+                                                       .test = test_name };    \
                                                                                \
     __attribute__((section(".test." #test_name))) void test_name(void)
 
@@ -148,6 +148,16 @@ typedef struct {
     source_location_t loc;
 } pointer_overflow_data_t;
 
+typedef struct {
+    source_location_t loc;
+    unsigned char kind;
+} invalid_builtin_data_t;
+
+typedef struct {
+    source_location_t loc;
+    const type_descriptor_t *type;
+} invalid_value_data_t;
+
 struct nunnull_arg_data {
     source_location_t loc;
     source_location_t attr_loc;
@@ -348,6 +358,21 @@ void __ubsan_handle_pointer_overflow(const pointer_overflow_data_t *data,
     }
 }
 
+void __ubsan_handle_invalid_builtin(const invalid_builtin_data_t *data) {
+    PRINT_UB_LOCATION("invalid_builtin", data->loc);
+
+    kprintf("passing zero to %s, which is not a valid argument\n",
+            data->kind == 0 ? "ctz()" : "clz()");
+}
+
+void __ubsan_handle_load_invalid_value(const invalid_value_data_t *data,
+                                       void *val) {
+    PRINT_UB_LOCATION("load_invalid_value", data->loc);
+
+    kprintf("load of value %lu, which is not a valid value for type %s\n",
+            (u64)val, data->type->type_name);
+}
+
 void __ubsan_handle_nonnull_arg(__unused const pointer_overflow_data_t *data) {
     kprintf("ubsan: nunnull_arg\n");
 }
@@ -0,0 +1,333 @@
+/*
+ * Host decoder of the binary logs of the kernel, see src/libk/binlog.h. It
+ * reads the serial output of a kernel built with LOG_BINARY=1, copies the
+ * text as is and replaces each frame of records by the messages they stand
+ * for. Format strings, and the strings given to %s, are read from the
+ * allocated sections of the kernel ELF at the addresses recorded.
+ *
+ * Timestamps are TSC values, printed relative to the first record, in
+ * microseconds if the TSC frequency is given.
+ */
+
+#define _GNU_SOURCE
+
+#include <elf.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libk/binlog.h"
+#include "types.h"
+
+typedef struct {
+    u64 addr;
+    u64 size;
+    const u8 *data;
+} section_t;
+
+static u8 *read_file(FILE *file, u64 *size);
+static bool load_sections(const u8 *elf, u64 elf_size);
+static const char *resolve_string(u64 addr);
+static void decode_frame(const u8 *records, u64 size);
+static void print_record(const binlog_record_t *record, const u64 *args);
+
+static const char *const level_prefix[] = {
+    [LOG_LEVEL_NONE] = "[NONE] ",   [LOG_LEVEL_ERROR] = "[ERROR] ",
+    [LOG_LEVEL_WARN] = "[WARN] ",   [LOG_LEVEL_INFO] = "[INFO] ",
+    [LOG_LEVEL_DEBUG] = "[DEBUG] ",
+};
+
+static section_t *sections;
+static u64 num_sections;
+static double tsc_mhz = 0;
+static bool has_first_timestamp = false;
+static u64 first_timestamp;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-f MHZ] KERNEL_ELF [SERIAL_OUTPUT]\n"
+            "  -f  TSC frequency, to print timestamps in microseconds\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "f:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            tsc_mhz = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *elf_file = fopen(argv[optind], "rb");
+    if (elf_file == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    u64 elf_size;
+    u8 *elf = read_file(elf_file, &elf_size);
+    fclose(elf_file);
+    if (elf == NULL || !load_sections(elf, elf_size)) {
+        fprintf(stderr, "%s: Not a 64-bit ELF\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *input = stdin;
+    if (optind == argc - 2) {
+        input = fopen(argv[optind + 1], "rb");
+        if (input == NULL) {
+            perror(argv[optind + 1]);
+            return EXIT_FAILURE;
+        }
+    }
+    u64 input_size;
+    u8 *data = read_file(input, &input_size);
+    if (data == NULL) {
+        perror("read");
+        return EXIT_FAILURE;
+    }
+
+    u64 i = 0;
+    while (i < input_size) {
+        const u8 *magic = memmem(data + i, input_size - i, BINLOG_MAGIC,
+                                 BINLOG_MAGIC_SIZE);
+        u64 text_end = magic == NULL ? input_size : (u64)(magic - data);
+        fwrite(data + i, 1, text_end - i, stdout);
+        i = text_end;
+        if (magic == NULL) {
+            break;
+        }
+
+        binlog_frame_t frame;
+        u64 records = i + BINLOG_MAGIC_SIZE + sizeof(frame);
+        if (records > input_size) {
+            fprintf(stderr, "Truncated frame header at offset %lu\n", i);
+            break;
+        }
+        memcpy(&frame, data + i + BINLOG_MAGIC_SIZE, sizeof(frame));
+        if (records + frame.size > input_size) {
+            fprintf(stderr, "Truncated frame at offset %lu\n", i);
+            break;
+        }
+
+        decode_frame(data + records, frame.size);
+        i = records + frame.size;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static u8 *read_file(FILE *file, u64 *size) {
+    u64 capacity = 1 << 16;
+    u8 *data = malloc(capacity);
+
+    *size = 0;
+    for (;;) {
+        *size += fread(data + *size, 1, capacity - *size, file);
+        if (*size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        data = realloc(data, capacity);
+    }
+
+    return ferror(file) ? NULL : data;
+}
+
+// Keep the sections loaded in memory, which hold every string the kernel can
+// log
+static bool load_sections(const u8 *elf, u64 elf_size) {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)elf;
+    if (elf_size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+        || ehdr->e_shoff + (u64)ehdr->e_shnum * sizeof(Elf64_Shdr) > elf_size) {
+        return false;
+    }
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(elf + ehdr->e_shoff);
+    sections = calloc(ehdr->e_shnum, sizeof(section_t));
+    for (u64 i = 0; i < ehdr->e_shnum; ++i) {
+        const Elf64_Shdr *shdr = &shdrs[i];
+        if (!(shdr->sh_flags & SHF_ALLOC) || shdr->sh_type != SHT_PROGBITS
+            || shdr->sh_offset + shdr->sh_size > elf_size) {
+            continue;
+        }
+
+        sections[num_sections].addr = shdr->sh_addr;
+        sections[num_sections].size = shdr->sh_size;
+        sections[num_sections].data = elf + shdr->sh_offset;
+        num_sections += 1;
+    }
+
+    return true;
+}
+
+// Return the null terminated string at addr in the kernel, or NULL if it is
+// not in the ELF
+static const char *resolve_string(u64 addr) {
+    for (u64 i = 0; i < num_sections; ++i) {
+        const section_t *section = &sections[i];
+        if (addr < section->addr || addr >= section->addr + section->size) {
+            continue;
+        }
+
+        u64 offset = addr - section->addr;
+        if (memchr(section->data + offset, '\0', section->size - offset)
+            == NULL) {
+            return NULL;
+        }
+
+        return (const char *)section->data + offset;
+    }
+
+    return NULL;
+}
+
+static void decode_frame(const u8 *records, u64 size) {
+    u64 offset = 0;
+    while (offset + sizeof(binlog_record_t) <= size) {
+        binlog_record_t record;
+        memcpy(&record, records + offset, sizeof(record));
+        offset += sizeof(record);
+
+        u64 args_size = record.num_args * sizeof(u64);
+        if (record.num_args > BINLOG_MAX_ARGS || offset + args_size > size) {
+            fprintf(stderr, "Corrupted record\n");
+            return;
+        }
+
+        u64 args[BINLOG_MAX_ARGS];
+        memcpy(args, records + offset, args_size);
+        offset += args_size;
+
+        print_record(&record, args);
+    }
+}
+
+// Format the record like kprintf would: each conversion of the kernel format
+// is handed to printf with an argument of the type it expects
+static void print_record(const binlog_record_t *record, const u64 *args) {
+    if (!has_first_timestamp) {
+        first_timestamp = record->timestamp;
+        has_first_timestamp = true;
+    }
+    u64 ticks = record->timestamp - first_timestamp;
+    if (tsc_mhz > 0) {
+        printf("[%12.3f] ", (double)ticks / tsc_mhz);
+    } else {
+        printf("[%12lu] ", ticks);
+    }
+    printf("CPU%u %s", record->cpu_id,
+           record->level <= LOG_LEVEL_DEBUG ? level_prefix[record->level]
+                                            : "[?] ");
+
+    const char *fmt = resolve_string(record->fmt_addr);
+    if (fmt == NULL) {
+        printf("<format at 0x%016lx>\n", record->fmt_addr);
+        return;
+    }
+
+    u64 arg_idx = 0;
+#define NEXT_ARG() (arg_idx < record->num_args ? args[arg_idx++] : 0)
+    for (const char *c = fmt; *c != '\0'; ++c) {
+        if (*c != '%') {
+            putchar(*c);
+            continue;
+        }
+
+        // Rebuild the conversion with the values of * and a ll modifier
+        char spec[64] = "%";
+        u64 len = 1;
+        c += 1;
+        while (*c == '-' || *c == '0') {
+            spec[len++] = *c++;
+        }
+        if (*c == '*') {
+            len += (u64)snprintf(spec + len, sizeof(spec) - len, "%d",
+                                 (int)NEXT_ARG());
+            c += 1;
+        }
+        while (*c >= '0' && *c <= '9' && len < 32) {
+            spec[len++] = *c++;
+        }
+        if (*c == '.') {
+            spec[len++] = *c++;
+            if (*c == '*') {
+                len += (u64)snprintf(spec + len, sizeof(spec) - len, "%d",
+                                     (int)NEXT_ARG());
+                c += 1;
+            }
+            while (*c >= '0' && *c <= '9' && len < 48) {
+                spec[len++] = *c++;
+            }
+        }
+        bool is_long = false;
+        while (*c == 'h' || *c == 'l') {
+            is_long = is_long || *c == 'l';
+            c += 1;
+        }
+        if (*c == '\0') {
+            break;
+        }
+
+        u64 arg;
+        switch (*c) {
+        case 'd':
+        case 'i':
+            arg = NEXT_ARG();
+            memcpy(spec + len, "lld", 4);
+            printf(spec, is_long ? (long long)arg : (long long)(int)arg);
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            arg = NEXT_ARG();
+            spec[len] = 'l';
+            spec[len + 1] = 'l';
+            spec[len + 2] = *c;
+            spec[len + 3] = '\0';
+            printf(spec, is_long ? (unsigned long long)arg
+                                 : (unsigned long long)(u32)arg);
+            break;
+        case 'c':
+            memcpy(spec + len, "c", 2);
+            printf(spec, (int)(char)NEXT_ARG());
+            break;
+        case 's': {
+            arg = NEXT_ARG();
+            const char *s = resolve_string(arg);
+            char unresolved[32];
+            if (s == NULL) {
+                snprintf(unresolved, sizeof(unresolved), "<0x%016lx>", arg);
+                s = unresolved;
+            }
+            memcpy(spec + len, "s", 2);
+            printf(spec, s);
+            break;
+        }
+        case 'p': {
+            // kprintf pads 0x and the hexadecimal digits as a whole
+            char ptr[32];
+            snprintf(ptr, sizeof(ptr), "0x%lx", NEXT_ARG());
+            memcpy(spec + len, "s", 2);
+            printf(spec, ptr);
+            break;
+        }
+        default:
+            putchar(*c);
+            break;
+        }
+    }
+#undef NEXT_ARG
+}